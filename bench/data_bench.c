@@ -0,0 +1,191 @@
+#include <criterion/criterion.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <time.h>
+
+#include "debug.h"
+#include "data.h"
+#include "data_funcs.h"
+#include "transaction.h"
+#include "excludes.h"
+
+/*
+ * Benchmarks for blobs, keys and reference counts.  They are built by
+ * "make bench", apart from the unit tests, and print their numbers rather
+ * than check anything.
+ */
+
+static void init() {
+    trans_init();
+}
+
+/*
+ * Heap bytes taken by blobs of various sizes.
+ */
+Test(data_bench, blob_memory, .init = init, .timeout = 10) {
+#ifdef NO_DATA
+    cr_assert_fail("Data module was not implemented");
+#endif
+    static BLOB *blobs[100000];
+    size_t sizes[] = { 8, 64, 200, 1024 };
+    char content[1024];
+    memset(content, 'v', sizeof(content));
+    for(int s = 0; s < 4; s++) {
+	struct mallinfo2 before = mallinfo2();
+	for(int i = 0; i < 100000; i++)
+	    blobs[i] = blob_create(content, sizes[s]);
+	struct mallinfo2 after = mallinfo2();
+	fprintf(stderr, "Blob of %4lu bytes: %.1f heap bytes\n", sizes[s],
+		(double)(after.uordblks - before.uordblks) / 100000);
+	for(int i = 0; i < 100000; i++)
+	    blob_unref(blobs[i], "");
+    }
+}
+
+/* Reference count operations per thread. */
+#define NBENCHOPS (1000000)
+
+struct ref_bench_args {
+    BLOB *bp;
+    TRANSACTION *tp;
+    pthread_mutex_t *mutex;       // If not NULL, count under this mutex instead.
+    int count;
+};
+
+static void *ref_bench_thread(void *arg) {
+    struct ref_bench_args *ap = arg;
+    for(int i = 0; i < NBENCHOPS / 2; i++) {
+	if(ap->mutex != NULL) {
+	    pthread_mutex_lock(ap->mutex);
+	    ap->count++;
+	    pthread_mutex_unlock(ap->mutex);
+	    pthread_mutex_lock(ap->mutex);
+	    ap->count--;
+	    pthread_mutex_unlock(ap->mutex);
+	} else if(ap->tp != NULL) {
+	    trans_ref(ap->tp, "");
+	    trans_unref(ap->tp, "");
+	} else {
+	    blob_ref(ap->bp, "");
+	    blob_unref(ap->bp, "");
+	}
+    }
+    return NULL;
+}
+
+/*
+ * Reference count operations per second on a single blob and a single
+ * transaction shared by a number of threads, against the same operations
+ * done under a mutex as the reference counts used to be.
+ */
+Test(data_bench, ref_unref, .init = init, .timeout = 60) {
+#ifdef NO_DATA
+    cr_assert_fail("Data module was not implemented");
+#endif
+    static char *names[] = { "mutex", "blob", "transaction" };
+    int nthreads[] = { 1, 4, 16 };
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    for(int k = 0; k < 3; k++) {
+	for(int t = 0; t < 3; t++) {
+	    struct ref_bench_args args = { 0 };
+	    if(k == 0)
+		args.mutex = &mutex;
+	    else if(k == 1)
+		args.bp = blob_create("ABC", 3);
+	    else
+		args.tp = trans_create();
+	    pthread_t tids[16];
+	    struct timespec start, end;
+	    clock_gettime(CLOCK_MONOTONIC, &start);
+	    for(int i = 0; i < nthreads[t]; i++)
+		pthread_create(&tids[i], NULL, ref_bench_thread, &args);
+	    for(int i = 0; i < nthreads[t]; i++)
+		pthread_join(tids[i], NULL);
+	    clock_gettime(CLOCK_MONOTONIC, &end);
+	    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	    fprintf(stderr, "ref/unref %-11s %2d threads: %12.0f ops/sec\n", names[k], nthreads[t],
+		    (double)nthreads[t] * NBENCHOPS / secs);
+	    if(k == 1) {
+		cr_assert_eq(args.bp->refcnt, 1, "Final blob refcount is %d, not 1", args.bp->refcnt);
+		blob_unref(args.bp, "");
+	    } else if(k == 2) {
+		cr_assert_eq(args.tp->refcnt, 1, "Final transaction refcount is %d, not 1",
+			     args.tp->refcnt);
+		trans_commit(args.tp);
+	    }
+	}
+    }
+}
+
+/*
+ * The byte-at-a-time hash that blob_hash() used to compute, for comparison.
+ */
+static uint64_t djb2(const char *p, size_t len, uint64_t seed) {
+    int hash = seed;
+    for(size_t i = 0; i < len; i++)
+	hash = ((hash << 5) + hash) + p[i];
+    return hash;
+}
+
+/*
+ * Hash quality and throughput by key length.  Quality is measured on keys
+ * that differ in one byte, as counters and sequence numbers do: the
+ * chi-square of their distribution over 1024 buckets (about 1023 for a
+ * uniform hash), and the average number of output bits that change when
+ * a single input bit is flipped (ideally 32 of 64).  The time taken by
+ * the old byte-at-a-time hash is shown alongside.
+ */
+Test(data_bench, hash, .init = init, .timeout = 60) {
+#ifdef NO_DATA
+    cr_assert_fail("Data module was not implemented");
+#endif
+    size_t lens[] = { 8, 16, 32, 64, 256, 1024, 4096 };
+    static char buf[4096];
+    int nkeys = 1 << 16;
+    for(int l = 0; l < 7; l++) {
+	size_t len = lens[l];
+	memset(buf, 'k', len);
+	static int buckets[1024];
+	memset(buckets, 0, sizeof(buckets));
+	for(int i = 0; i < nkeys; i++) {
+	    memcpy(buf + len - 2, &i, 2);
+	    buckets[hash_bytes(buf, len, BLOB_HASH_SEED) & 1023]++;
+	}
+	double expected = nkeys / 1024.0, chi2 = 0;
+	for(int b = 0; b < 1024; b++)
+	    chi2 += (buckets[b] - expected) * (buckets[b] - expected) / expected;
+	long flips = 0, trials = 0;
+	for(size_t bit = 0; bit < 8 * len && bit < 2048; bit++) {
+	    uint64_t h1 = hash_bytes(buf, len, BLOB_HASH_SEED);
+	    buf[bit / 8] ^= 1 << (bit % 8);
+	    uint64_t h2 = hash_bytes(buf, len, BLOB_HASH_SEED);
+	    buf[bit / 8] ^= 1 << (bit % 8);
+	    flips += __builtin_popcountll(h1 ^ h2);
+	    trials++;
+	}
+	long iters = (64L << 20) / len;
+	uint64_t sink = 0;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(long i = 0; i < iters; i++) {
+	    buf[0] = i;
+	    sink += hash_bytes(buf, len, sink);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(long i = 0; i < iters; i++) {
+	    buf[0] = i;
+	    sink += djb2(buf, len, sink);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double old_secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "hash %4lu bytes: chi2 %7.1f, %.1f bits flipped, %6.1f ns/hash, %5.2f GB/s "
+		"(byte-at-a-time %7.1f ns/hash)%s\n",
+		len, chi2, (double)flips / trials, secs * 1e9 / iters, iters * len / secs / 1e9,
+		old_secs * 1e9 / iters, sink == 1 ? " " : "");
+    }
+}
@@ -0,0 +1,235 @@
+#include <criterion/criterion.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+
+#include "debug.h"
+#include "store.h"
+#include "store_funcs.h"
+#include "excludes.h"
+
+/*
+ * Benchmarks for the store.  They are built by "make bench", apart from the
+ * unit tests, and print their numbers rather than check anything.
+ */
+
+/* Number of keys each thread works on. */
+#define NKEYS (100)
+
+/*
+ * Make a key from content -- to avoid blob ref count annoyance.
+ */
+static KEY *make_key(char *content, size_t size) {
+    return(key_create(blob_create(content, size)));
+}
+
+/*
+ * Thread for the contention benchmark: run transactions that each get and
+ * put one key private to the thread, so that threads never touch the same
+ * keys and any slowdown is due to contention inside the store.
+ */
+struct contention_args {
+    int index;
+    int iters;
+    pthread_t tid;
+};
+
+static void *contention_thread(void *arg) {
+    struct contention_args *ap = arg;
+    char content[20];
+    for(int i = 0; i < ap->iters; i++) {
+	snprintf(content, sizeof(content), "%4d:%6d", ap->index, i % NKEYS);
+	TRANSACTION *tp = trans_create();
+	BLOB *value = NULL;
+	store_get(tp, make_key(content, strlen(content)), &value);
+	if(value != NULL)
+	    blob_unref(value, "");
+	store_put(tp, make_key(content, strlen(content)), blob_create(content, strlen(content)));
+	trans_commit(tp);
+    }
+    return NULL;
+}
+
+/*
+ * Measure store_get/store_put throughput for an increasing number of threads
+ * working on disjoint keys.  With striped locking the throughput should keep
+ * rising with the number of threads, up to the number of cores.
+ */
+Test(store_bench, contention, .timeout = 60) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    int iters = 20000;
+    for(int nthreads = 1; nthreads <= 32; nthreads *= 2) {
+	struct contention_args args[32];
+	struct timespec start, end;
+	trans_init();
+	store_init_buckets(STORE_DEFAULT_BUCKETS);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int i = 0; i < nthreads; i++) {
+	    args[i].index = i;
+	    args[i].iters = iters;
+	    pthread_create(&args[i].tid, NULL, contention_thread, &args[i]);
+	}
+	for(int i = 0; i < nthreads; i++)
+	    pthread_join(args[i].tid, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	double ops = 2.0 * iters * nthreads;
+	fprintf(stderr, "Store contention: %2d threads, %.0f get+put ops/sec\n",
+		nthreads, ops / secs);
+	store_fini();
+	trans_fini();
+    }
+}
+
+/*
+ * Thread for the read-scaling benchmark: repeatedly read committed values.
+ */
+static void *read_committed_thread(void *arg) {
+    struct contention_args *ap = arg;
+    char content[20];
+    for(int i = 0; i < ap->iters; i++) {
+	snprintf(content, sizeof(content), "%6d", i % NKEYS);
+	BLOB *value = store_get_committed(make_key(content, strlen(content)));
+	if(value != NULL)
+	    blob_unref(value, "");
+    }
+    return NULL;
+}
+
+/*
+ * Measure lock-free committed-read throughput for an increasing number of
+ * threads all reading the same small set of keys.
+ */
+Test(store_bench, read_committed, .timeout = 60) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    int iters = 50000;
+    char content[20];
+    trans_init();
+    store_init_buckets(STORE_DEFAULT_BUCKETS);
+    TRANSACTION *tp = trans_create();
+    for(int i = 0; i < NKEYS; i++) {
+	snprintf(content, sizeof(content), "%6d", i);
+	store_put(tp, make_key(content, strlen(content)), blob_create(content, strlen(content)));
+    }
+    trans_commit(tp);
+    for(int nthreads = 1; nthreads <= 32; nthreads *= 2) {
+	struct contention_args args[32];
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int i = 0; i < nthreads; i++) {
+	    args[i].index = i;
+	    args[i].iters = iters;
+	    pthread_create(&args[i].tid, NULL, read_committed_thread, &args[i]);
+	}
+	for(int i = 0; i < nthreads; i++)
+	    pthread_join(args[i].tid, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "Committed reads: %2d threads, %.0f reads/sec\n",
+		nthreads, (double)iters * nthreads / secs);
+    }
+}
+
+/*
+ * Time inserts, transactional get+put and lock-free reads on a single thread,
+ * with each kind of index, starting from the smallest table so that the
+ * cost of growing it is included.
+ */
+Test(store_bench, index, .timeout = 60) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    static char *names[] = { "chained", "flat" };
+    int nkeys = 1000 * NKEYS / 10;
+    int reads = 5;
+    char content[20];
+    for(int index = STORE_INDEX_CHAINED; index <= STORE_INDEX_FLAT; index++) {
+	struct timespec start, mid, end;
+	trans_init();
+	store_init_index(index, NUM_BUCKETS);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int i = 0; i < nkeys; i++) {
+	    snprintf(content, sizeof(content), "%8d", i);
+	    TRANSACTION *tp = trans_create();
+	    store_put(tp, make_key(content, 8), blob_create(content, 8));
+	    trans_commit(tp);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &mid);
+	for(int i = 0; i < nkeys; i++) {
+	    snprintf(content, sizeof(content), "%8d", i);
+	    TRANSACTION *tp = trans_create();
+	    BLOB *value = NULL;
+	    store_get(tp, make_key(content, 8), &value);
+	    if(value != NULL)
+		blob_unref(value, "");
+	    store_put(tp, make_key(content, 8), blob_create(content, 8));
+	    trans_commit(tp);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double put_secs = (mid.tv_sec - start.tv_sec) + (mid.tv_nsec - start.tv_nsec) / 1e9;
+	double rw_secs = (end.tv_sec - mid.tv_sec) + (end.tv_nsec - mid.tv_nsec) / 1e9;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int r = 0; r < reads; r++) {
+	    for(int i = 0; i < nkeys; i++) {
+		snprintf(content, sizeof(content), "%8d", (i * 7919) % nkeys);
+		BLOB *value = store_get_committed(make_key(content, 8));
+		if(value != NULL)
+		    blob_unref(value, "");
+	    }
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double read_secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "Store index %-7s: %d keys, %.0f inserts/sec, %.0f get+put ops/sec, "
+		"%.0f reads/sec\n", names[index], nkeys, nkeys / put_secs,
+		2.0 * nkeys / rw_secs, (double)reads * nkeys / read_secs);
+	store_fini();
+	trans_fini();
+    }
+}
+
+/*
+ * Heap bytes per key and PUT latency for 16-byte values, with and without
+ * inline values.
+ */
+Test(store_bench, inline_values, .timeout = 60) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    int nkeys = 1000 * NKEYS;
+    size_t maxes[] = { 0, STORE_INLINE_MAX };
+    char key[20], value[16];
+    memset(value, 'v', sizeof(value));
+    for(int m = 0; m < 2; m++) {
+	trans_init();
+	store_init_buckets(nkeys / STORE_MAX_LOAD);
+	store_set_inline_max(maxes[m]);
+	struct mallinfo2 before = mallinfo2();
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int i = 0; i < nkeys; i += 100) {
+	    TRANSACTION *tp = trans_create();
+	    for(int j = i; j < i + 100; j++) {
+		snprintf(key, sizeof(key), "%8d", j);
+		store_put(tp, make_key(key, 8), blob_create(value, sizeof(value)));
+	    }
+	    trans_commit(tp);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	store_gc_sweep(nkeys);
+	struct mallinfo2 after = mallinfo2();
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "Inline values %-3s: %d keys, %.1f heap bytes/key, %.0f ns/put\n",
+		maxes[m] ? "on" : "off", nkeys,
+		(double)(after.uordblks - before.uordblks) / nkeys, secs * 1e9 / nkeys);
+	store_fini();
+	trans_fini();
+    }
+    store_set_inline_max(0);
+}
@@ -0,0 +1,172 @@
+#include <criterion/criterion.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "store.h"
+#include "store_funcs.h"
+#include "transaction_funcs.h"
+#include "wal.h"
+#include "excludes.h"
+
+/*
+ * Benchmarks for the write-ahead log.  They are built by "make bench",
+ * apart from the unit tests, and print their numbers rather than check
+ * anything.
+ */
+
+/* Number of commits per thread. */
+#define NCOMMITS (2000)
+
+/* Number of keys, and size of each value, in the startup benchmark. */
+#define NBENCHKEYS (200000)
+#define BENCHVALUE (200)
+
+/*
+ * Logs go in /var/tmp rather than /tmp, which is often a memory file
+ * system on which syncing costs nothing.
+ */
+static char log_name[64];
+static char ckpt_name[80];
+static char prev_name[80];
+
+static void remove_files() {
+    unlink(log_name);
+    unlink(ckpt_name);
+    unlink(prev_name);
+}
+
+static void init() {
+    snprintf(log_name, sizeof(log_name), "/var/tmp/xacto_wal_bench.%d", getpid());
+    snprintf(ckpt_name, sizeof(ckpt_name), "%s.ckpt", log_name);
+    snprintf(prev_name, sizeof(prev_name), "%s.prev", log_name);
+    remove_files();
+    trans_init();
+    store_init();
+}
+
+static void fini() {
+    remove_files();
+}
+
+/*
+ * Simulate a restart: throw away the store and transaction manager
+ * and bring them back up from the log.
+ */
+static void restart(WAL_SYNC policy) {
+    wal_close();
+    store_fini();
+    trans_fini();
+    trans_init();
+    store_init();
+    cr_assert_eq(wal_open(log_name, policy, 10), 0, "Could not open log");
+}
+
+static KEY *make_key(char *content) {
+    return key_create(blob_create(content, strlen(content)));
+}
+
+static void *commit_thread(void *arg) {
+    int n = (int)(long)arg;
+    char key[32];
+    for(int i = 0; i < NCOMMITS; i++) {
+	snprintf(key, sizeof(key), "t%d:%d", n, i);
+	TRANSACTION *tp = trans_create();
+	store_put(tp, make_key(key), blob_create(key, strlen(key)));
+	trans_commit(tp);
+	// As a server does before it acknowledges the commit.
+	wal_wait_durable(NULL, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * Commit throughput under each durability policy, with one thread and with
+ * many, and how many commits shared each sync.
+ */
+Test(wal_bench, commit, .init = init, .fini = fini, .timeout = 300) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    static struct {
+	char *name;
+	WAL_SYNC policy;
+    } policies[] = {
+	{ "commit", WAL_SYNC_COMMIT }, { "10ms", WAL_SYNC_INTERVAL }, { "off", WAL_SYNC_NONE }
+    };
+    int nthreads[] = { 1, 16 };
+    for(int p = 0; p < 3; p++) {
+	for(int t = 0; t < 2; t++) {
+	    unlink(log_name);
+	    cr_assert_eq(wal_open(log_name, policies[p].policy, 10), 0, "Could not open log");
+	    pthread_t tids[16];
+	    struct timespec start, end;
+	    clock_gettime(CLOCK_MONOTONIC, &start);
+	    for(int i = 0; i < nthreads[t]; i++)
+		pthread_create(&tids[i], NULL, commit_thread, (void *)(long)i);
+	    for(int i = 0; i < nthreads[t]; i++)
+		pthread_join(tids[i], NULL);
+	    clock_gettime(CLOCK_MONOTONIC, &end);
+	    WAL_STATS stats;
+	    wal_get_stats(&stats);
+	    wal_close();
+	    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	    fprintf(stderr, "wal %-6s %2d threads: %9.0f commits/s, %lu syncs, %.1f commits/sync\n",
+		    policies[p].name, nthreads[t], stats.commits / secs, stats.syncs,
+		    stats.syncs ? (double)stats.commits / stats.syncs : 0.0);
+	    cr_assert_eq(stats.commits, (unsigned long)nthreads[t] * NCOMMITS,
+			 "Wrong number of commits logged");
+	}
+    }
+}
+
+/*
+ * Startup time from a checkpoint, with one loading thread and with one per
+ * processor, against replaying the same data from the log.
+ */
+Test(wal_bench, startup, .init = init, .fini = fini, .timeout = 300) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    cr_assert_eq(wal_open(log_name, WAL_SYNC_NONE, 0), 0, "Could not open log");
+    char key[32], value[BENCHVALUE];
+    memset(value, 'v', sizeof(value));
+    for(int i = 0; i < NBENCHKEYS; i += 1000) {
+	TRANSACTION *tp = trans_create();
+	for(int j = i; j < i + 1000; j++) {
+	    snprintf(key, sizeof(key), "bench%d", j);
+	    store_put(tp, make_key(key), blob_create(value, sizeof(value)));
+	}
+	trans_commit(tp);
+    }
+    restart(WAL_SYNC_NONE);
+    WAL_STATS stats;
+    wal_get_stats(&stats);
+    struct stat st;
+    stat(log_name, &st);
+    fprintf(stderr, "startup from log:        %lu records, %.1f MB in %.3f s, %.2f s/GB\n",
+	    stats.recovered, st.st_size / 1e6, stats.replay_nsecs / 1e9,
+	    stats.replay_nsecs / 1e9 / (st.st_size / 1e9));
+    cr_assert_eq(wal_checkpoint(), 0, "Checkpoint failed");
+    wal_get_stats(&stats);
+    fprintf(stderr, "checkpoint written:      %lu keys, %.1f MB in %.3f s\n",
+	    stats.checkpoint.entries, stats.checkpoint.bytes / 1e6, stats.checkpoint.nsecs / 1e9);
+    wal_close();
+    int nthreads[] = { 1, 0 };
+    for(int t = 0; t < 2; t++) {
+	store_fini();
+	trans_fini();
+	trans_init();
+	store_init();
+	CKPT_STATS cs;
+	cr_assert_eq(ckpt_load(ckpt_name, nthreads[t], &cs), 0, "Could not load checkpoint");
+	cr_assert_eq(cs.entries, NBENCHKEYS, "Wrong number of keys loaded");
+	fprintf(stderr, "startup from checkpoint: %2d threads, %.1f MB in %.3f s, %.2f s/GB\n",
+		cs.threads, cs.bytes / 1e6, cs.nsecs / 1e9, cs.nsecs / 1e9 / (cs.bytes / 1e9));
+    }
+}
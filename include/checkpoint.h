@@ -0,0 +1,86 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+
+/*
+ * Checkpoints: every key in the store with its committed value, written
+ * to a file in a compact binary form, so that a restart can load them
+ * directly instead of replaying the whole write-ahead log.
+ *
+ * A checkpoint file is a header, the entries, and a table of offsets.
+ * Each entry is a 32-bit key length, a 32-bit value length, the key and
+ * the value, with no padding.  The offset table gives the position of
+ * every CKPT_STRIDE'th entry, starting with the first, so that a load can
+ * split the entries between threads without reading through them.  All
+ * numbers are in host byte order.
+ *
+ * Values are read as of the time each key is visited, so a checkpoint
+ * taken while transactions are committing is "fuzzy": it is consistent
+ * only once the log records from the time it started are replayed over it.
+ * The write-ahead log takes care of that.
+ */
+#define CKPT_MAGIC "XACTCKP1"
+#define CKPT_STRIDE 4096
+
+typedef struct ckpt_header {
+    char magic[8];
+    uint64_t count;               // Number of entries.
+    uint64_t table;               // Offset of the offset table.
+    uint64_t chunks;              // Number of offsets in the table.
+} CKPT_HEADER;
+
+typedef struct ckpt_stats {
+    unsigned long entries;        // Entries written or loaded.
+    unsigned long bytes;          // Size of the file.
+    int threads;                  // Threads used to load.
+    long nsecs;                   // Time taken.
+} CKPT_STATS;
+
+/*
+ * Function called once the values have been read and before the checkpoint
+ * is put in place.  Returns 0 if successful, -1 otherwise.
+ */
+typedef int CKPT_SYNC_FUNC(void);
+
+/*
+ * Write a checkpoint of the committed values in the store.  The file is
+ * written under a temporary name, synced, and then renamed into place, so
+ * that it either replaces an existing checkpoint completely or not at all.
+ *
+ * A value read by the checkpoint may belong to a transaction that is
+ * committed but whose log record is not yet durable.  The checkpoint must
+ * not be put in place until it is, since the log it covers is dropped
+ * afterwards; the sync function is there to see to that.
+ *
+ * @param path  Name of the checkpoint file.
+ * @param sync  If not NULL, called before the file is renamed into place;
+ * the checkpoint fails if it fails.
+ * @param sp  If not NULL, set to statistics about the checkpoint.
+ * @return  0 if successful, -1 otherwise.
+ */
+int ckpt_write(char *path, CKPT_SYNC_FUNC *sync, CKPT_STATS *sp);
+
+/*
+ * Load a checkpoint into the store.  The file is mapped into memory, and
+ * its entries are put into the store by several threads at once, each in
+ * a transaction of its own, which commits once the thread is done.  The
+ * store must not contain any of the keys in the checkpoint.
+ *
+ * @param path  Name of the checkpoint file.
+ * @param nthreads  Number of threads to use, or 0 for one per processor.
+ * @param sp  If not NULL, set to statistics about the load.
+ * @return  0 if successful or if there is no checkpoint, -1 if the file
+ * exists but is not a valid checkpoint.
+ */
+int ckpt_load(char *path, int nthreads, CKPT_STATS *sp);
+
+/*
+ * Sync the directory containing a file, so that the file's creation, or a
+ * rename to its name, survives a crash.
+ *
+ * @return  0 if successful, -1 otherwise.
+ */
+int ckpt_sync_dir(char *path);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef DATA_FUNCS_H
+#define DATA_FUNCS_H
+
+#include <stdint.h>
+
+#include "data.h"
+
+/*
+ * A blob is a single allocation: the BLOB header is followed by the cached
+ * hash of the content and then the content, which has a null byte after it
+ * so that text content can be printed.  No other copy of the content is
+ * kept.  The prefix field is only
+ * used in debugging builds, where blob_prefix() builds it from the content
+ * the first time it is wanted, cut off after BLOB_PREFIX_MAX bytes.
+ */
+#define BLOB_PREFIX_MAX 32
+
+/*
+ * Get a printable prefix of the content of a blob, for debugging output.
+ * Bytes that are not printable are shown as '.', and a prefix that was cut
+ * short ends in "...".  The string belongs to the blob.  In builds without
+ * DEBUG this is always the empty string.
+ *
+ * @param bp  The blob.
+ * @return  The prefix.
+ */
+char *blob_prefix(BLOB *bp);
+
+/*
+ * Create a blob whose content is left for the caller to fill in, so that
+ * data can be read straight into it rather than copied there from another
+ * buffer.  The content must be filled in before the blob is used in any
+ * other way, in particular before it is hashed or shared.
+ *
+ * @param size  The size of the content.
+ * @return  The blob, with a reference count of 1.
+ */
+BLOB *blob_alloc(size_t size);
+
+/*
+ * Blob contents are hashed over exactly their size, so content with null
+ * bytes in it hashes correctly, by a word-at-a-time function taking a
+ * 64-bit seed (see hash_bytes()).  blob_hash() computes the hash of a blob
+ * the first time it is called and returns the cached value after that.
+ * key_compare() compares the hashes of two keys, then the sizes of their
+ * blobs, and only then their contents.
+ */
+#define BLOB_HASH_SEED 0x9e3779b97f4a7c15ull
+
+/*
+ * Hash a sequence of bytes.
+ *
+ * @param p  The bytes.
+ * @param len  The number of bytes.
+ * @param seed  The seed, which selects one of a family of hash functions.
+ * @return  The hash.
+ */
+uint64_t hash_bytes(const char *p, size_t len, uint64_t seed);
+
+/*
+ * Set the seed used by blob_hash() in place of BLOB_HASH_SEED, so that the
+ * hash values of keys cannot be predicted from outside.  This must be done
+ * before any blob is hashed.
+ */
+void blob_set_hash_seed(uint64_t seed);
+
+#endif
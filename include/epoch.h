@@ -0,0 +1,56 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based reclamation.
+ *
+ * Readers that traverse shared structures without taking locks bracket the
+ * traversal with epoch_enter() and epoch_exit().  A writer that unlinks an
+ * object from such a structure (while holding whatever lock protects it
+ * against other writers) passes the object to epoch_retire() instead of
+ * freeing it.  The object is freed later, once no reader can still hold a
+ * pointer to it.
+ *
+ * There is a global epoch counter.  A thread entering a critical section
+ * records the value of the counter, and the counter only advances once every
+ * thread currently inside a critical section has recorded its current value.
+ * An object retired while the counter was e can therefore no longer be seen
+ * by any reader once the counter has reached e + 2.
+ *
+ * Critical sections may be nested, but must not block for long: a reader
+ * that stays inside one holds up reclamation for every other thread.
+ */
+
+/*
+ * Enter a read-side critical section.
+ */
+void epoch_enter(void);
+
+/*
+ * Leave a read-side critical section.
+ */
+void epoch_exit(void);
+
+/*
+ * Arrange for an object to be freed once no reader can still see it.
+ * The object must already be unreachable for readers that start later.
+ *
+ * @param ptr  The object.
+ * @param free_fn  Function to call to free the object.
+ */
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+/*
+ * Wait until everything retired by the calling thread so far has been
+ * freed.  The caller must not be inside a critical section.
+ */
+void epoch_barrier(void);
+
+/*
+ * Free everything that has been retired by any thread, without waiting.
+ * Only for use when no thread can be inside a critical section, such as
+ * when the store is being finalized.
+ */
+void epoch_fini(void);
+
+#endif
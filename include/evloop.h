@@ -0,0 +1,83 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <stddef.h>
+
+/*
+ * Event-driven server core, an alternative to a thread per connection.
+ *
+ * A few event-loop threads own the client connections, which are put in
+ * non-blocking mode and watched with epoll.  A loop reads whatever has
+ * arrived on a connection into a buffer of its own, and as soon as the
+ * buffer holds one or more complete requests (see proto_request_length()),
+ * hands the connection to a fixed pool of worker threads, which run the
+ * session (see server_funcs.h) over those requests.  The worker then
+ * writes out the replies, as far as the socket takes them without
+ * blocking, and gives the connection back to its loop, to wait either for
+ * more input or for the socket to take the rest of the output.
+ *
+ * Connections are watched with EPOLLONESHOT, so a connection belongs to
+ * exactly one thread at a time: its loop, while it is being watched or
+ * read, or a worker, while it is being served.  Requests on a connection
+ * are therefore handled in order, and an idle connection holds no thread
+ * and, once its buffers are empty, little memory.  Workers never block
+ * waiting for other transactions to commit: a session whose commit has to
+ * wait stops (see session_set_wake()), and its connection is handed to a
+ * worker again once the commit has finished.
+ *
+ * Where the kernel supports it, an io_uring engine can be used instead of
+ * the epoll loops.  A single thread owns the ring: a multishot accept takes
+ * new connections, and a multishot receive on each connection fills
+ * buffers picked from a registered buffer ring, whose contents are added to
+ * the connection's input.  Workers serve connections and write out the
+ * replies as before, but hand them back to the ring thread, which sends
+ * whatever output the socket did not take.  The receives, sends and re-arms
+ * prepared while handling one batch of completions are submitted with a
+ * single system call.  The receive of a connection is cancelled while the
+ * connection is over the limits below, and armed again once it is not.
+ */
+#define EVLOOP_MAX_EVENTS 64
+#define EVLOOP_READ_SIZE 16384
+#define EVLOOP_RING_ENTRIES 256
+#define EVLOOP_RING_BUFS 256
+
+/*
+ * A client that sends faster than it reads its replies is held back rather
+ * than let grow the buffers of its connection without end.  Input is read
+ * only while the replies already made have all been written out, and only
+ * until it holds a complete request and at least EVLOOP_INPUT_HIGH bytes;
+ * the rest waits in the socket.  A session stops taking requests once its
+ * output passes SESSION_OUTPUT_HIGH (see server_funcs.h), and goes on with
+ * them once the client has taken that output.  A request can still need
+ * any amount of input before it is complete, so a connection is closed as
+ * soon as a packet header declares a payload larger than the packet limit
+ * (see session_set_packet_max()).
+ */
+#define EVLOOP_INPUT_HIGH (256 << 10)
+
+/*
+ * Start the event loops and the worker pool.
+ *
+ * @param nloops  Number of event-loop threads.
+ * @param nworkers  Number of worker threads.
+ */
+void evloop_start(int nloops, int nworkers);
+
+/*
+ * Start the io_uring engine, which accepts connections on listenfd itself,
+ * and the worker pool.
+ *
+ * @param listenfd  The listening socket.
+ * @param nworkers  Number of worker threads.
+ * @return  0 if successful, -1 if the kernel lacks io_uring or any of the
+ *   features the engine uses, in which case nothing has been started.
+ */
+int evloop_start_uring(int listenfd, int nworkers);
+
+/*
+ * Hand a newly accepted connection to one of the event loops, which starts
+ * a session on it.
+ */
+void evloop_add(int fd);
+
+#endif
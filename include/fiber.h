@@ -0,0 +1,66 @@
+#ifndef FIBER_H
+#define FIBER_H
+
+/*
+ * Fibers: coroutines, each with a stack of its own, that are run by a few
+ * scheduler threads and switch among themselves (with swapcontext()) only
+ * where they would otherwise block.  This lets a server give each
+ * connection straight-line, blocking-style code, as with a thread per
+ * connection, while a handful of threads serve any number of connections.
+ *
+ * A fiber stays on the scheduler thread it was given when it was spawned.
+ * It gives up the thread in two ways:
+ *
+ *   - fiber_wait() waits for a descriptor in non-blocking mode to become
+ *     ready.  The descriptor is watched with the scheduler's epoll, and the
+ *     fiber runs again when the descriptor is ready.
+ *   - fiber_park() waits for fiber_wake() to be called on it, from any
+ *     thread.  It is meant for waits that end when another fiber or thread
+ *     does something, such as resolving a transaction.
+ *
+ * Anything else a fiber does that blocks, such as syncing a log, blocks the
+ * whole scheduler thread and the fibers on it.
+ */
+#define FIBER_STACK_SIZE 65536
+#define FIBER_MAX_EVENTS 64
+
+typedef struct fiber FIBER;
+typedef void FIBER_FUNC(void *arg);
+
+/*
+ * Start the scheduler threads.
+ *
+ * @param nthreads  Number of scheduler threads.
+ */
+void fiber_start(int nthreads);
+
+/*
+ * Start a fiber, on one of the scheduler threads in turn.  The fiber ends
+ * when the function returns.
+ */
+void fiber_spawn(FIBER_FUNC *func, void *arg);
+
+/*
+ * Get the calling fiber, or NULL if not called from a fiber.
+ */
+FIBER *fiber_self(void);
+
+/*
+ * Wait, in a fiber, until a descriptor is ready for reading or, if write
+ * is nonzero, for writing.  This has the type of XACTO_WAIT (see
+ * protocol_funcs.h).
+ *
+ * @return  0 once it is ready, -1 if not called from a fiber or the
+ * descriptor cannot be watched.
+ */
+int fiber_wait(int fd, int write);
+
+/*
+ * Suspend the calling fiber until fiber_wake() is called on it, which may
+ * already have happened, in which case the fiber goes on at once.  Each
+ * fiber_park() must be matched by exactly one fiber_wake().
+ */
+void fiber_park(void);
+void fiber_wake(FIBER *fp);
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef FLAT_TABLE_H
+#define FLAT_TABLE_H
+
+#include "store.h"
+
+/*
+ * Open-addressing hash table of map entries, used by the store as an
+ * alternative to chained buckets.
+ *
+ * Slots are arranged in groups of FLAT_GROUP_SIZE, and each slot has a
+ * one-byte control tag.  The tag of an occupied slot holds seven bits of
+ * the key's hash; empty and deleted slots have the top bit set.  A lookup
+ * compares the tags of a whole group against the wanted tag at once (with
+ * SSE2, or AVX2 if the compiler targets it), then checks the full hash kept
+ * in the slot before it ever touches the key itself.  Groups are probed
+ * quadratically until one is found that has an empty slot.
+ *
+ * The table does no locking of its own.  Modifications must be serialized
+ * by the caller, but flat_find() may run concurrently with them, provided
+ * that entries removed from the table, and tables replaced by a resize,
+ * are only freed once no such reader can be looking at them.
+ */
+#if defined(__AVX2__)
+#define FLAT_GROUP_SIZE 32
+#else
+#define FLAT_GROUP_SIZE 16
+#endif
+
+#define FLAT_CTRL_EMPTY ((signed char)0x80)
+#define FLAT_CTRL_DELETED ((signed char)0xfe)
+
+/*
+ * The table is rebuilt once occupied and deleted slots together exceed
+ * FLAT_MAX_LOAD_NUM/FLAT_MAX_LOAD_DEN of its capacity, and halved once it
+ * is less than 1/FLAT_MIN_LOAD_INV full.
+ */
+#define FLAT_MAX_LOAD_NUM 7
+#define FLAT_MAX_LOAD_DEN 8
+#define FLAT_MIN_LOAD_INV 8
+
+typedef struct flat_slot {
+    unsigned int hash;       // Mixed hash of the key.
+    MAP_ENTRY *entry;
+} FLAT_SLOT;
+
+typedef struct flat_table {
+    int num_groups;          // Number of groups (a power of two).
+    int count;               // Number of occupied slots.
+    int deleted;             // Number of deleted slots.
+    signed char *ctrl;       // Control tags, one per slot.
+    FLAT_SLOT *slots;
+} FLAT_TABLE;
+
+/*
+ * Create an empty table.
+ *
+ * @param num_groups  Number of groups, which must be a power of two.
+ * @return  The new table.
+ */
+FLAT_TABLE *flat_create(int num_groups);
+
+/*
+ * Free a table, but not the map entries in it.
+ */
+void flat_free(FLAT_TABLE *ft);
+
+/*
+ * Find the map entry for a key.
+ *
+ * @return  The entry, or NULL if there is none.
+ */
+MAP_ENTRY *flat_find(FLAT_TABLE *ft, KEY *key);
+
+/*
+ * Add a map entry, whose key must not already be in the table.
+ * The caller must have made sure that there is room, using flat_wanted_groups().
+ */
+void flat_insert(FLAT_TABLE *ft, MAP_ENTRY *ep);
+
+/*
+ * Remove the entry in a slot.  The entry itself is not freed.
+ *
+ * @param i  Index of an occupied slot.
+ */
+void flat_erase(FLAT_TABLE *ft, int i);
+
+/*
+ * Work out how many groups a table should have to hold its current entries
+ * plus a number of new ones under the load-factor policy.  If the result
+ * differs from ft->num_groups, or if the table is overloaded with deleted
+ * slots, flat_needs_rebuild() will say so.
+ *
+ * @param extra  Number of entries about to be added.
+ * @param min_groups  Never go below this many groups.
+ */
+int flat_wanted_groups(FLAT_TABLE *ft, int extra, int min_groups);
+
+/*
+ * Determine whether a table must be rebuilt before extra entries are added
+ * to it, or may be shrunk.
+ */
+int flat_needs_rebuild(FLAT_TABLE *ft, int extra, int min_groups);
+
+/*
+ * Make a new table with a given number of groups, containing all the
+ * entries of an existing table.  The existing table is left unchanged.
+ */
+FLAT_TABLE *flat_rebuild(FLAT_TABLE *ft, int num_groups);
+
+#endif
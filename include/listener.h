@@ -0,0 +1,61 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+/*
+ * Listening sockets, and the threads that accept connections on them.
+ *
+ * With a single listening socket, every acceptor takes connections off the
+ * same queue, and a storm of new connections is accepted no faster than
+ * one thread can go.  With several acceptor threads, each has a listening
+ * socket of its own, bound to the same port with SO_REUSEPORT, and the
+ * kernel spreads incoming connections over their queues.  Connections are
+ * accepted with accept4(), so that the flags the server wants on them,
+ * such as SOCK_NONBLOCK for an event loop, are set by the same system call.
+ *
+ * The backlog is the length of each socket's queue of connections not yet
+ * accepted.  The kernel caps it at net.core.somaxconn.
+ */
+#define LISTENER_DEFAULT_BACKLOG 1024
+
+/*
+ * An error in accepting a connection, other than one showing that the
+ * listening socket is unusable, does not stop an acceptor.  Running out of
+ * descriptors or memory, or an error on the network or on the connection
+ * being accepted, is reported, and the acceptor tries again after a pause,
+ * leaving the connections that are waiting in the queue meanwhile.
+ */
+#define LISTENER_RETRY_MS 10
+
+/*
+ * Function that takes over a newly accepted connection.
+ */
+typedef void LISTENER_FUNC(int fd);
+
+/*
+ * Open a listening socket on a port, on any address.
+ *
+ * @param port  The port.
+ * @param backlog  The length of the queue of connections not yet accepted.
+ * @param reuseport  Whether other sockets may listen on the same port
+ * (SO_REUSEPORT), which must be set on all of them.
+ * @return  The socket, or -1 on error.
+ */
+int listener_open(char *port, int backlog, int reuseport);
+
+/*
+ * Accept connections on a listening socket opened with reuseport set if
+ * nacceptors is more than 1, in the calling thread and in nacceptors - 1
+ * more threads, each on a socket of its own, and hand each connection to
+ * a function.  This does not return.
+ *
+ * @param listenfd  The listening socket of the calling thread.
+ * @param port  The port, to open the other sockets on.
+ * @param nacceptors  The number of acceptor threads.
+ * @param backlog  The backlog of the other sockets.
+ * @param flags  Flags for accept4(), such as SOCK_NONBLOCK.
+ * @param serve  The function to hand connections to.
+ */
+void listener_run(int listenfd, char *port, int nacceptors, int backlog, int flags,
+		  LISTENER_FUNC *serve);
+
+#endif
@@ -1,4 +1,279 @@
+#ifndef PROTOCOL_FUNCS_H
+#define PROTOCOL_FUNCS_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+#include "csapp.h"
+
+/*
+ * Packet types beyond those in protocol.h.
+ *
+ *   SCAN:    Get the keys in a range, in order, with their values
+ *            (payload is an optional 32-bit limit on the number of keys,
+ *            in network byte order, with 0 or no payload meaning no limit)
+ *            (sends the first key and the key just past the range,
+ *            either of which may be a null data value for no bound)
+ *            (reply is a key and value DATA packet for each key visited,
+ *            then a REPLY with the status)
+ */
+#define XACTO_SCAN_PKT (XACTO_REPLY_PKT + 1)
+/*
+ *   SNAPSHOT: Make the transaction of this session read-only
+ *            (must come before any other request of the transaction)
+ *            (reply is a REPLY with status PENDING)
+ *            (GET and SCAN then see the store as of a snapshot taken now,
+ *            and never abort; PUT aborts the transaction; COMMIT always
+ *            succeeds at once)
+ */
+#define XACTO_SNAPSHOT_PKT (XACTO_REPLY_PKT + 2)
+/*
+ *   MGET:    Get the values of a batch of keys
+ *            (payload is a count, then that many items, each a key)
+ *            (reply is a REPLY with the status of the transaction, whose
+ *            payload has, for each key in order, a one-byte status
+ *            followed by an item with the value)
+ *   MPUT:    Put values for a batch of keys
+ *            (payload is a count, then a key item and a value item for
+ *            each key)
+ *            (reply is a REPLY with the status of the transaction, whose
+ *            payload has a one-byte status for each key in order)
+ *
+ * A count is 32 bits in network byte order, and is at most
+ * XACTO_BATCH_MAX.  An item is a 32-bit length in network byte order,
+ * followed by that many bytes of content, except that a length of
+ * XACTO_NULL_ITEM stands for a null data value and has no content.
+ * The status of a key is that of the transaction just after the key was
+ * accessed.  Once the transaction aborts, the remaining keys are not
+ * accessed and an MGET returns null values for them.  An MGET whose reply
+ * would be larger than a packet the server accepts aborts the transaction,
+ * and returns null values for all of the keys.
+ */
+#define XACTO_MGET_PKT (XACTO_REPLY_PKT + 3)
+#define XACTO_MPUT_PKT (XACTO_REPLY_PKT + 4)
+
+/*
+ *   ADD:     Add a signed delta to a numeric value (see store_add())
+ *            (payload is the delta, 64 bits in network byte order)
+ *            (sends the key)
+ *            (reply is a REPLY with the status, then a DATA packet with
+ *            the new value, which is null if the value was not a number
+ *            and so was left alone)
+ */
+#define XACTO_ADD_PKT (XACTO_REPLY_PKT + 5)
+/*
+ *   CAS:     Put a new value for a key if its value is an expected one
+ *            (see store_cas())
+ *            (sends the key, the expected value and the new value, either
+ *            of which may be a null data value)
+ *            (reply is a REPLY with the status, whose payload is one byte,
+ *            1 if the new value was put and 0 if not; if not, and the
+ *            transaction has not aborted, a DATA packet with the value
+ *            found follows)
+ */
+#define XACTO_CAS_PKT (XACTO_REPLY_PKT + 6)
+/*
+ *   BEGIN:   Keep the connection open after each transaction ends
+ *            (reply is a REPLY with status PENDING)
+ *            (any transaction in progress is aborted; from then on, once
+ *            a transaction commits or aborts, the next request starts a new
+ *            one, which SNAPSHOT may make read-only, rather than the
+ *            server closing the connection; BEGIN may be sent again to
+ *            abandon a transaction)
+ */
+#define XACTO_BEGIN_PKT (XACTO_REPLY_PKT + 7)
+/*
+ *   HELLO:   Ask for protocol extensions
+ *            (must be the first packet on the connection)
+ *            (payload is a 32-bit mask of XACTO_FEATURE_* bits, in network
+ *            byte order)
+ *            (reply is a REPLY with status PENDING, whose payload is the
+ *            mask of the features asked for that the server supports)
+ *
+ * Clients that never send HELLO see the protocol as it always was.
+ *
+ * XACTO_FEATURE_TAGS lets a client pipeline requests, sending as many as
+ * it likes without waiting for their replies.  Every packet that starts
+ * a request, and every REPLY, then has a payload that begins with a 32-bit
+ * request ID, in network byte order, followed by the payload it would
+ * otherwise have.  The server handles requests in the order they arrive
+ * and gives each REPLY the ID of the request it answers.  DATA packets are
+ * not tagged: they go with the request or REPLY they always went with.
+ * The session also behaves as if the client had sent BEGIN, except that a
+ * transaction that aborts stays aborted, answering every request with
+ * ABORTED, until the client sends COMMIT or BEGIN, so that requests
+ * pipelined after one that aborted never run in a transaction of their
+ * own.
+ */
+#define XACTO_HELLO_PKT (XACTO_REPLY_PKT + 8)
+
+/* The last packet type defined. */
+#define XACTO_LAST_PKT XACTO_HELLO_PKT
+
+#define XACTO_FEATURE_TAGS 0x1
+#define XACTO_FEATURES XACTO_FEATURE_TAGS
+
+#define XACTO_BATCH_MAX 4096
+#define XACTO_NULL_ITEM 0xffffffff
+
 extern char *xacto_packet_type_names[];
 
+/*
+ * A connection with buffered input and output, for a side that handles
+ * many packets in a row, as the server does.  Packets sent are collected
+ * in an output buffer, and only written out when proto_conn_flush() is
+ * called (or, in blocking mode, when the buffer fills up), so that a reply
+ * and the DATA packets that go with it, or the replies to several
+ * pipelined requests, leave in a single write.
+ *
+ * A connection is in one of two modes:
+ *
+ *   Blocking:  Packets received are read through a rio_t buffer, so that a
+ *              single read() can bring in several of them.  A payload that
+ *              does not fit in what is left of the output buffer is
+ *              written straight from the caller's memory, together with the
+ *              buffer, by writev().  Flushing writes everything.  The
+ *              descriptor may be in non-blocking mode if the connection has
+ *              a wait function, which is called to wait whenever reading
+ *              or writing would block.  While it waits for input with no
+ *              output left, the connection holds no buffers.
+ *   Event:     For a descriptor in non-blocking mode, watched by an event
+ *              loop.  The loop reads the input itself and hands complete
+ *              requests to the connection with proto_conn_feed(); reading
+ *              past what was fed fails.  The output buffer grows as needed,
+ *              and flushing writes as much as the descriptor takes without
+ *              blocking, leaving the rest for proto_conn_unsent() to report.
+ *              Buffers are only held while they have something in them, so
+ *              an idle connection costs little memory.
+ *
+ * The packets on the wire are the same as those of proto_send_packet()
+ * and proto_recv_packet(), which the other side may go on using.
+ */
+#define XACTO_OBUF_SIZE RIO_BUFSIZE
+
+/*
+ * Function called by a connection in blocking mode when its descriptor
+ * would block, to wait until it is ready for reading or, if write is
+ * nonzero, for writing.
+ *
+ * @return  0 once it is ready, -1 if it cannot wait.
+ */
+typedef int XACTO_WAIT(int fd, int write);
+
+typedef struct xacto_conn {
+    int fd;
+    int event;                    // Whether the connection is in event mode.
+    rio_t *in;                    // Input buffer, in blocking mode.
+    const char *src;              // Input fed in event mode.
+    size_t src_len, src_pos;
+    char *out;                    // Output buffer.
+    size_t out_len, out_cap;
+    XACTO_WAIT *wait;             // Waits for a non-blocking descriptor.
+    size_t packet_max;            // Largest payload accepted in a packet.
+} XACTO_CONN;
+
+/*
+ * The largest payload a connection accepts in a packet, unless set with
+ * proto_conn_set_packet_max().
+ */
+#define XACTO_PACKET_MAX (16 << 20)
+
+void proto_conn_init(XACTO_CONN *cp, int fd);
+void proto_conn_init_event(XACTO_CONN *cp, int fd);
+
+/*
+ * Set the largest payload a connection accepts in a packet.  Receiving a
+ * packet whose header declares a larger one fails, before any of the
+ * payload is read or room is made for it.
+ */
+void proto_conn_set_packet_max(XACTO_CONN *cp, size_t max);
+
+/*
+ * Set the function a connection in blocking mode calls to wait for its
+ * descriptor, once the descriptor has been put in non-blocking mode.
+ */
+void proto_conn_set_wait(XACTO_CONN *cp, XACTO_WAIT *wait);
+
+/*
+ * Free the buffers of a connection.  The descriptor is left open.
+ */
+void proto_conn_fini(XACTO_CONN *cp);
+
+/*
+ * Give a connection in event mode the next input to receive packets from.
+ * The input is borrowed until it has all been received or the connection
+ * is fed again.
+ */
+void proto_conn_feed(XACTO_CONN *cp, const char *buf, size_t len);
+
+/*
+ * Receive a packet, as proto_recv_packet() does.  On failure, nothing is
+ * left for the caller to free.
+ */
+int proto_conn_recv(XACTO_CONN *cp, XACTO_PACKET *pkt, void **payload);
+
+/*
+ * Receive a packet in two steps, so that the caller can choose where the
+ * payload goes: first the header, then, if pkt->size is not 0, exactly
+ * pkt->size bytes of payload into a buffer of the caller's.
+ *
+ * @return  0 if successful, -1 on error, end of file, or a payload larger
+ * than the connection accepts.
+ */
+int proto_conn_recv_header(XACTO_CONN *cp, XACTO_PACKET *pkt);
+int proto_conn_recv_payload(XACTO_CONN *cp, void *buf, size_t size);
+
+/*
+ * Whether a packet that has already arrived is waiting to be received, so
+ * that receiving it will not block.  A side that flushes before it waits
+ * for more input lets the output of pipelined requests pile up.
+ */
+int proto_conn_pending(XACTO_CONN *cp);
+
+/*
+ * Send a packet, as proto_send_packet() does, except that it may stay in
+ * the output buffer until the next flush.  The header is not modified.
+ */
+int proto_conn_send(XACTO_CONN *cp, XACTO_PACKET *pkt, void *payload);
+
+/*
+ * Write out what is in the output buffer: all of it in blocking mode, as
+ * much as can be written without blocking in event mode.
+ *
+ * @return  0 if successful, -1 if the connection failed.
+ */
+int proto_conn_flush(XACTO_CONN *cp);
+
+/*
+ * The length of the request at the start of a buffer, together with the
+ * DATA packets that go with it, so that an event loop can tell when it has
+ * read enough to hand the request to a session.  The header of each packet
+ * is checked as soon as it is in the buffer, so that a request too large
+ * to accept is found out before its payload is read.
+ *
+ * @param max  The largest payload accepted in a packet.
+ * @return  The length in bytes, 0 if the buffer does not hold all of the
+ * request yet, or XACTO_TOO_LARGE if a packet of the request has a payload
+ * larger than max.
+ */
+#define XACTO_TOO_LARGE ((size_t)-1)
+size_t proto_request_length(const char *buf, size_t len, size_t max);
+
+/*
+ * The number of bytes sent on a connection in event mode that are still
+ * waiting to be written.
+ */
+size_t proto_conn_unsent(XACTO_CONN *cp);
+
+/*
+ * For a caller that writes the output of a connection in event mode
+ * itself: get the bytes waiting to be written, and drop the first n of
+ * them once they have been.
+ */
+char *proto_conn_output(XACTO_CONN *cp, size_t *lenp);
+void proto_conn_sent(XACTO_CONN *cp, size_t n);
+
 void proto_debug_packet(XACTO_PACKET *pkt, char *payload);
 void proto_init_packet(XACTO_PACKET *pkt, XACTO_PACKET_TYPE type, size_t size);
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef SERVER_FUNCS_H
+#define SERVER_FUNCS_H
+
+#include "protocol_funcs.h"
+
+/*
+ * Client sessions, for servers that do not give each connection a thread
+ * of its own.  xacto_client_service() runs a session on a connection in
+ * blocking mode from start to finish; an event loop instead opens a
+ * session on a connection in event mode, feeds it complete requests as
+ * they arrive, and has it handle them, on whatever thread is free.  Only
+ * one thread may use a session at a time.
+ */
+typedef struct session SESSION;
+
+/*
+ * Start a session on a newly accepted connection, and register the
+ * connection with the client registry.
+ *
+ * @param fd  The connection.
+ * @param event  Whether the connection is to be in event mode (see
+ * protocol_funcs.h).
+ */
+SESSION *session_open(int fd, int event);
+
+/*
+ * Set the largest payload accepted in a packet on the connections of the
+ * sessions opened from then on (XACTO_PACKET_MAX unless set), and get it,
+ * for an event loop to check requests against before feeding them.
+ */
+void session_set_packet_max(size_t max);
+size_t session_packet_max(void);
+
+/*
+ * Get the connection of a session, to feed it input or write out its
+ * output.
+ */
+XACTO_CONN *session_conn(SESSION *sp);
+
+/*
+ * Function called when a session that stopped to wait for a commit can go
+ * on.  It is called on the thread that resolved the last transaction the
+ * commit was waiting for, or on the thread that synced the log, possibly
+ * before session_serve() has returned, and must not block.
+ */
+typedef void SESSION_WAKE(void *arg);
+
+/*
+ * Have the commits of a session in event mode that would block wait
+ * without blocking instead, calling the wake function when they finish.
+ */
+void session_set_wake(SESSION *sp, SESSION_WAKE *wake, void *arg);
+
+/*
+ * Output a session in event mode may leave unsent before it stops taking
+ * requests.
+ */
+#define SESSION_OUTPUT_HIGH (1 << 20)
+
+/*
+ * Handle every request that has been fed to a session in event mode, which
+ * must have been fed only complete requests (see proto_request_length()).
+ * Replies are left in the output buffer of the connection.  A session
+ * with a wake function may stop at a commit that has to wait, for other
+ * transactions or for the log to make it durable, leaving the
+ * rest of the input fed to it, which must be kept as it is.  Once the wake
+ * function has been called, session_serve() is called again to finish the
+ * commit and go on with the rest.  Likewise, a session stops once more than
+ * SESSION_OUTPUT_HIGH bytes of output are waiting to be written, between
+ * requests or in the middle of a SCAN, and is called again with the same
+ * input once they have been.
+ *
+ * @return  0 if the session goes on, 1 if it is waiting for a commit, 2 if
+ * it has stopped for its output to be written, -1 if it is over and should
+ * be closed.
+ */
+int session_serve(SESSION *sp);
+
+/*
+ * Serve a connection as xacto_client_service() does, but from a fiber (see
+ * fiber.h) rather than a thread of its own.  The fiber gives up its
+ * scheduler thread to other fibers whenever the connection would block or
+ * a commit has to wait for other transactions.
+ *
+ * @param arg  Pointer to the descriptor of the connection, which is freed.
+ */
+void xacto_client_fiber(void *arg);
+
+/*
+ * End a session: write out what output can be written, abort any
+ * transaction that has not committed, unregister and close the connection,
+ * and free the session.
+ */
+void session_close(SESSION *sp);
+
+#endif
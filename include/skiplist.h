@@ -0,0 +1,78 @@
+#ifndef SKIPLIST_H
+#define SKIPLIST_H
+
+#include "store.h"
+
+/*
+ * Ordered index of map entries, kept by the store next to the hash table so
+ * that ranges of keys can be visited in order.  Keys are ordered by their
+ * content, byte by byte as unsigned chars, with a key that is a prefix of
+ * another coming first.
+ *
+ * The index is a skip list.  Insertions and removals are serialized by a
+ * mutex, but readers take no locks: a new node is linked in from the bottom
+ * level up, and a removed node is unlinked from the top down and then
+ * retired with epoch_retire(), so a reader inside an epoch critical section
+ * always sees a well-formed list at every level.
+ */
+#define SKIPLIST_MAX_LEVEL 16
+
+typedef struct skiplist_node {
+    MAP_ENTRY *entry;
+    int height;
+    struct skiplist_node *next[];
+} SKIPLIST_NODE;
+
+typedef struct skiplist {
+    pthread_mutex_t mutex;   // Serializes insertions and removals.
+    int count;               // Number of entries in the index.
+    SKIPLIST_NODE *head;     // Sentinel of full height.
+} SKIPLIST;
+
+/*
+ * Compare two keys, given as blobs, in index order.
+ *
+ * @return  A value less than, equal to, or greater than zero according as
+ * the first key comes before, is equal to, or comes after the second.
+ */
+int skiplist_compare(BLOB *bp1, BLOB *bp2);
+
+/*
+ * Initialize an empty index.
+ */
+void skiplist_init(SKIPLIST *sl);
+
+/*
+ * Free an index, but not the map entries in it.  Only to be used when
+ * no other thread can be accessing the index.
+ */
+void skiplist_fini(SKIPLIST *sl);
+
+/*
+ * Add a map entry to the index.  No entry with an equal key may already
+ * be present.
+ */
+void skiplist_insert(SKIPLIST *sl, MAP_ENTRY *ep);
+
+/*
+ * Remove a map entry from the index.  Does nothing if it is not present.
+ */
+void skiplist_remove(SKIPLIST *sl, MAP_ENTRY *ep);
+
+/*
+ * Get the keys of a run of consecutive entries in the index, in order.
+ * This takes no locks, and the caller need not be in a critical section.
+ *
+ * @param from  Start with the first key at or after this one, or with the
+ * first key in the index if NULL.
+ * @param after  If nonzero, skip a key equal to from.
+ * @param to  Stop before the first key at or after this one, or NULL to
+ * run to the end of the index.
+ * @param keys  Caller-supplied storage for the keys.  The caller becomes
+ * responsible for a reference to each blob stored here.
+ * @param max  The maximum number of keys to get.
+ * @return  The number of keys stored in the array.
+ */
+int skiplist_range(SKIPLIST *sl, BLOB *from, int after, BLOB *to, BLOB **keys, int max);
+
+#endif
@@ -0,0 +1,341 @@
+#ifndef STORE_FUNCS_H
+#define STORE_FUNCS_H
+
+#include "store.h"
+#include "transaction_funcs.h"
+
+/*
+ * Load-factor policy for the map.  The table doubles once the average
+ * number of entries per bucket exceeds STORE_MAX_LOAD, and halves once it
+ * drops below 1/STORE_MIN_LOAD_INV, but never below the size it was
+ * initialized with.  Bucket counts are always powers of two.
+ *
+ * Rather than moving every entry at once, a resize installs the new table
+ * and leaves the old one in place; each subsequent store operation then
+ * migrates up to STORE_REHASH_STEP buckets from the old table to the new.
+ */
+#define STORE_MAX_LOAD 4
+#define STORE_MIN_LOAD_INV 2
+#define STORE_REHASH_STEP 4
+
+/*
+ * Maximum number of lock stripes protecting the map.  Operations on keys in
+ * different stripes never contend.  The stripe count is fixed when the store
+ * is initialized, at the smaller of this and the initial number of buckets,
+ * so pre-sizing the table with at least this many buckets gets full striping.
+ * STORE_DEFAULT_BUCKETS is the size the server uses unless told otherwise.
+ */
+#define STORE_STRIPES 64
+#define STORE_DEFAULT_BUCKETS 1024
+
+/*
+ * Kinds of index the store can use to find the map entry for a key.
+ * STORE_INDEX_CHAINED is the linked hash map described in store.h, resized
+ * incrementally as above.  STORE_INDEX_FLAT instead gives each lock stripe
+ * an open-addressing table (see flat_table.h), which avoids following a
+ * chain of pointers on every probe and compares the full hash of a key
+ * before its contents.  A stripe's table is resized in one go, so with a
+ * flat index the pause for a resize is bounded by the size of a stripe
+ * rather than the whole map.
+ */
+typedef enum { STORE_INDEX_CHAINED, STORE_INDEX_FLAT } STORE_INDEX;
+
+/*
+ * Version garbage collection.  Every GET or PUT removes aborted versions
+ * from the version list it touches, since nothing may follow them, but only
+ * discards superseded committed versions once the list is longer than
+ * STORE_GC_THRESHOLD.  The rest of the cleanup is left to an optional
+ * background collector, which sweeps STORE_GC_BATCH buckets every
+ * STORE_GC_INTERVAL_MS milliseconds unless configured otherwise.  Besides
+ * compacting version lists, the collector removes map entries that have no
+ * versions left, or whose only version is a committed NULL (deleted) value
+ * that no pending transaction could be refused access by.
+ */
+#define STORE_GC_THRESHOLD 4
+#define STORE_GC_BATCH 64
+#define STORE_GC_INTERVAL_MS 10
+
+/*
+ * Progress of the background garbage collector.  The counters cover sweeps
+ * made by store_gc_sweep() whether or not the thread is running, and are
+ * reset by store_init_buckets().
+ */
+typedef struct store_gc_stats {
+    int running;                      // Whether the collector thread is running.
+    int cursor;                       // Buckets swept so far in the current pass.
+    unsigned long sweeps;             // Complete passes over the table.
+    unsigned long buckets_swept;
+    unsigned long versions_reclaimed;
+    unsigned long entries_reclaimed;
+    int scan_ranges;                  // Ranges of scans not yet discarded.
+} STORE_GC_STATS;
+
+/*
+ * Values of at most STORE_INLINE_MAX bytes are copied into the version that
+ * holds them, which is allocated together with the bytes, rather than kept
+ * as a reference to the blob that was put.  This saves the blob, with its
+ * mutex and two copies of the content, for the lifetime of the version, and
+ * disposing of the version touches no reference count but the creator's.
+ * Reading such a value creates a new blob to return.  Inlining is off
+ * unless turned on with store_set_inline_max(), since then a GET no longer
+ * returns the very blob that was put, only one with the same content.
+ */
+#define STORE_INLINE_MAX 32
+
+/*
+ * Number of keys a scan takes from the ordered index at a time.
+ */
+#define STORE_SCAN_BATCH 64
+
+/*
+ * Statistics about the map, for monitoring and testing.
+ */
+typedef struct store_stats {
+    STORE_INDEX index;      // Kind of index in use.
+    int num_entries;        // Number of map entries (keys) in the store.
+    int num_buckets;        // Size of the current table, or total slots of a flat index.
+    int old_num_buckets;    // Size of the table being rehashed from, or 0.
+    int rehash_remaining;   // Old buckets not yet migrated.
+    int num_stripes;        // Number of lock stripes.
+    unsigned long resizes;  // Number of resizes started since init.
+} STORE_STATS;
+
+/*
+ * Initialize the store, pre-sizing the table for a given number of buckets.
+ * The count is rounded up to a power of two.  store_init() is equivalent
+ * to store_init_buckets(NUM_BUCKETS).
+ *
+ * @param nbuckets  The initial (and minimum) number of buckets.
+ */
+void store_init_buckets(int nbuckets);
+
+/*
+ * Initialize the store with a given kind of index.  For a flat index,
+ * nbuckets is the initial (and minimum) total number of slots, which is
+ * divided among the lock stripes.  store_init_buckets(n) is equivalent to
+ * store_init_index(STORE_INDEX_CHAINED, n).
+ *
+ * @param index  The kind of index.
+ * @param nbuckets  The initial number of buckets or slots.
+ */
+void store_init_index(STORE_INDEX index, int nbuckets);
+
+/*
+ * Set the size up to which values are held inline in versions, normally
+ * STORE_INLINE_MAX; 0 turns inlining off.  Versions already in the store
+ * are not affected.
+ */
+void store_set_inline_max(size_t max);
+
+/*
+ * Get the current committed value associated with a key, outside of any
+ * transaction.  The value is that of the committed version with the greatest
+ * creator ID, as a GET would see it if nothing were pending.  Unlike
+ * store_get(), this creates no version, cannot conflict with anything and
+ * takes no locks: map entries and versions unlinked by writers are only
+ * freed once no such reader can still be looking at them.
+ *
+ * This operation inherits the key.  The caller is responsible for one
+ * reference on any returned value.
+ *
+ * @param key  The key.
+ * @return  The value, or NULL if the key has no committed value.
+ */
+BLOB *store_get_committed(KEY *key);
+
+/*
+ * Get the values of a batch of keys within a transaction, with the same
+ * effect as calling store_get() for each of them in turn, but locking each
+ * lock stripe that the keys fall in only once.  Keys in the same stripe are
+ * read in the order given, but the order of stripes is unspecified.  Once
+ * the transaction aborts, the remaining keys are not read.
+ *
+ * This operation inherits the keys.  The caller is responsible for one
+ * reference on each non-NULL value returned.
+ *
+ * @param tp  The transaction in which the operation is being performed.
+ * @param n  The number of keys.
+ * @param keys  The keys.
+ * @param values  Array of n elements, each of which is set to the value
+ * of the corresponding key, or NULL if it has none or was not read.
+ * @param statuses  Array of n elements, each of which is set to the status
+ * of the transaction just after the corresponding key was read, or NULL.
+ * @return  The status of the transaction after all the keys were read.
+ */
+TRANS_STATUS store_get_many(TRANSACTION *tp, int n, KEY **keys, BLOB **values,
+			    TRANS_STATUS *statuses);
+
+/*
+ * Put values for a batch of keys within a transaction, with the same
+ * effect as calling store_put() for each of them in turn, but locking each
+ * lock stripe only once, as for store_get_many().
+ *
+ * This operation inherits the keys and values.
+ *
+ * @param tp  The transaction in which the operation is being performed.
+ * @param n  The number of keys.
+ * @param keys  The keys.
+ * @param values  The values to put, which may be NULL.
+ * @param statuses  As for store_get_many().
+ * @return  The status of the transaction after all the values were put.
+ */
+TRANS_STATUS store_put_many(TRANSACTION *tp, int n, KEY **keys, BLOB **values,
+			    TRANS_STATUS *statuses);
+
+/*
+ * Add a signed delta to the value of a key within a transaction, with the
+ * same effect as a GET of the key followed by a PUT of the sum, but in a
+ * single step.  The value must be a signed decimal number, in ASCII with
+ * no spaces, and is taken to be 0 if the key has no value; the sum is
+ * stored the same way.  If the value is not such a number, or the sum
+ * would overflow, the value is left as it is, though the key still counts
+ * as read.
+ *
+ * This operation inherits the key.  The caller is responsible for one
+ * reference on any returned value.
+ *
+ * @param tp  The transaction in which the operation is being performed.
+ * @param key  The key.
+ * @param delta  The amount to add.
+ * @param valuep  Set to the new value, or to NULL if the value was left
+ * as it was or the transaction aborted.
+ * @return  The status of the transaction after the operation.
+ */
+TRANS_STATUS store_add(TRANSACTION *tp, KEY *key, long delta, BLOB **valuep);
+
+/*
+ * Compare the value of a key with an expected value within a transaction,
+ * and only if they are equal put a new value, all in a single step.  If
+ * the values are equal this has the same effect as a store_put() of the
+ * new value, and if not that of a store_get(), so in either case conflicts
+ * are dealt with as for the existing version list operations.  A NULL
+ * expected value matches only a key that has no value.
+ *
+ * This operation inherits the key, the expected value and the new value.
+ * The caller is responsible for one reference on any returned value.
+ *
+ * @param tp  The transaction in which the operation is being performed.
+ * @param key  The key.
+ * @param expected  The expected value, which may be NULL.
+ * @param value  The new value, which may be NULL.
+ * @param swappedp  Set to 1 if the new value was put, otherwise to 0.
+ * @param currentp  If the new value was not put, set to the value found,
+ * otherwise to NULL.
+ * @return  The status of the transaction after the operation.
+ */
+TRANS_STATUS store_cas(TRANSACTION *tp, KEY *key, BLOB *expected, BLOB *value,
+		       int *swappedp, BLOB **currentp);
+
+/*
+ * Get the value of a key as of a snapshot: that of the committed version
+ * with the greatest creator ID below the snapshot's ID.  This is how a
+ * read-only transaction reads.  Like store_get_committed(), it creates no
+ * version, cannot conflict with anything and takes no locks, and since the
+ * value it sees can never change, a transaction made up of such reads is
+ * serializable at the snapshot's ID without ever having to abort.
+ * Versions that a snapshot may still read are kept by the garbage
+ * collector until the snapshot is released.
+ *
+ * This operation inherits the key.  The caller is responsible for one
+ * reference on any returned value.
+ *
+ * @param ssp  The snapshot.
+ * @param key  The key.
+ * @return  The value, or NULL if the key had no value as of the snapshot.
+ */
+BLOB *store_get_snapshot(TRANS_SNAPSHOT *ssp, KEY *key);
+
+/*
+ * Visit, in order, the keys in a range that have non-NULL values as of a
+ * snapshot, reading each as by store_get_snapshot().  Nothing is recorded,
+ * since no writer can change what a snapshot sees.  Arguments are as for
+ * store_scan().
+ */
+void store_scan_snapshot(TRANS_SNAPSHOT *ssp, KEY *lo, KEY *hi, int limit,
+			 int (*fn)(BLOB *key, BLOB *value, void *arg), void *arg);
+
+/*
+ * Visit, in order, the keys in a range that have non-NULL committed values,
+ * reading each as by store_get_committed().  Each value is the latest at
+ * the time its key is visited, so the result is not a consistent picture
+ * of the store if transactions commit during the scan.  Arguments are as
+ * for store_scan().
+ */
+void store_scan_committed(KEY *lo, KEY *hi, int limit,
+			  int (*fn)(BLOB *key, BLOB *value, void *arg), void *arg);
+
+/*
+ * Visit, in order, the keys in a range that have non-NULL values for a
+ * transaction, stopping after a given number of them.  Keys are ordered by
+ * their content, as by skiplist_compare().
+ *
+ * Every key in the range that is present in the map is read as by
+ * store_get(), with the same effect on the transaction, including creating
+ * a version and possibly aborting.  Keys whose value is NULL are read too,
+ * but are not passed to the function and do not count toward the limit.
+ * In addition, the range up to the last key visited is recorded, so that
+ * a transaction with a smaller ID that then tries to access a key in the
+ * range that was not in the map is aborted, as it would have been had the
+ * key been there with a version created by the scan.
+ *
+ * This operation inherits the keys used as bounds.
+ *
+ * @param tp  The transaction in which the scan is performed.
+ * @param lo  The first key in the range, or NULL to start at the beginning.
+ * @param hi  The key just past the range, or NULL to go on to the end.
+ * @param limit  The maximum number of keys to visit, or 0 for no limit.
+ * @param fn  Function to call with each key and value, which are only
+ * borrowed, and which returns nonzero to end the scan early, or NULL.
+ * @param arg  Argument to pass to fn.
+ * @return  The status of the transaction after the scan.
+ */
+TRANS_STATUS store_scan(TRANSACTION *tp, KEY *lo, KEY *hi, int limit,
+			int (*fn)(BLOB *key, BLOB *value, void *arg), void *arg);
+
+/*
+ * Finish any rehash that is in progress, so that all entries are
+ * in the_map.table.  Intended for debugging and tests.
+ */
+void store_rehash_finish(void);
+
+/*
+ * Get a snapshot of the current map statistics.
+ *
+ * @param sp  Caller-supplied storage for the statistics.
+ */
+void store_get_stats(STORE_STATS *sp);
+
+/*
+ * Start the background garbage collector thread.  Does nothing if it is
+ * already running.  The thread is stopped by store_gc_stop() or store_fini().
+ *
+ * @param batch  Number of buckets to sweep at a time, or 0 for the default.
+ * @param interval_ms  Milliseconds to wait between batches, or -1 for the default.
+ */
+void store_gc_start(int batch, int interval_ms);
+
+/*
+ * Stop the background garbage collector thread, waiting for it to exit.
+ * Does nothing if it is not running.
+ */
+void store_gc_stop(void);
+
+/*
+ * Sweep the next few buckets of the map, as one step of the background
+ * collector does.  The sweep resumes where the previous one left off and
+ * wraps around at the end of the table.  With a flat index, each group of
+ * slots counts as a bucket.
+ *
+ * @param nbuckets  The number of buckets to sweep.
+ * @return  The number of buckets swept.
+ */
+int store_gc_sweep(int nbuckets);
+
+/*
+ * Get a snapshot of the progress of the background garbage collector.
+ *
+ * @param sp  Caller-supplied storage for the statistics.
+ */
+void store_gc_get_stats(STORE_GC_STATS *sp);
+
+#endif
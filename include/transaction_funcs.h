@@ -0,0 +1,105 @@
+#ifndef TRANSACTION_FUNCS_H
+#define TRANSACTION_FUNCS_H
+
+#include "transaction.h"
+
+/*
+ * Get the ID of the oldest transaction that has neither committed nor
+ * aborted.  If there is none, the ID returned is the one the next
+ * transaction to be created will get.  Since IDs are handed out in
+ * increasing order, every transaction with a smaller ID has already
+ * committed or aborted, and stays that way.
+ *
+ * @return  The ID of the oldest pending transaction.
+ */
+unsigned int trans_oldest_pending(void);
+
+/*
+ * Function called when an asynchronous commit finishes, with the final
+ * status of the transaction.  It is called on whatever thread resolved the
+ * last of the transactions the commit was waiting for, with no transaction
+ * locked, and must not block.
+ */
+typedef void TRANS_CALLBACK(TRANS_STATUS status, void *arg);
+
+/*
+ * Try to commit a transaction, as trans_commit() does, but without waiting
+ * for the transactions in its dependency set.  If any of them is still
+ * pending, the commit goes on once they have resolved, and the callback
+ * is called with the final status.  Otherwise the commit finishes at once
+ * and the callback is not called.
+ *
+ * In all cases, this function consumes a single reference to the
+ * transaction object.
+ *
+ * @param tp  The transaction to be committed.
+ * @param cb  The function to call when a commit that had to wait finishes.
+ * @param arg  Argument to pass to the callback.
+ * @return  TRANS_PENDING if the callback will be called, otherwise the
+ * final status of the transaction: either TRANS_ABORTED, or
+ * TRANS_COMMITTED.
+ */
+TRANS_STATUS trans_commit_async(TRANSACTION *tp, TRANS_CALLBACK *cb, void *arg);
+
+/*
+ * A snapshot is a fixed point in the serialization order for read-only
+ * transactions.  Its ID is that of the oldest transaction that was pending
+ * when it was created, so every transaction with a smaller ID had already
+ * committed or aborted.  Reading as of a snapshot means seeing exactly the
+ * effects of the committed transactions with smaller IDs, which can never
+ * change, so such reads need no versions and can never conflict.
+ */
+typedef struct trans_snapshot {
+    unsigned int id;                // Reads see transactions with smaller IDs.
+    struct trans_snapshot *next;    // Next in list of all snapshots.
+    struct trans_snapshot *prev;    // Prev in list of all snapshots.
+} TRANS_SNAPSHOT;
+
+/*
+ * Create a snapshot of the current state of the transaction manager.
+ *
+ * @return  The new snapshot, which must be released with
+ * trans_snapshot_release().
+ */
+TRANS_SNAPSHOT *trans_snapshot_create(void);
+
+/*
+ * Release a snapshot.
+ */
+void trans_snapshot_release(TRANS_SNAPSHOT *ssp);
+
+/*
+ * Get the ID below which the history of the store is no longer needed:
+ * the smaller of the ID of the oldest pending transaction and that of the
+ * oldest snapshot.  A committed version may be discarded once a later
+ * committed version exists whose creator ID is below this value, since no
+ * snapshot, present or future, can read the earlier one.  The value never
+ * decreases.
+ *
+ * @return  The ID.
+ */
+unsigned int trans_horizon(void);
+
+/*
+ * Function called as a transaction is about to commit or abort, once it is
+ * known which, but before any other transaction can tell.  For a commit,
+ * a nonzero return makes the transaction abort instead, and the hook is
+ * not called again.  The hook is called with the transaction's mutex held,
+ * so other transactions waiting on it keep waiting until it returns.
+ */
+typedef int TRANS_HOOK(TRANSACTION *tp, TRANS_STATUS status);
+
+/*
+ * Install the hook, or remove it if NULL.  Intended to be called while
+ * no transactions are being resolved.
+ */
+void trans_set_hook(TRANS_HOOK *hook);
+
+/*
+ * Wait until every transaction that has already called the hook to commit
+ * has been resolved.  Anything the hook did for such a transaction is then
+ * matched by its committed versions being visible in the store.
+ */
+void trans_hook_barrier(void);
+
+#endif
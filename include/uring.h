@@ -0,0 +1,79 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring wrapper, made directly from the system calls, for
+ * the io_uring engine of the event-driven server core (see evloop.h).
+ *
+ * A ring is used by a single thread.  Submission queue entries are taken
+ * with uring_get_sqe() and filled in by the caller; they are only passed
+ * to the kernel by uring_submit(), so entries prepared while handling a
+ * batch of completions go in with a single system call.  If the queue
+ * fills up, uring_get_sqe() submits what is in it to make room.
+ *
+ * A buffer ring is a set of equal-sized buffers registered with the
+ * kernel, from which a multishot receive picks one for each completion
+ * (IOSQE_BUFFER_SELECT).  The buffer ID comes back in the completion's
+ * flags, and the buffer is handed back with uring_buf_recycle() once its
+ * contents have been used.
+ */
+typedef struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_local;            // Tail including entries not yet published.
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+    unsigned entries;
+} URING;
+
+typedef struct uring_bufs {
+    struct io_uring_buf_ring *ring;
+    char *base;
+    unsigned count, size;
+    int group;
+} URING_BUFS;
+
+/*
+ * Set up a ring.
+ *
+ * @return  0 if successful, -1 if the kernel does not support io_uring.
+ */
+int uring_init(URING *rp, unsigned entries);
+void uring_fini(URING *rp);
+
+/*
+ * Get a cleared submission queue entry.
+ */
+struct io_uring_sqe *uring_get_sqe(URING *rp);
+
+/*
+ * Submit the entries prepared so far and, if wait is nonzero, wait until
+ * at least one completion is ready.
+ *
+ * @return  0 if successful, -1 otherwise.
+ */
+int uring_submit(URING *rp, int wait);
+
+/*
+ * Get the next completion, or NULL if there is none, and mark it seen
+ * once it has been handled.
+ */
+struct io_uring_cqe *uring_peek_cqe(URING *rp);
+void uring_cqe_seen(URING *rp);
+
+/*
+ * Register a buffer ring of count buffers (a power of 2) of size bytes.
+ *
+ * @return  0 if successful, -1 otherwise.
+ */
+int uring_bufs_init(URING *rp, URING_BUFS *bp, int group, unsigned count, unsigned size);
+char *uring_buf(URING_BUFS *bp, unsigned id);
+void uring_buf_recycle(URING_BUFS *bp, unsigned id);
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+
+#include "store.h"
+#include "checkpoint.h"
+
+/*
+ * Write-ahead log, which makes committed transactions survive a restart.
+ *
+ * While the log is open, the store reports every value put by a transaction
+ * with wal_note_put(), and the log keeps these as the transaction's write
+ * set.  When the transaction commits, its write set is appended to the log
+ * as a single record, before any other transaction can see that it has
+ * committed; when it aborts, the write set is simply dropped.  Transactions
+ * that only read write nothing.
+ *
+ * Records are appended to a buffer in memory, and written to the file from
+ * there by a background thread, the log thread.  Committing only appends
+ * the record; how long a commit waits before it is acknowledged, in
+ * wal_wait_durable(), depends on the durability policy:
+ *
+ *   WAL_SYNC_COMMIT:    until the record has been written and the file
+ *                       synced.  The log thread writes and syncs
+ *                       everything appended so far, so commits that arrive
+ *                       while a sync is under way share the next one
+ *                       ("group commit").
+ *   WAL_SYNC_INTERVAL:  not at all, unless more than WAL_BUFFER_MAX is
+ *                       waiting to be written.  The log thread writes and
+ *                       syncs the buffer every interval, so a crash may
+ *                       lose the commits of the last interval.
+ *   WAL_SYNC_NONE:      until the record has been written, but the file is
+ *                       only synced when the log is closed.  This survives
+ *                       the server process dying, but not the machine.
+ *
+ * Two transactions that put the same key are always ordered by a dependency,
+ * so their records appear in the log in the order of their IDs.  Replaying
+ * the records in log order, each overwriting the values of earlier ones,
+ * therefore rebuilds the committed state.
+ *
+ * The log is a sequence of records, each a header giving the length and a
+ * checksum of the payload, in host byte order, followed by the payload: a
+ * count of writes, then for each a key item and a value item.  An item is a
+ * 32-bit length followed by that many bytes, with a length of WAL_NULL_ITEM
+ * standing for a NULL value and having no content.  A record that was only
+ * partly written when the server died fails its checksum; it and anything
+ * after it are discarded when the log is opened.
+ *
+ * A checkpoint (see checkpoint.h) lets the log be cut short.  Taking one
+ * first moves the log aside to <log>.prev and starts a new, empty log, then
+ * waits for the transactions with records in the old log to be resolved,
+ * writes the checkpoint to <log>.ckpt, and finally deletes the old log.
+ * Every record not in the new log is then reflected in the checkpoint, and
+ * replaying the new log over the checkpoint brings any keys that changed
+ * while it was being written up to date.  Opening the log loads the
+ * checkpoint, then replays <log>.prev, if a crash left one behind, and the
+ * log itself.  Replaying old records over a newer checkpoint does no harm,
+ * since the last record for each key in the old log leaves it with the
+ * value it had when the checkpoint started.
+ */
+#define WAL_NULL_ITEM 0xffffffff
+
+/* Buffered bytes at which the log thread writes out without waiting. */
+#define WAL_BUFFER_MAX (1 << 20)
+
+/* Number of buckets in the table of pending write sets. */
+#define WAL_TXN_BUCKETS 64
+
+typedef enum {
+    WAL_SYNC_COMMIT, WAL_SYNC_INTERVAL, WAL_SYNC_NONE
+} WAL_SYNC;
+
+typedef struct wal_stats {
+    unsigned long commits;        // Records appended.
+    unsigned long bytes;          // Bytes appended.
+    unsigned long writes;         // Times the buffer was written to the file.
+    unsigned long syncs;          // Times the file was synced.
+    unsigned long recovered;      // Records replayed when the log was opened.
+    unsigned long discarded;      // Bytes of torn records discarded on opening.
+    long replay_nsecs;            // Time taken to replay the log on opening.
+    CKPT_STATS load;              // Loading the checkpoint on opening.
+    unsigned long checkpoints;    // Checkpoints taken.
+    CKPT_STATS checkpoint;        // The last checkpoint taken.
+} WAL_STATS;
+
+/*
+ * Open a log, creating it if need be, load its checkpoint, if there is one,
+ * and replay any records in the log into the store in a single transaction.
+ * From then on, committing transactions write to the log.  The transaction
+ * manager and the store must already have been initialized, and no other
+ * transactions may be running.
+ *
+ * @param path  Name of the log file.
+ * @param policy  Durability policy.
+ * @param interval_ms  Sync interval for WAL_SYNC_INTERVAL.
+ * @return  0 if successful, -1 if the log could not be opened.
+ */
+int wal_open(char *path, WAL_SYNC policy, int interval_ms);
+
+/*
+ * Take a checkpoint and drop the part of the log that it covers.  Only one
+ * checkpoint is taken at a time; transactions go on committing meanwhile.
+ *
+ * @return  0 if successful, -1 otherwise.  If it fails, the log is left
+ * intact, and the next checkpoint will cover what this one did not.
+ */
+int wal_checkpoint(void);
+
+/*
+ * Start a thread that takes a checkpoint at regular intervals.  It stops
+ * when the log is closed.
+ */
+void wal_checkpoint_start(int interval_ms);
+
+/*
+ * Write and sync anything still buffered, stop logging, and close the log.
+ * Does nothing if no log is open.
+ */
+void wal_close(void);
+
+/*
+ * Add a put to the write set of a transaction.  Called by the store, and
+ * does nothing if no log is open.  This borrows the key and value.
+ */
+void wal_note_put(TRANSACTION *tp, KEY *key, BLOB *value);
+
+/*
+ * Function called when a wait with wal_wait_durable() ends, with 0 if the
+ * log is durable, or -1 if it has failed.
+ */
+typedef void WAL_DONE_FUNC(int ret, void *arg);
+
+/*
+ * Wait for everything appended to the log so far to be as durable as the
+ * policy asks before a commit is acknowledged.  A commit calls this before
+ * it is acknowledged.  Since its record is then already appended, and so
+ * are those of the transactions whose values it could have read, they are
+ * all durable once the wait ends.  Writing and syncing are left out of
+ * committing itself, so that they are not done while the transaction is
+ * locked and other transactions wait on it.
+ *
+ * @param done  NULL to block until the log is durable, or a function that
+ * the log thread calls once it is, so that the caller does not block.
+ * @return  0 if the log is durable, or no wait is needed under the policy
+ * or with no log open; -1 if the log has failed; 1 if done will be called
+ * once the wait ends.
+ */
+int wal_wait_durable(WAL_DONE_FUNC *done, void *arg);
+
+/*
+ * Get the log statistics.
+ */
+void wal_get_stats(WAL_STATS *sp);
+
+#endif
@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "debug.h"
+#include "csapp.h"
+#include "checkpoint.h"
+#include "store_funcs.h"
+#include "transaction_funcs.h"
+
+static long elapsed_ns(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000L + (now.tv_nsec - start->tv_nsec);
+}
+
+/*
+ * State of a checkpoint being written.
+ */
+typedef struct ckpt_writer {
+    FILE *f;
+    uint64_t offset;              // Where the next entry goes.
+    uint64_t count;
+    uint64_t *offsets;
+    size_t chunks, cap;
+    int error;
+} CKPT_WRITER;
+
+static int write_entry(BLOB *key, BLOB *value, void *arg) {
+    CKPT_WRITER *wp = arg;
+    if(wp->count % CKPT_STRIDE == 0) {
+	if(wp->chunks == wp->cap) {
+	    wp->cap = wp->cap ? 2 * wp->cap : 64;
+	    wp->offsets = Realloc(wp->offsets, wp->cap * sizeof(uint64_t));
+	}
+	wp->offsets[wp->chunks++] = wp->offset;
+    }
+    uint32_t lens[2] = { key->size, value->size };
+    if(fwrite(lens, sizeof(lens), 1, wp->f) != 1
+       || fwrite(key->content, 1, key->size, wp->f) != key->size
+       || fwrite(value->content, 1, value->size, wp->f) != value->size) {
+	wp->error = 1;
+	return 1;
+    }
+    wp->offset += sizeof(lens) + key->size + value->size;
+    wp->count++;
+    return 0;
+}
+
+int ckpt_sync_dir(char *path) {
+    char *copy = strdup(path);
+    int fd = open(dirname(copy), O_RDONLY);
+    free(copy);
+    if(fd == -1)
+	return -1;
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+int ckpt_write(char *path, CKPT_SYNC_FUNC *sync, CKPT_STATS *sp) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t n = strlen(path) + 5;
+    char *tmp = Malloc(n);
+    snprintf(tmp, n, "%s.tmp", path);
+    CKPT_WRITER w = { 0 };
+    if((w.f = fopen(tmp, "w")) == NULL) {
+	free(tmp);
+	return -1;
+    }
+    setvbuf(w.f, NULL, _IOFBF, 1 << 20);
+    CKPT_HEADER h = { 0 };
+    w.offset = sizeof(h);
+    if(fwrite(&h, sizeof(h), 1, w.f) != 1)
+	w.error = 1;
+    if(!w.error)
+	store_scan_committed(NULL, NULL, 0, write_entry, &w);
+    memcpy(h.magic, CKPT_MAGIC, sizeof(h.magic));
+    h.count = w.count;
+    h.table = w.offset;
+    h.chunks = w.chunks;
+    if(!w.error && w.chunks > 0 && fwrite(w.offsets, sizeof(uint64_t), w.chunks, w.f) != w.chunks)
+	w.error = 1;
+    if(!w.error && (fseek(w.f, 0, SEEK_SET) == -1 || fwrite(&h, sizeof(h), 1, w.f) != 1
+		    || fflush(w.f) == EOF || fsync(fileno(w.f)) == -1))
+	w.error = 1;
+    if(fclose(w.f) == EOF)
+	w.error = 1;
+    free(w.offsets);
+    if(!w.error && sync != NULL && sync() == -1)
+	w.error = 1;
+    if(!w.error && (rename(tmp, path) == -1 || ckpt_sync_dir(path) == -1))
+	w.error = 1;
+    if(w.error)
+	unlink(tmp);
+    free(tmp);
+    if(sp != NULL) {
+	sp->entries = w.count;
+	sp->bytes = h.table + h.chunks * sizeof(uint64_t);
+	sp->threads = 1;
+	sp->nsecs = elapsed_ns(&start);
+    }
+    debug("Checkpoint of %lu entries written to %s", (unsigned long)w.count, path);
+    return w.error ? -1 : 0;
+}
+
+/*
+ * State shared by the threads loading a checkpoint.  Each thread takes
+ * the next chunk of entries that nobody has taken yet.
+ */
+typedef struct ckpt_loader {
+    const char *base;
+    CKPT_HEADER *header;
+    const uint64_t *offsets;
+    uint64_t next;                // Next chunk to take.
+    uint64_t loaded;              // Entries loaded so far.
+    int error;
+} CKPT_LOADER;
+
+/*
+ * Put the entries of one chunk into the store.
+ * Returns the number of entries, or -1 if the chunk is malformed.
+ */
+static long load_chunk(CKPT_LOADER *lp, TRANSACTION *tp, uint64_t c) {
+    uint64_t off = lp->offsets[c];
+    uint64_t end = c + 1 < lp->header->chunks ? lp->offsets[c + 1] : lp->header->table;
+    if(off < sizeof(CKPT_HEADER) || off > end || end > lp->header->table)
+	return -1;
+    long n = 0;
+    while(off < end) {
+	uint32_t lens[2];
+	if(end - off < sizeof(lens))
+	    return -1;
+	memcpy(lens, lp->base + off, sizeof(lens));
+	off += sizeof(lens);
+	if(end - off < (uint64_t)lens[0] + lens[1])
+	    return -1;
+	KEY *key = key_create(blob_create((char *)lp->base + off, lens[0]));
+	off += lens[0];
+	store_put(tp, key, blob_create((char *)lp->base + off, lens[1]));
+	off += lens[1];
+	n++;
+    }
+    return n;
+}
+
+static void *load_thread(void *arg) {
+    CKPT_LOADER *lp = arg;
+    TRANSACTION *tp = trans_create();
+    uint64_t c;
+    while((c = __atomic_fetch_add(&lp->next, 1, __ATOMIC_RELAXED)) < lp->header->chunks) {
+	long n = load_chunk(lp, tp, c);
+	if(n == -1) {
+	    lp->error = 1;
+	    break;
+	}
+	__atomic_add_fetch(&lp->loaded, n, __ATOMIC_RELAXED);
+    }
+    trans_commit(tp);
+    return NULL;
+}
+
+int ckpt_load(char *path, int nthreads, CKPT_STATS *sp) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(sp != NULL)
+	memset(sp, 0, sizeof(*sp));
+    int fd = open(path, O_RDONLY);
+    if(fd == -1)
+	return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(CKPT_HEADER)) {
+	close(fd);
+	return -1;
+    }
+    size_t size = st.st_size;
+    char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+	return -1;
+    CKPT_LOADER l = { .base = base, .header = (CKPT_HEADER *)base };
+    CKPT_HEADER *h = l.header;
+    if(memcmp(h->magic, CKPT_MAGIC, sizeof(h->magic)) || h->table > size
+       || h->chunks > (size - h->table) / sizeof(uint64_t)) {
+	munmap(base, size);
+	return -1;
+    }
+    l.offsets = (const uint64_t *)(base + h->table);
+    if(nthreads <= 0)
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if((uint64_t)nthreads > h->chunks)
+	nthreads = h->chunks > 0 ? h->chunks : 1;
+    pthread_t *tids = Malloc(nthreads * sizeof(pthread_t));
+    for(int i = 0; i < nthreads; i++)
+	Pthread_create(&tids[i], NULL, load_thread, &l);
+    for(int i = 0; i < nthreads; i++)
+	Pthread_join(tids[i], NULL);
+    free(tids);
+    int ret = l.error || l.loaded != h->count ? -1 : 0;
+    munmap(base, size);
+    if(sp != NULL) {
+	sp->entries = l.loaded;
+	sp->bytes = size;
+	sp->threads = nthreads;
+	sp->nsecs = elapsed_ns(&start);
+    }
+    debug("Loaded %lu entries from checkpoint %s with %d threads", l.loaded, path, nthreads);
+    return ret;
+}
@@ -2,70 +2,203 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include "debug.h"
 #include "csapp.h"
 #include <semaphore.h>
 #include "data.h"
+#include "data_funcs.h"
 
-void decrease_cnt(BLOB *bp);
-void increase_cnt(BLOB *bp);
+int decrease_cnt(BLOB *bp);
+int increase_cnt(BLOB *bp);
 
-BLOB *blob_create(char *content, size_t size)
+/*
+ * The single allocation holding a blob.  The hash of the content is
+ * computed the first time it is asked for, and kept; hashed is set, with
+ * release ordering, once hash is valid.
+ */
+typedef struct blob_block
+{
+    BLOB blob;
+    unsigned int hash;
+    int hashed;
+    char content[];
+} BLOB_BLOCK;
+
+static uint64_t hash_seed = BLOB_HASH_SEED;
+
+void blob_set_hash_seed(uint64_t seed)
+{
+    hash_seed = seed;
+}
+
+BLOB *blob_alloc(size_t size)
 {
-    BLOB *bp = Malloc(sizeof(BLOB));
-    pthread_mutex_init(&(bp->mutex), NULL);
-    blob_ref(bp,"Blob");
-    bp->prefix = malloc(size);
-    bp->content = malloc(size);
+    BLOB_BLOCK *block = Malloc(sizeof(BLOB_BLOCK) + size + 1);
+    BLOB *bp = &block->blob;
+    block->hashed = 0;
+    bp->refcnt = 1;
     bp->size = size;
-    strncpy(bp->prefix,content,size);
-    strncpy(bp->content,content,size);
+    bp->content = block->content;
+    bp->prefix = NULL;
+    bp->content[size] = '\0';
+    debug("Allocate blob %p of size %lu", bp, size);
     return bp;
 }
+
+BLOB *blob_create(char *content, size_t size)
+{
+    BLOB *bp = blob_alloc(size);
+    memcpy(bp->content, content, size);
+    debug("Create blob %p [%s] of size %lu", bp, blob_prefix(bp), size);
+    return bp;
+}
+char *blob_prefix(BLOB *bp)
+{
+#ifdef DEBUG
+    char *prefix = __atomic_load_n(&bp->prefix, __ATOMIC_ACQUIRE);
+    if(prefix != NULL)
+        return prefix;
+    size_t n = bp->size < BLOB_PREFIX_MAX ? bp->size : BLOB_PREFIX_MAX;
+    prefix = Malloc(n + 4);
+    for(size_t i = 0; i < n; i++)
+        prefix[i] = isprint((unsigned char)bp->content[i]) ? bp->content[i] : '.';
+    strcpy(prefix + n, n < bp->size ? "..." : "");
+    // Another thread may have got there first.
+    char *expected = NULL;
+    if(!__atomic_compare_exchange_n(&bp->prefix, &expected, prefix, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        free(prefix);
+        return expected;
+    }
+    return prefix;
+#else
+    return "";
+#endif
+}
 BLOB *blob_ref(BLOB *bp, char *why)
 {
     if(bp!=NULL)
     {
-    pthread_mutex_lock(&(bp->mutex));
     increase_cnt(bp);
-    pthread_mutex_unlock(&(bp->mutex));
+    debug("Increase reference count on blob %p [%s] for %s", bp, blob_prefix(bp), why);
     }
     return bp;
 }
 int blob_compare(BLOB *bp1, BLOB *bp2)
 {
-    if(strcmp(bp1->content,bp2->content)!=0)
-    {
+    if(bp1==bp2)
+        return 0;
+    if(bp1->size!=bp2->size)
         return 1;
-    }
-    else return 0;
+    return memcmp(bp1->content,bp2->content,bp1->size)!=0;
 }
 void blob_unref(BLOB *bp, char *why)
 {
     if(bp!=NULL)
     {
-    pthread_mutex_lock(&(bp->mutex));
-    decrease_cnt(bp);
-    if(bp->refcnt==0)
+    debug("Decrease reference count on blob %p [%s] for %s", bp, blob_prefix(bp), why);
+    if(decrease_cnt(bp)==0)
     {
-        pthread_mutex_unlock(&(bp->mutex));
+        free(bp->prefix);
         free(bp);
-        return;
     }
-        pthread_mutex_unlock(&(bp->mutex));
     }
 }
-int blob_hash(BLOB *bp)
-{
-    int hash = 0;
-    int c;
+/*
+ * Hashing follows wyhash (final version 4, public domain): the content is
+ * read eight bytes at a time, sixteen or forty-eight bytes per round, and
+ * each pair of words is mixed by a 64x64->128-bit multiplication whose
+ * halves are folded together.  Content of up to 16 bytes is read as at
+ * most four overlapping words, so short keys take no loop at all.
+ */
+#define WY0 0xa0761d6478bd642full
+#define WY1 0xe7037ed1a0b428dbull
+#define WY2 0x8ebc6af09c88c6e3ull
+#define WY3 0x589965cc75374cc3ull
 
-    while ((c = *bp->content++)){
-        hash = ((hash << 5) + hash) + c;
+static inline uint64_t wymix(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+static inline uint64_t read64(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+static inline uint64_t read32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+uint64_t hash_bytes(const char *p, size_t len, uint64_t seed)
+{
+    uint64_t a, b;
+    seed ^= wymix(seed ^ WY0, WY1);
+    if(len <= 16)
+    {
+        if(len >= 4)
+        {
+            size_t d = (len >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + d);
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - d);
+        }
+        else if(len > 0)
+        {
+            a = ((uint64_t)(uint8_t)p[0] << 16) | ((uint64_t)(uint8_t)p[len >> 1] << 8)
+                | (uint8_t)p[len - 1];
+            b = 0;
+        }
+        else
+            a = b = 0;
     }
-
-    return hash;
+    else
+    {
+        size_t i = len;
+        if(i > 48)
+        {
+            uint64_t s1 = seed, s2 = seed;
+            do
+            {
+                seed = wymix(read64(p) ^ WY1, read64(p + 8) ^ seed);
+                s1 = wymix(read64(p + 16) ^ WY2, read64(p + 24) ^ s1);
+                s2 = wymix(read64(p + 32) ^ WY3, read64(p + 40) ^ s2);
+                p += 48;
+                i -= 48;
+            } while(i > 48);
+            seed ^= s1 ^ s2;
+        }
+        while(i > 16)
+        {
+            seed = wymix(read64(p) ^ WY1, read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+    a ^= WY1;
+    b ^= seed;
+    __uint128_t r = (__uint128_t)a * b;
+    return wymix((uint64_t)r ^ WY0 ^ len, (uint64_t)(r >> 64) ^ WY1);
+}
+int blob_hash(BLOB *bp)
+{
+    BLOB_BLOCK *block = (BLOB_BLOCK *)bp;
+    if(__atomic_load_n(&block->hashed, __ATOMIC_ACQUIRE))
+        return block->hash;
+    uint64_t h = hash_bytes(bp->content, bp->size, hash_seed);
+    // Racing threads compute the same value, so either may store it.
+    __atomic_store_n(&block->hash, (unsigned int)(h ^ (h >> 32)), __ATOMIC_RELAXED);
+    __atomic_store_n(&block->hashed, 1, __ATOMIC_RELEASE);
+    return block->hash;
 }
 VERSION *version_create(TRANSACTION *tp, BLOB *bp)
 {
@@ -108,25 +241,31 @@ KEY *key_create(BLOB *bp)
 }
 int key_compare(KEY *kp1, KEY *kp2)
 {
-    if(blob_compare(kp1->blob,kp2->blob)==0)
-    {
-        if(kp1->hash==kp2->hash)
-        {
-            return 0;
-        }
-    }
-    return 1;
+    if(kp1->hash!=kp2->hash)
+        return 1;
+    return blob_compare(kp1->blob,kp2->blob);
 }
 void key_dispose(KEY *kp)
 {
     blob_unref(kp->blob,"For key disposal");
     free(kp);
 }
-void decrease_cnt(BLOB *bp)
+/*
+ * The reference count is updated atomically rather than under the blob's
+ * mutex, which is not used.  Taking a reference needs no ordering, since
+ * the caller already holds one.  Dropping one is a release, so that all
+ * uses of the blob through it happen before the count can be seen to reach
+ * zero, and whoever takes it to zero acquires before freeing the blob.
+ * Returns the new count.
+ */
+int decrease_cnt(BLOB *bp)
 {
-    bp->refcnt--;
+    int n = __atomic_sub_fetch(&bp->refcnt, 1, __ATOMIC_RELEASE);
+    if(n==0)
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return n;
 }
-void increase_cnt(BLOB *bp)
+int increase_cnt(BLOB *bp)
 {
-    bp->refcnt++;
+    return __atomic_add_fetch(&bp->refcnt, 1, __ATOMIC_RELAXED);
 }
\ No newline at end of file
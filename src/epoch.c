@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <sched.h>
+
+#include "debug.h"
+#include "csapp.h"
+#include "epoch.h"
+
+/*
+ * Number of objects a thread may retire before it tries to advance the
+ * global epoch and free what it can.
+ */
+#define EPOCH_RETIRE_BATCH 64
+
+/*
+ * An object waiting to be freed, tagged with the epoch in which it was retired.
+ */
+typedef struct limbo {
+    void *ptr;
+    void (*free_fn)(void *);
+    unsigned long epoch;
+    struct limbo *next;
+} LIMBO;
+
+/*
+ * Per-thread state.  The state word is (epoch << 1) | 1 while the thread
+ * is inside a critical section and 0 otherwise, so that other threads can
+ * read both at once.  Records are never freed; a record whose thread has
+ * exited is reused by the next thread to register.
+ */
+typedef struct epoch_thread {
+    unsigned long state;
+    int depth;                  // Critical section nesting depth.
+    int in_use;                 // Whether a live thread owns this record.
+    LIMBO *limbo;               // Objects retired by this thread, newest first.
+    int nlimbo;
+    struct epoch_thread *next;  // Next in list of all records.
+} EPOCH_THREAD;
+
+static unsigned long global_epoch;
+static EPOCH_THREAD *threads;
+static LIMBO *orphans;           // Retired by threads that have since exited.
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static __thread EPOCH_THREAD *self;
+
+/*
+ * Called when a registered thread exits: hand its pending objects over to
+ * the orphan list and release the record for reuse.
+ */
+static void thread_exit(void *arg) {
+    EPOCH_THREAD *rec = arg;
+    pthread_mutex_lock(&threads_mutex);
+    while(rec->limbo != NULL) {
+	LIMBO *lp = rec->limbo;
+	rec->limbo = lp->next;
+	lp->next = orphans;
+	orphans = lp;
+    }
+    rec->nlimbo = 0;
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+    rec->in_use = 0;
+    pthread_mutex_unlock(&threads_mutex);
+}
+
+static void make_thread_key(void) {
+    if(pthread_key_create(&thread_key, thread_exit))
+	unix_error("pthread_key_create error");
+}
+
+static EPOCH_THREAD *get_self(void) {
+    if(self != NULL)
+	return self;
+    pthread_once(&thread_key_once, make_thread_key);
+    pthread_mutex_lock(&threads_mutex);
+    EPOCH_THREAD *rec;
+    for(rec = threads; rec != NULL; rec = rec->next) {
+	if(!rec->in_use)
+	    break;
+    }
+    if(rec == NULL) {
+	rec = Calloc(1, sizeof(EPOCH_THREAD));
+	rec->next = threads;
+	__atomic_store_n(&threads, rec, __ATOMIC_RELEASE);
+    }
+    rec->in_use = 1;
+    pthread_mutex_unlock(&threads_mutex);
+    pthread_setspecific(thread_key, rec);
+    self = rec;
+    return rec;
+}
+
+void epoch_enter(void) {
+    EPOCH_THREAD *rec = get_self();
+    if(rec->depth++ > 0)
+	return;
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->state, (e << 1) | 1, __ATOMIC_RELAXED);
+    // The announcement must be visible before any shared pointer is read.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void) {
+    EPOCH_THREAD *rec = self;
+    if(--rec->depth > 0)
+	return;
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Advance the global epoch if every thread in a critical section has
+ * observed its current value.
+ */
+static void try_advance(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    for(EPOCH_THREAD *rec = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+	rec != NULL; rec = rec->next) {
+	unsigned long st = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+	if((st & 1) && (st >> 1) != e)
+	    return;
+    }
+    __atomic_compare_exchange_n(&global_epoch, &e, e + 1, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/*
+ * Free the objects on a limbo list that were retired at least two epochs
+ * ago.  The list is newest first, so everything after the first such object
+ * can go too.  Returns the number of objects freed.
+ */
+static int reclaim(LIMBO **listp) {
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    while(*listp != NULL && (*listp)->epoch + 2 > e)
+	listp = &(*listp)->next;
+    LIMBO *lp = *listp;
+    *listp = NULL;
+    int n = 0;
+    while(lp != NULL) {
+	LIMBO *next = lp->next;
+	lp->free_fn(lp->ptr);
+	free(lp);
+	lp = next;
+	n++;
+    }
+    return n;
+}
+
+static void reclaim_orphans(void) {
+    if(__atomic_load_n(&orphans, __ATOMIC_RELAXED) == NULL
+       || pthread_mutex_trylock(&threads_mutex))
+	return;
+    reclaim(&orphans);
+    pthread_mutex_unlock(&threads_mutex);
+}
+
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+    EPOCH_THREAD *rec = get_self();
+    LIMBO *lp = Malloc(sizeof(LIMBO));
+    lp->ptr = ptr;
+    lp->free_fn = free_fn;
+    lp->epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    lp->next = rec->limbo;
+    rec->limbo = lp;
+    if(++rec->nlimbo >= EPOCH_RETIRE_BATCH) {
+	try_advance();
+	rec->nlimbo -= reclaim(&rec->limbo);
+	reclaim_orphans();
+    }
+}
+
+void epoch_barrier(void) {
+    EPOCH_THREAD *rec = get_self();
+    unsigned long target = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) + 2;
+    while(__atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) < target) {
+	try_advance();
+	sched_yield();
+    }
+    rec->nlimbo -= reclaim(&rec->limbo);
+    reclaim_orphans();
+}
+
+static void free_all(LIMBO *lp) {
+    while(lp != NULL) {
+	LIMBO *next = lp->next;
+	lp->free_fn(lp->ptr);
+	free(lp);
+	lp = next;
+    }
+}
+
+void epoch_fini(void) {
+    debug("Free all retired objects");
+    pthread_mutex_lock(&threads_mutex);
+    for(EPOCH_THREAD *rec = threads; rec != NULL; rec = rec->next) {
+	free_all(rec->limbo);
+	rec->limbo = NULL;
+	rec->nlimbo = 0;
+    }
+    free_all(orphans);
+    orphans = NULL;
+    pthread_mutex_unlock(&threads_mutex);
+}
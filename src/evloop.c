@@ -0,0 +1,635 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "debug.h"
+#include "csapp.h"
+#include "evloop.h"
+#include "server_funcs.h"
+#include "uring.h"
+
+typedef struct ev_loop {
+    int epfd;
+    pthread_t tid;
+} EV_LOOP;
+
+/*
+ * State of a connection owned by an event loop.  The complete requests at
+ * the front of the input are handed to a worker as a buffer of their own,
+ * so that the io_uring loop can go on receiving into the input meanwhile.
+ */
+typedef struct ev_conn {
+    int fd;
+    EV_LOOP *loop;
+    SESSION *sp;                  // NULL once the session is closed.
+    char *in;                     // Input read but not yet handled.
+    size_t in_len, in_cap;
+    char *work;                   // Requests being handled by a worker.
+    size_t work_len;
+    int eof;                      // Whether the client has stopped sending.
+    int closing;                  // Whether to close once the output is out.
+    int result;                   // What session_serve() returned.
+    int fed;                      // Whether the work is fed to the session.
+    int waiting;                  // Whether the session waits for a commit.
+    int arrivals;                 // Of the worker and the commit, once waiting.
+    // Used by the io_uring engine only.
+    int serving;                  // Whether a worker has the connection.
+    int sending;                  // Whether a send is in flight.
+    int receiving;                // Whether a multishot receive is armed.
+    int stopping;                 // Whether the receive is being cancelled.
+    struct ev_conn *next;         // Next in the queue of work.
+} EV_CONN;
+
+static EV_LOOP *loops;
+static int num_loops;
+static unsigned int next_loop;
+
+/*
+ * Connections with requests ready, waiting for a worker.
+ */
+static EV_CONN *work_head, *work_tail;
+static pthread_mutex_t work_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+
+static void work_push(EV_CONN *cp) {
+    cp->next = NULL;
+    pthread_mutex_lock(&work_mutex);
+    if(work_tail != NULL)
+	work_tail->next = cp;
+    else
+	work_head = cp;
+    work_tail = cp;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&work_mutex);
+}
+
+static EV_CONN *work_pop(void) {
+    pthread_mutex_lock(&work_mutex);
+    while(work_head == NULL)
+	pthread_cond_wait(&work_cond, &work_mutex);
+    EV_CONN *cp = work_head;
+    if((work_head = cp->next) == NULL)
+	work_tail = NULL;
+    pthread_mutex_unlock(&work_mutex);
+    return cp;
+}
+
+/*
+ * A session waiting for a commit goes on once both the worker that served
+ * it has let go of it and the commit has finished, whichever comes second.
+ */
+static void conn_arrive(EV_CONN *cp) {
+    if(__atomic_add_fetch(&cp->arrivals, 1, __ATOMIC_ACQ_REL) == 2) {
+	cp->arrivals = 0;
+	work_push(cp);
+    }
+}
+
+static void conn_wake(void *arg) {
+    conn_arrive(arg);
+}
+
+/*
+ * Watch a connection for one event, after which it belongs to the thread
+ * that sees the event.
+ */
+static void conn_arm(EV_CONN *cp, uint32_t events) {
+    struct epoll_event ev = { .events = events | EPOLLONESHOT, .data.ptr = cp };
+    if(epoll_ctl(cp->loop->epfd, EPOLL_CTL_MOD, cp->fd, &ev) == -1)
+	unix_error("epoll_ctl error");
+}
+
+static void conn_close(EV_CONN *cp) {
+    // Closing the descriptor also takes it out of the epoll set.
+    session_close(cp->sp);
+    free(cp->in);
+    free(cp->work);
+    free(cp);
+}
+
+/*
+ * Whether the input of a connection is as full as it is let get: it holds
+ * at least EVLOOP_INPUT_HIGH bytes and a complete request, or a packet over
+ * the limit, which there is no point reading any further.
+ */
+static int conn_input_full(EV_CONN *cp) {
+    return cp->in_len >= EVLOOP_INPUT_HIGH
+	&& proto_request_length(cp->in, cp->in_len, session_packet_max()) != 0;
+}
+
+/*
+ * Read what has arrived on a connection, until the socket has no more or the
+ * input is full.
+ */
+static void conn_read_input(EV_CONN *cp) {
+    while(!conn_input_full(cp)) {
+	if(cp->in_cap - cp->in_len < EVLOOP_READ_SIZE) {
+	    size_t cap = cp->in_cap ? 2 * cp->in_cap : EVLOOP_READ_SIZE;
+	    while(cap - cp->in_len < EVLOOP_READ_SIZE)
+		cap *= 2;
+	    cp->in = Realloc(cp->in, cap);
+	    cp->in_cap = cap;
+	}
+	size_t want = cp->in_cap - cp->in_len;
+	ssize_t n = read(cp->fd, cp->in + cp->in_len, want);
+	if(n < 0) {
+	    if(errno == EINTR)
+		continue;
+	    if(errno != EAGAIN && errno != EWOULDBLOCK)
+		cp->eof = 1;
+	    break;
+	}
+	if(n == 0) {
+	    cp->eof = 1;
+	    break;
+	}
+	cp->in_len += n;
+	if((size_t)n < want)
+	    break;
+    }
+}
+
+/*
+ * Add bytes received to the input of a connection.
+ */
+static void conn_append(EV_CONN *cp, const char *buf, size_t n) {
+    if(cp->in_cap - cp->in_len < n) {
+	size_t cap = cp->in_cap ? 2 * cp->in_cap : EVLOOP_READ_SIZE;
+	while(cap - cp->in_len < n)
+	    cap *= 2;
+	cp->in = Realloc(cp->in, cap);
+	cp->in_cap = cap;
+    }
+    memcpy(cp->in + cp->in_len, buf, n);
+    cp->in_len += n;
+}
+
+/*
+ * If the input starts with complete requests, move them to the work of the
+ * connection, keeping the rest as the input.
+ *
+ * @return  1 if there is work to be done, 0 if not, -1 if the input has a
+ * packet over the limit and the connection should be closed.
+ */
+static int conn_take_work(EV_CONN *cp) {
+    size_t off = 0, n;
+    while((n = proto_request_length(cp->in + off, cp->in_len - off,
+				     session_packet_max())) > 0) {
+	if(n == XACTO_TOO_LARGE) {
+	    debug("Packet over %lu bytes on connection %d", session_packet_max(), cp->fd);
+	    return -1;
+	}
+	off += n;
+    }
+    if(off == 0)
+	return 0;
+    size_t len = cp->in_len;
+    cp->work = cp->in;
+    cp->work_len = off;
+    cp->in = NULL;
+    cp->in_len = cp->in_cap = 0;
+    if(off < len)
+	conn_append(cp, cp->work + off, len - off);
+    return 1;
+}
+
+/*
+ * Handle an event on a connection, in its epoll loop: write out pending
+ * output, then go on with requests the session stopped short of, or read
+ * input, and hand the connection to a worker once it has complete requests.
+ */
+static void conn_event(EV_CONN *cp) {
+    XACTO_CONN *xp = session_conn(cp->sp);
+    if(proto_conn_unsent(xp) > 0) {
+	if(proto_conn_flush(xp) == -1) {
+	    conn_close(cp);
+	    return;
+	}
+	if(proto_conn_unsent(xp) > 0) {
+	    conn_arm(cp, EPOLLOUT);
+	    return;
+	}
+    }
+    if(cp->closing) {
+	conn_close(cp);
+	return;
+    }
+    if(cp->work != NULL) {
+	work_push(cp);
+	return;
+    }
+    conn_read_input(cp);
+    int ret = conn_take_work(cp);
+    if(ret == 1)
+	work_push(cp);
+    else if(ret == -1 || cp->eof)
+	conn_close(cp);
+    else
+	conn_arm(cp, EPOLLIN);
+}
+
+/*
+ * Give a connection back to its epoll loop once a worker has served it.
+ */
+static void conn_served(EV_CONN *cp) {
+    XACTO_CONN *xp = session_conn(cp->sp);
+    // Everything the client sent before it stopped has now been handled.
+    if(cp->result == -1 || (cp->eof && cp->work == NULL))
+	cp->closing = 1;
+    if(proto_conn_flush(xp) == -1)
+	conn_close(cp);
+    else if(proto_conn_unsent(xp) > 0)
+	conn_arm(cp, EPOLLOUT);
+    else if(cp->closing)
+	conn_close(cp);
+    else if(cp->work != NULL)
+	work_push(cp);
+    else
+	conn_arm(cp, EPOLLIN);
+}
+
+static void *loop_thread(void *arg) {
+    EV_LOOP *lp = arg;
+    struct epoll_event events[EVLOOP_MAX_EVENTS];
+    for(;;) {
+	int n = epoll_wait(lp->epfd, events, EVLOOP_MAX_EVENTS, -1);
+	if(n == -1) {
+	    if(errno == EINTR)
+		continue;
+	    unix_error("epoll_wait error");
+	}
+	for(int i = 0; i < n; i++)
+	    conn_event(events[i].data.ptr);
+    }
+    return NULL;
+}
+
+/*
+ * The io_uring engine.  A single thread owns the ring, on which a multishot
+ * accept takes new connections and a multishot receive per connection
+ * brings in input, into buffers picked from a registered buffer ring.
+ * Workers hand served connections back through a queue and an eventfd the
+ * ring reads from, and the ring thread sends the output they could not
+ * write out without blocking.  The sends and
+ * re-armed operations prepared while handling a batch of completions are
+ * submitted together.
+ */
+#define RING_ACCEPT 1
+#define RING_RECV 2
+#define RING_SEND 3
+#define RING_WAKE 4
+#define RING_CANCEL 5
+#define RING_TAG_MASK 7
+
+static int use_uring;
+static URING ring;
+static URING_BUFS ring_bufs;
+static int ring_listenfd, ring_eventfd;
+static uint64_t ring_wakeups;
+
+/* Connections served by workers, waiting to be given back to the ring. */
+static EV_CONN *done_head, *done_tail;
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct io_uring_sqe *ring_sqe(void *ptr, int tag) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    sqe->user_data = (uint64_t)(uintptr_t)ptr | tag;
+    return sqe;
+}
+
+static void ring_accept(void) {
+    struct io_uring_sqe *sqe = ring_sqe(NULL, RING_ACCEPT);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring_listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+static void ring_recv(EV_CONN *cp) {
+    struct io_uring_sqe *sqe = ring_sqe(cp, RING_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = cp->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ring_bufs.group;
+    cp->receiving = 1;
+}
+
+/*
+ * Keep the receive of a connection armed only while its input is not full
+ * and, when no worker has it, its output is not past SESSION_OUTPUT_HIGH.
+ * A multishot receive goes on adding to the input for as long as it is
+ * armed, so it is cancelled once either limit is reached, and armed again
+ * once the connection has caught up.
+ */
+static void ring_throttle(EV_CONN *cp) {
+    if(cp->sp == NULL || cp->closing || cp->eof)
+	return;
+    int full = conn_input_full(cp)
+	|| (!cp->serving && proto_conn_unsent(session_conn(cp->sp)) > SESSION_OUTPUT_HIGH);
+    if(full && cp->receiving && !cp->stopping) {
+	struct io_uring_sqe *sqe = ring_sqe(NULL, RING_CANCEL);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uintptr_t)cp | RING_RECV;
+	cp->stopping = 1;
+    } else if(!full && !cp->receiving) {
+	ring_recv(cp);
+    }
+}
+
+static void ring_send(EV_CONN *cp) {
+    size_t len;
+    char *out = proto_conn_output(session_conn(cp->sp), &len);
+    struct io_uring_sqe *sqe = ring_sqe(cp, RING_SEND);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = cp->fd;
+    sqe->addr = (uintptr_t)out;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    cp->sending = 1;
+}
+
+static void ring_wake(void) {
+    struct io_uring_sqe *sqe = ring_sqe(NULL, RING_WAKE);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ring_eventfd;
+    sqe->addr = (uintptr_t)&ring_wakeups;
+    sqe->len = sizeof(ring_wakeups);
+}
+
+/*
+ * Move a connection on, in the ring thread, once nothing is in flight for
+ * it but its receive: send its output, hand it to a worker, or close it.
+ */
+static void ring_progress(EV_CONN *cp) {
+    ring_throttle(cp);
+    if(cp->serving || cp->sending)
+	return;
+    if(cp->sp != NULL && !cp->closing) {
+	if(proto_conn_unsent(session_conn(cp->sp)) > 0) {
+	    ring_send(cp);
+	    return;
+	}
+	int ret = cp->work != NULL ? 1 : conn_take_work(cp);
+	if(ret == 1) {
+	    cp->serving = 1;
+	    work_push(cp);
+	    // The input it has taken off may make room for the receive.
+	    ring_throttle(cp);
+	    return;
+	}
+	if(ret == -1 || cp->eof)
+	    cp->closing = 1;
+    }
+    if(cp->closing && cp->sp != NULL) {
+	if(proto_conn_unsent(session_conn(cp->sp)) > 0) {
+	    ring_send(cp);
+	    return;
+	}
+	// This ends the receive, whose last completion frees the connection.
+	shutdown(cp->fd, SHUT_RDWR);
+	session_close(cp->sp);
+	cp->sp = NULL;
+    }
+    if(cp->sp == NULL && !cp->receiving) {
+	free(cp->in);
+	free(cp->work);
+	free(cp);
+    }
+}
+
+static void ring_complete(uint64_t data, int res, unsigned flags) {
+    EV_CONN *cp = (EV_CONN *)(uintptr_t)(data & ~(uint64_t)RING_TAG_MASK);
+    switch(data & RING_TAG_MASK) {
+    case RING_ACCEPT:
+	if(res >= 0) {
+	    cp = Calloc(1, sizeof(EV_CONN));
+	    cp->fd = res;
+	    cp->sp = session_open(res, 1);
+	    session_set_wake(cp->sp, conn_wake, cp);
+	    ring_recv(cp);
+	}
+	if(!(flags & IORING_CQE_F_MORE))
+	    ring_accept();
+	return;
+    case RING_RECV:
+	if(res > 0) {
+	    unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+	    if(cp->sp != NULL && !cp->closing)
+		conn_append(cp, uring_buf(&ring_bufs, id), res);
+	    uring_buf_recycle(&ring_bufs, id);
+	} else if(res != -ENOBUFS && res != -ECANCELED) {
+	    cp->eof = 1;
+	}
+	// The receive may also stop when it runs out of buffers.
+	if(!(flags & IORING_CQE_F_MORE))
+	    cp->receiving = cp->stopping = 0;
+	ring_progress(cp);
+	return;
+    case RING_CANCEL:
+	// The receive it cancels completes as well, with -ECANCELED.
+	return;
+    case RING_SEND:
+	cp->sending = 0;
+	if(res < 0) {
+	    size_t len;
+	    proto_conn_output(session_conn(cp->sp), &len);
+	    proto_conn_sent(session_conn(cp->sp), len);
+	    cp->closing = 1;
+	} else {
+	    proto_conn_sent(session_conn(cp->sp), res);
+	}
+	ring_progress(cp);
+	return;
+    case RING_WAKE:
+	pthread_mutex_lock(&done_mutex);
+	EV_CONN *list = done_head;
+	done_head = done_tail = NULL;
+	pthread_mutex_unlock(&done_mutex);
+	while(list != NULL) {
+	    cp = list;
+	    list = cp->next;
+	    cp->serving = 0;
+	    if(cp->result == -1)
+		cp->closing = 1;
+	    ring_progress(cp);
+	}
+	ring_wake();
+	return;
+    }
+}
+
+static void *ring_thread(void *arg) {
+    ring_accept();
+    ring_wake();
+    for(;;) {
+	if(uring_submit(&ring, 1) == -1)
+	    unix_error("io_uring_enter error");
+	struct io_uring_cqe *cqe;
+	while((cqe = uring_peek_cqe(&ring)) != NULL) {
+	    uint64_t data = cqe->user_data;
+	    int res = cqe->res;
+	    unsigned flags = cqe->flags;
+	    uring_cqe_seen(&ring);
+	    ring_complete(data, res, flags);
+	}
+    }
+    return NULL;
+}
+
+/*
+ * Give a connection back to the ring thread once a worker has served it.
+ */
+static void ring_served(EV_CONN *cp) {
+    cp->next = NULL;
+    pthread_mutex_lock(&done_mutex);
+    if(done_tail != NULL)
+	done_tail->next = cp;
+    else
+	done_head = cp;
+    done_tail = cp;
+    pthread_mutex_unlock(&done_mutex);
+    uint64_t one = 1;
+    if(write(ring_eventfd, &one, sizeof(one)) == -1)
+	unix_error("eventfd write error");
+}
+
+/*
+ * Whether the kernel supports what the io_uring engine needs: a buffer
+ * ring and multishot receives, which came last.  A receive is tried out on
+ * a socket pair.
+ */
+static int ring_supported(void) {
+    int sv[2];
+    if(uring_bufs_init(&ring, &ring_bufs, 0, EVLOOP_RING_BUFS, EVLOOP_READ_SIZE) == -1
+       || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+	return 0;
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ring_bufs.group;
+    int ok = write(sv[1], "x", 1) == 1 && uring_submit(&ring, 1) == 0;
+    struct io_uring_cqe *cqe = uring_peek_cqe(&ring);
+    ok = ok && cqe != NULL && cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE);
+    if(cqe != NULL) {
+	if(cqe->flags & IORING_CQE_F_BUFFER)
+	    uring_buf_recycle(&ring_bufs, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	uring_cqe_seen(&ring);
+    }
+    shutdown(sv[0], SHUT_RDWR);
+    close(sv[0]);
+    close(sv[1]);
+    // Wait for the receive to finish, so it is not taken for a connection.
+    while(ok) {
+	if(uring_submit(&ring, 1) == -1 || (cqe = uring_peek_cqe(&ring)) == NULL)
+	    return 0;
+	int more = cqe->flags & IORING_CQE_F_MORE;
+	if(cqe->flags & IORING_CQE_F_BUFFER)
+	    uring_buf_recycle(&ring_bufs, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	uring_cqe_seen(&ring);
+	if(!more)
+	    break;
+    }
+    return ok;
+}
+
+/*
+ * Serve the complete requests of a connection, in a worker.  If the session
+ * stops to wait for a commit, the connection is left with neither its loop
+ * nor a worker until the commit finishes, with the rest of its requests
+ * still fed to the session.  If it stops for its output to be written, the
+ * rest stay fed to it, and the connection is served again once the output
+ * is out.
+ */
+static void conn_serve(EV_CONN *cp) {
+    XACTO_CONN *xp = session_conn(cp->sp);
+    if(!cp->fed) {
+	proto_conn_feed(xp, cp->work, cp->work_len);
+	cp->fed = 1;
+    }
+    cp->result = session_serve(cp->sp);
+    if((cp->waiting = cp->result == 1)) {
+	// The replies before the commit are already out, as far as they go.
+	conn_arrive(cp);
+	return;
+    }
+    if(cp->result != 2) {
+	proto_conn_feed(xp, NULL, 0);
+	free(cp->work);
+	cp->work = NULL;
+	cp->work_len = 0;
+	cp->fed = 0;
+    }
+    if(use_uring) {
+	if(proto_conn_flush(xp) == -1)
+	    cp->result = -1;
+	ring_served(cp);
+    } else {
+	conn_served(cp);
+    }
+}
+
+static void *worker_thread(void *arg) {
+    EV_CONN *cp;
+    while((cp = work_pop()) != NULL)
+	conn_serve(cp);
+    return NULL;
+}
+
+static void start_pool(int nworkers) {
+    pthread_t tid;
+    for(int i = 0; i < nworkers; i++) {
+	Pthread_create(&tid, NULL, worker_thread, NULL);
+	pthread_detach(tid);
+    }
+}
+
+void evloop_start(int nloops, int nworkers) {
+    num_loops = nloops;
+    loops = Calloc(nloops, sizeof(EV_LOOP));
+    for(int i = 0; i < nloops; i++) {
+	if((loops[i].epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+	    unix_error("epoll_create1 error");
+	Pthread_create(&loops[i].tid, NULL, loop_thread, &loops[i]);
+    }
+    start_pool(nworkers);
+    debug("Started %d event loops and %d workers", nloops, nworkers);
+}
+
+int evloop_start_uring(int listenfd, int nworkers) {
+    if(uring_init(&ring, EVLOOP_RING_ENTRIES) == -1)
+	return -1;
+    if(!ring_supported()) {
+	uring_fini(&ring);
+	return -1;
+    }
+    if((ring_eventfd = eventfd(0, EFD_CLOEXEC)) == -1)
+	unix_error("eventfd error");
+    ring_listenfd = listenfd;
+    use_uring = 1;
+    start_pool(nworkers);
+    pthread_t tid;
+    Pthread_create(&tid, NULL, ring_thread, NULL);
+    debug("Started io_uring loop and %d workers", nworkers);
+    return 0;
+}
+
+void evloop_add(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if(flags == -1 || (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)) {
+	close(fd);
+	return;
+    }
+    EV_CONN *cp = Calloc(1, sizeof(EV_CONN));
+    cp->fd = fd;
+    cp->loop = &loops[__atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED) % num_loops];
+    cp->sp = session_open(fd, 1);
+    session_set_wake(cp->sp, conn_wake, cp);
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = cp };
+    if(epoll_ctl(cp->loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+	conn_close(cp);
+}
@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "debug.h"
+#include "csapp.h"
+#include "fiber.h"
+
+typedef struct sched SCHED;
+
+struct fiber {
+    ucontext_t ctx;
+    char *stack;
+    SCHED *sched;                 // Scheduler the fiber runs on.
+    FIBER_FUNC *func;
+    void *arg;
+    int done;                     // Whether the function has returned.
+    int parked;                   // Whether it waits for fiber_wake().
+    int arrivals;                 // Of the scheduler and the wakeup, once parked.
+    struct fiber *next;           // Next in a queue of runnable fibers.
+};
+
+/*
+ * A scheduler thread.  Fibers made runnable by its own epoll go on a run
+ * queue that only the thread touches; those made runnable from elsewhere,
+ * whether spawned or woken, go on a queue of their own, under a mutex, and
+ * the thread is told through an eventfd in its epoll set.
+ */
+struct sched {
+    int epfd;
+    int evfd;
+    pthread_t tid;
+    ucontext_t ctx;               // Where running fibers switch back to.
+    FIBER *current;
+    FIBER *run_head, *run_tail;
+    FIBER *wake_head, *wake_tail;
+    pthread_mutex_t wake_mutex;
+};
+
+static SCHED *scheds;
+static int num_scheds;
+static unsigned int next_sched;
+static __thread SCHED *self;
+
+static void run_push(SCHED *sp, FIBER *fp) {
+    fp->next = NULL;
+    if(sp->run_tail != NULL)
+	sp->run_tail->next = fp;
+    else
+	sp->run_head = fp;
+    sp->run_tail = fp;
+}
+
+static void wake_push(SCHED *sp, FIBER *fp) {
+    fp->next = NULL;
+    pthread_mutex_lock(&sp->wake_mutex);
+    if(sp->wake_tail != NULL)
+	sp->wake_tail->next = fp;
+    else
+	sp->wake_head = fp;
+    sp->wake_tail = fp;
+    pthread_mutex_unlock(&sp->wake_mutex);
+    uint64_t one = 1;
+    if(write(sp->evfd, &one, sizeof(one)) == -1)
+	unix_error("eventfd write error");
+}
+
+/*
+ * Move the fibers woken from elsewhere to the run queue.
+ */
+static void wake_take(SCHED *sp) {
+    uint64_t n;
+    if(read(sp->evfd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+	unix_error("eventfd read error");
+    pthread_mutex_lock(&sp->wake_mutex);
+    FIBER *list = sp->wake_head;
+    sp->wake_head = sp->wake_tail = NULL;
+    pthread_mutex_unlock(&sp->wake_mutex);
+    while(list != NULL) {
+	FIBER *fp = list;
+	list = fp->next;
+	run_push(sp, fp);
+    }
+}
+
+/*
+ * A parked fiber runs again once both its scheduler has switched away from
+ * it and it has been woken, whichever comes second.
+ */
+static void fiber_arrive(FIBER *fp) {
+    if(__atomic_add_fetch(&fp->arrivals, 1, __ATOMIC_ACQ_REL) == 2) {
+	fp->arrivals = 0;
+	fp->parked = 0;
+	wake_push(fp->sched, fp);
+    }
+}
+
+static void fiber_main(void) {
+    FIBER *fp = self->current;
+    fp->func(fp->arg);
+    fp->done = 1;
+    setcontext(&self->ctx);
+}
+
+/*
+ * Run a fiber until it gives up the thread.
+ */
+static void sched_run(SCHED *sp, FIBER *fp) {
+    sp->current = fp;
+    if(swapcontext(&sp->ctx, &fp->ctx) == -1)
+	unix_error("swapcontext error");
+    sp->current = NULL;
+    if(fp->done) {
+	free(fp->stack);
+	free(fp);
+    } else if(fp->parked) {
+	fiber_arrive(fp);
+    }
+}
+
+static void *sched_thread(void *arg) {
+    SCHED *sp = arg;
+    self = sp;
+    struct epoll_event events[FIBER_MAX_EVENTS];
+    for(;;) {
+	while(sp->run_head != NULL) {
+	    FIBER *fp = sp->run_head;
+	    if((sp->run_head = fp->next) == NULL)
+		sp->run_tail = NULL;
+	    sched_run(sp, fp);
+	}
+	int n = epoll_wait(sp->epfd, events, FIBER_MAX_EVENTS, -1);
+	if(n == -1) {
+	    if(errno == EINTR)
+		continue;
+	    unix_error("epoll_wait error");
+	}
+	for(int i = 0; i < n; i++) {
+	    if(events[i].data.ptr == NULL)
+		wake_take(sp);
+	    else
+		run_push(sp, events[i].data.ptr);
+	}
+    }
+    return NULL;
+}
+
+void fiber_start(int nthreads) {
+    num_scheds = nthreads;
+    scheds = Calloc(nthreads, sizeof(SCHED));
+    for(int i = 0; i < nthreads; i++) {
+	SCHED *sp = &scheds[i];
+	pthread_mutex_init(&sp->wake_mutex, NULL);
+	if((sp->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+	    unix_error("epoll_create1 error");
+	if((sp->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+	    unix_error("eventfd error");
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	if(epoll_ctl(sp->epfd, EPOLL_CTL_ADD, sp->evfd, &ev) == -1)
+	    unix_error("epoll_ctl error");
+	Pthread_create(&sp->tid, NULL, sched_thread, sp);
+    }
+    debug("Started %d fiber schedulers", nthreads);
+}
+
+void fiber_spawn(FIBER_FUNC *func, void *arg) {
+    FIBER *fp = Calloc(1, sizeof(FIBER));
+    fp->func = func;
+    fp->arg = arg;
+    fp->stack = Malloc(FIBER_STACK_SIZE);
+    if(getcontext(&fp->ctx) == -1)
+	unix_error("getcontext error");
+    fp->ctx.uc_stack.ss_sp = fp->stack;
+    fp->ctx.uc_stack.ss_size = FIBER_STACK_SIZE;
+    fp->ctx.uc_link = NULL;
+    makecontext(&fp->ctx, fiber_main, 0);
+    fp->sched = &scheds[__atomic_fetch_add(&next_sched, 1, __ATOMIC_RELAXED) % num_scheds];
+    wake_push(fp->sched, fp);
+}
+
+FIBER *fiber_self(void) {
+    return self != NULL ? self->current : NULL;
+}
+
+int fiber_wait(int fd, int write) {
+    FIBER *fp = fiber_self();
+    if(fp == NULL)
+	return -1;
+    // Once the event is seen the descriptor is disabled until watched again.
+    struct epoll_event ev = {
+	.events = (write ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT, .data.ptr = fp
+    };
+    if(epoll_ctl(self->epfd, EPOLL_CTL_MOD, fd, &ev) == -1
+       && (errno != ENOENT || epoll_ctl(self->epfd, EPOLL_CTL_ADD, fd, &ev) == -1))
+	return -1;
+    if(swapcontext(&fp->ctx, &self->ctx) == -1)
+	unix_error("swapcontext error");
+    return 0;
+}
+
+void fiber_park(void) {
+    FIBER *fp = fiber_self();
+    fp->parked = 1;
+    if(swapcontext(&fp->ctx, &self->ctx) == -1)
+	unix_error("swapcontext error");
+}
+
+void fiber_wake(FIBER *fp) {
+    fiber_arrive(fp);
+}
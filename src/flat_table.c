@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "csapp.h"
+#include "flat_table.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * The seven-bit tag of an occupied slot comes from the top of the mixed
+ * hash, and the starting group from the bottom, so the two are independent.
+ */
+#define TAG(h) ((signed char)((h) >> 25))
+
+/*
+ * Mix the bits of a key hash.  Keys are assigned to lock stripes by the low
+ * bits of their raw hash, so all keys in one table share those bits.
+ */
+static unsigned int mix(int hash) {
+    unsigned int h = hash;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+/*
+ * Bit i of the result is set if control byte i of the group equals c.
+ */
+static unsigned int group_match(const signed char *ctrl, signed char c) {
+#if defined(__AVX2__)
+    __m256i g = _mm256_loadu_si256((const __m256i *)ctrl);
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(g, _mm256_set1_epi8(c)));
+#elif defined(__SSE2__)
+    __m128i g = _mm_loadu_si128((const __m128i *)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+#else
+    unsigned int m = 0;
+    for(int i = 0; i < FLAT_GROUP_SIZE; i++) {
+	if(ctrl[i] == c)
+	    m |= 1u << i;
+    }
+    return m;
+#endif
+}
+
+/*
+ * Bit i of the result is set if slot i of the group is empty or deleted.
+ */
+static unsigned int group_free(const signed char *ctrl) {
+#if defined(__AVX2__)
+    return _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)ctrl));
+#elif defined(__SSE2__)
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+    unsigned int m = 0;
+    for(int i = 0; i < FLAT_GROUP_SIZE; i++) {
+	if(ctrl[i] < 0)
+	    m |= 1u << i;
+    }
+    return m;
+#endif
+}
+
+FLAT_TABLE *flat_create(int num_groups) {
+    FLAT_TABLE *ft = Malloc(sizeof(FLAT_TABLE));
+    ft->num_groups = num_groups;
+    ft->count = 0;
+    ft->deleted = 0;
+    ft->ctrl = Malloc(num_groups * FLAT_GROUP_SIZE);
+    memset(ft->ctrl, FLAT_CTRL_EMPTY, num_groups * FLAT_GROUP_SIZE);
+    ft->slots = Calloc(num_groups * FLAT_GROUP_SIZE, sizeof(FLAT_SLOT));
+    return ft;
+}
+
+void flat_free(FLAT_TABLE *ft) {
+    free(ft->ctrl);
+    free(ft->slots);
+    free(ft);
+}
+
+MAP_ENTRY *flat_find(FLAT_TABLE *ft, KEY *key) {
+    unsigned int h = mix(key->hash);
+    int mask = ft->num_groups - 1;
+    int g = h & mask;
+    for(int step = 1; step <= ft->num_groups; step++) {
+	const signed char *ctrl = ft->ctrl + g * FLAT_GROUP_SIZE;
+	unsigned int m = group_match(ctrl, TAG(h));
+	unsigned int empty = group_match(ctrl, FLAT_CTRL_EMPTY);
+	// Slots are filled in before their tags are published.
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	while(m != 0) {
+	    FLAT_SLOT *sp = &ft->slots[g * FLAT_GROUP_SIZE + __builtin_ctz(m)];
+	    if(__atomic_load_n(&sp->hash, __ATOMIC_RELAXED) == h) {
+		MAP_ENTRY *ep = __atomic_load_n(&sp->entry, __ATOMIC_RELAXED);
+		if(!key_compare(ep->key, key))
+		    return ep;
+	    }
+	    m &= m - 1;
+	}
+	if(empty != 0)
+	    return NULL;
+	g = (g + step) & mask;
+    }
+    return NULL;
+}
+
+static void insert_hashed(FLAT_TABLE *ft, unsigned int h, MAP_ENTRY *ep) {
+    int mask = ft->num_groups - 1;
+    int g = h & mask;
+    for(int step = 1; ; step++) {
+	unsigned int m = group_free(ft->ctrl + g * FLAT_GROUP_SIZE);
+	if(m != 0) {
+	    int i = g * FLAT_GROUP_SIZE + __builtin_ctz(m);
+	    if(ft->ctrl[i] == FLAT_CTRL_DELETED)
+		ft->deleted--;
+	    __atomic_store_n(&ft->slots[i].hash, h, __ATOMIC_RELAXED);
+	    __atomic_store_n(&ft->slots[i].entry, ep, __ATOMIC_RELAXED);
+	    __atomic_store_n(&ft->ctrl[i], TAG(h), __ATOMIC_RELEASE);
+	    ft->count++;
+	    return;
+	}
+	g = (g + step) & mask;
+    }
+}
+
+void flat_insert(FLAT_TABLE *ft, MAP_ENTRY *ep) {
+    insert_hashed(ft, mix(ep->key->hash), ep);
+}
+
+void flat_erase(FLAT_TABLE *ft, int i) {
+    // A lookup only goes past a group that has no empty slot, so if this
+    // group has one, no lookup can depend on the slot being occupied.
+    const signed char *ctrl = ft->ctrl + (i / FLAT_GROUP_SIZE) * FLAT_GROUP_SIZE;
+    if(group_match(ctrl, FLAT_CTRL_EMPTY) != 0) {
+	__atomic_store_n(&ft->ctrl[i], FLAT_CTRL_EMPTY, __ATOMIC_RELEASE);
+    } else {
+	__atomic_store_n(&ft->ctrl[i], FLAT_CTRL_DELETED, __ATOMIC_RELEASE);
+	ft->deleted++;
+    }
+    ft->count--;
+}
+
+static int overloaded(FLAT_TABLE *ft, int extra) {
+    long used = ft->count + ft->deleted + extra;
+    return used * FLAT_MAX_LOAD_DEN > (long)ft->num_groups * FLAT_GROUP_SIZE * FLAT_MAX_LOAD_NUM;
+}
+
+int flat_wanted_groups(FLAT_TABLE *ft, int extra, int min_groups) {
+    long n = ft->count + extra;
+    long capacity = (long)ft->num_groups * FLAT_GROUP_SIZE;
+    if(overloaded(ft, extra))
+	return n * 2 > capacity ? ft->num_groups * 2 : ft->num_groups;
+    if(ft->num_groups > min_groups && n * FLAT_MIN_LOAD_INV < capacity)
+	return ft->num_groups / 2;
+    return ft->num_groups;
+}
+
+int flat_needs_rebuild(FLAT_TABLE *ft, int extra, int min_groups) {
+    return overloaded(ft, extra) || flat_wanted_groups(ft, extra, min_groups) != ft->num_groups;
+}
+
+FLAT_TABLE *flat_rebuild(FLAT_TABLE *ft, int num_groups) {
+    debug("Rebuild flat table of %d groups (%d entries, %d deleted) with %d groups",
+	  ft->num_groups, ft->count, ft->deleted, num_groups);
+    FLAT_TABLE *new = flat_create(num_groups);
+    for(int i = 0; i < ft->num_groups * FLAT_GROUP_SIZE; i++) {
+	if(ft->ctrl[i] >= 0)
+	    insert_hashed(new, ft->slots[i].hash, ft->slots[i].entry);
+    }
+    return new;
+}
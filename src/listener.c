@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+
+#include "debug.h"
+#include "csapp.h"
+#include "listener.h"
+
+/*
+ * State of an acceptor thread.
+ */
+typedef struct acceptor {
+    int listenfd;
+    int flags;
+    LISTENER_FUNC *serve;
+} ACCEPTOR;
+
+int listener_open(char *port, int backlog, int reuseport) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, rc, optval = 1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+	fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port, gai_strerror(rc));
+	return -1;
+    }
+    for(p = listp; p != NULL; p = p->ai_next) {
+	listenfd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+	if(listenfd == -1)
+	    continue;
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+	if((!reuseport
+	    || setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == 0)
+	   && bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+	    break;
+	close(listenfd);
+	listenfd = -1;
+    }
+    freeaddrinfo(listp);
+    if(listenfd != -1 && listen(listenfd, backlog) == -1) {
+	close(listenfd);
+	listenfd = -1;
+    }
+    return listenfd;
+}
+
+static void accept_loop(ACCEPTOR *ap) {
+    for(;;) {
+	// accept4() is only declared with _GNU_SOURCE, which csapp.h clashes with.
+	int fd = syscall(SYS_accept4, ap->listenfd, NULL, NULL, ap->flags);
+	if(fd == -1) {
+	    // The connection was reset before it could be accepted.
+	    if(errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    // Only these mean that the listening socket itself is unusable.
+	    if(errno == EBADF || errno == EINVAL || errno == ENOTSOCK)
+		unix_error("accept4 error");
+	    fprintf(stderr, "accept4 error: %s\n", strerror(errno));
+	    usleep(LISTENER_RETRY_MS * 1000);
+	    continue;
+	}
+	ap->serve(fd);
+    }
+}
+
+static void *acceptor_thread(void *arg) {
+    accept_loop(arg);
+    return NULL;
+}
+
+void listener_run(int listenfd, char *port, int nacceptors, int backlog, int flags,
+		  LISTENER_FUNC *serve) {
+    ACCEPTOR *aps = Calloc(nacceptors, sizeof(ACCEPTOR));
+    for(int i = 0; i < nacceptors; i++) {
+	aps[i].flags = flags;
+	aps[i].serve = serve;
+	if(i == 0) {
+	    aps[i].listenfd = listenfd;
+	    continue;
+	}
+	if((aps[i].listenfd = listener_open(port, backlog, 1)) == -1)
+	    unix_error("listener_open error");
+	pthread_t tid;
+	Pthread_create(&tid, NULL, acceptor_thread, &aps[i]);
+    }
+    debug("Accepting connections on port %s with %d threads", port, nacceptors);
+    accept_loop(&aps[0]);
+}
@@ -2,13 +2,38 @@
 #include "client_registry.h"
 #include "transaction.h"
 #include "store.h"
+#include "store_funcs.h"
+#include "data_funcs.h"
+#include "wal.h"
 #include "csapp.h"
 #include "server.h"
+#include "evloop.h"
+#include "fiber.h"
+#include "server_funcs.h"
+#include "listener.h"
+
+#include <sys/random.h>
 
 char *port;
 char *host_name;
 char *file_name;
+int num_buckets = STORE_DEFAULT_BUCKETS;
+int gc_batch = -1;
+STORE_INDEX store_index = STORE_INDEX_CHAINED;
+char *log_name;
+WAL_SYNC log_policy = WAL_SYNC_COMMIT;
+int log_interval_ms;
+int checkpoint_secs;
+int event_loops;
+int event_workers;
+int uring_workers;
+int fiber_threads;
+int acceptors = 1;
+int backlog = LISTENER_DEFAULT_BACKLOG;
+long packet_max = XACTO_PACKET_MAX;
 static void terminate(int status);
+static void usage(char *name);
+static void serve_connection(int fd);
 void sighup_handler(int sig);
 
 CLIENT_REGISTRY *client_registry;
@@ -18,11 +43,37 @@ int main(int argc, char* argv[]){
     // Option processing should be performed here.
     // Option '-p <port>' is required in order to specify the port number
     // on which the server should listen.
+    // Option '-b <buckets>' pre-sizes the store's hash table.
+    // Option '-i flat' selects the open-addressing store index.
+    // Option '-g <batch>' runs the background version garbage collector,
+    // sweeping <batch> buckets at a time (0 for the default).
+    // Option '-l <log>' makes committed transactions durable in a
+    // write-ahead log, which is replayed on startup.
+    // Option '-d commit|<ms>|off' sets when the log is synced: on every
+    // commit (the default), every <ms> milliseconds, or never.
+    // Option '-c <secs>' checkpoints the store every <secs> seconds, so
+    // that startup loads the checkpoint and replays only the log after it.
+    // Option '-e <loops>,<workers>' serves clients from <loops> epoll event
+    // loops and a pool of <workers> worker threads, instead of a thread per
+    // connection.
+    // Option '-u <workers>' serves clients from an io_uring loop and a pool
+    // of <workers> worker threads, falling back to a single epoll loop if
+    // the kernel does not support io_uring.
+    // Option '-f <threads>' serves each client from a fiber, and runs the
+    // fibers on <threads> scheduler threads.  Only one of '-e', '-u' and
+    // '-f' may be given.
+    // Option '-a <acceptors>' accepts connections in <acceptors> threads,
+    // each with a listening socket of its own bound with SO_REUSEPORT
+    // (except with '-u', whose ring accepts connections itself).
+    // Option '-q <backlog>' sets the length of the queue of connections
+    // waiting to be accepted, on each listening socket.
+    // Option '-m <bytes>' sets the largest packet payload accepted; a client
+    // that sends a larger one is disconnected.
 
     // Perform required initializations of the client_registry,
     // transaction manager, and object store.
     char optval;
-    static char *short_options = "+p:";
+    static char *short_options = "+p:b:g:i:l:d:c:e:u:f:a:q:m:";
     while(optind<argc)
     {
     if((optval = getopt(argc, argv, short_options)) != -1)
@@ -32,40 +83,146 @@ int main(int argc, char* argv[]){
                 case 'p':
                 port = optarg;
                 break;
+                case 'b':
+                num_buckets = atoi(optarg);
+                break;
+                case 'g':
+                gc_batch = atoi(optarg);
+                break;
+                case 'i':
+                if(!strcmp(optarg, "flat"))
+                    store_index = STORE_INDEX_FLAT;
+                else if(strcmp(optarg, "chained"))
+                    optval = '?';
+                break;
+                case 'l':
+                log_name = optarg;
+                break;
+                case 'd':
+                if(!strcmp(optarg, "commit"))
+                    log_policy = WAL_SYNC_COMMIT;
+                else if(!strcmp(optarg, "off"))
+                    log_policy = WAL_SYNC_NONE;
+                else if((log_interval_ms = atoi(optarg)) > 0)
+                    log_policy = WAL_SYNC_INTERVAL;
+                else
+                    optval = '?';
+                break;
+                case 'c':
+                if((checkpoint_secs = atoi(optarg)) <= 0)
+                    optval = '?';
+                break;
+                case 'e':
+                if(sscanf(optarg, "%d,%d", &event_loops, &event_workers) != 2
+                   || event_loops <= 0 || event_workers <= 0)
+                    optval = '?';
+                break;
+                case 'u':
+                if((uring_workers = atoi(optarg)) <= 0)
+                    optval = '?';
+                break;
+                case 'f':
+                if((fiber_threads = atoi(optarg)) <= 0)
+                    optval = '?';
+                break;
+                case 'a':
+                if((acceptors = atoi(optarg)) <= 0)
+                    optval = '?';
+                break;
+                case 'q':
+                if((backlog = atoi(optarg)) <= 0)
+                    optval = '?';
+                break;
+                case 'm':
+                if((packet_max = atol(optarg)) <= 0)
+                    optval = '?';
+                break;
                 case '?':
-                fprintf(stderr, "Usage: %s [-i <cmd_file>] [-o <out_file>]\n", argv[0]);
-                exit(EXIT_FAILURE);
                 break;
            }
+           if(optval == '?')
+                usage(argv[0]);
         }
 
     }
+    // Clients are served in one way only.
+    if((event_loops > 0) + (uring_workers > 0) + (fiber_threads > 0) > 1)
+        usage(argv[0]);
 
-    int *connfdp;
-    int listenfd = Open_listenfd(port);
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    pthread_t tid;
+    int listenfd = listener_open(port, backlog, acceptors > 1);
+    if(listenfd == -1) {
+        fprintf(stderr, "Cannot listen on port %s: %s\n", port, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
+    uint64_t seed;
+    if(getrandom(&seed, sizeof(seed), 0) == sizeof(seed))
+        blob_set_hash_seed(seed);
     client_registry = creg_init();
     trans_init();
-    store_init();
-    while (1) {
-        clientlen=sizeof(struct sockaddr_storage);
-        connfdp = malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *) &clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, xacto_client_service, connfdp);
+    store_init_index(store_index, num_buckets);
+    store_set_inline_max(STORE_INLINE_MAX);
+    if(log_name != NULL && wal_open(log_name, log_policy, log_interval_ms) == -1) {
+        fprintf(stderr, "Cannot open log %s: %s\n", log_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if(log_name != NULL) {
+        WAL_STATS ws;
+        wal_get_stats(&ws);
+        double secs = (ws.load.nsecs + ws.replay_nsecs) / 1e9;
+        fprintf(stderr, "Loaded %lu keys (%.1f MB) from checkpoint with %d threads "
+                "and replayed %lu log records in %.3f s",
+                ws.load.entries, ws.load.bytes / 1e6, ws.load.threads, ws.recovered, secs);
+        if(ws.load.bytes >= 1000000)
+            fprintf(stderr, " (%.2f s/GB of checkpoint)", ws.load.nsecs / 1e9 / (ws.load.bytes / 1e9));
+        fprintf(stderr, "\n");
+        if(checkpoint_secs > 0)
+            wal_checkpoint_start(checkpoint_secs * 1000);
     }
-    // TODO: Set up the server socket and enter a loop to accept connections
-    // on this socket.  For each connection, a thread should be started to
-    // run function xacto_client_service().  In addition, you should install
-    // a SIGHUP handler, so that receipt of SIGHUP will perform a clean
-    // shutdown of the server.
+    if(gc_batch >= 0)
+        store_gc_start(gc_batch, -1);
+    session_set_packet_max(packet_max);
+    if(uring_workers > 0) {
+        if(evloop_start_uring(listenfd, uring_workers) == 0) {
+            while(1)
+                pause();
+        }
+        fprintf(stderr, "io_uring is not supported, using epoll\n");
+        event_loops = 1;
+        event_workers = uring_workers;
+    }
+    if(event_loops > 0)
+        evloop_start(event_loops, event_workers);
+    if(fiber_threads > 0)
+        fiber_start(fiber_threads);
+    // Connections served by event loops or fibers are non-blocking.
+    int flags = SOCK_CLOEXEC;
+    if(event_loops > 0 || fiber_threads > 0)
+        flags |= SOCK_NONBLOCK;
+    listener_run(listenfd, port, acceptors, backlog, flags, serve_connection);
+}
 
-    fprintf(stderr, "You have to finish implementing main() "
-	    "before the Xacto server will function.\n");
+static void usage(char *name) {
+    fprintf(stderr, "Usage: %s -p <port> [-b <buckets>] [-g <batch>] [-i chained|flat] [-l <log> [-d commit|<ms>|off] [-c <secs>]] [-e <loops>,<workers> | -u <workers> | -f <threads>] [-a <acceptors>] [-q <backlog>] [-m <bytes>]\n", name);
+    exit(EXIT_FAILURE);
+}
 
-    terminate(EXIT_FAILURE);
+/*
+ * Hand a newly accepted connection to whatever serves clients.
+ */
+static void serve_connection(int fd) {
+    if(event_loops > 0) {
+        evloop_add(fd);
+        return;
+    }
+    int *connfdp = malloc(sizeof(int));
+    *connfdp = fd;
+    if(fiber_threads > 0) {
+        fiber_spawn(xacto_client_fiber, connfdp);
+    } else {
+        pthread_t tid;
+        Pthread_create(&tid, NULL, xacto_client_service, connfdp);
+    }
 }
 
 /*
@@ -81,6 +238,8 @@ void terminate(int status) {
     debug("All service threads terminated.");
 
     // Finalize modules.
+    store_gc_stop();
+    wal_close();
     creg_fini(client_registry);
     trans_fini();
     store_fini();
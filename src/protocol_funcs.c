@@ -1,13 +1,17 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
+#include <sys/uio.h>
 
 #include "debug.h"
 #include "protocol.h"
 #include "protocol_funcs.h"
 
 char *xacto_packet_type_names[] = {
-    "NONE", "PUT", "GET", "DATA", "COMMIT", "REPLY"
+    "NONE", "PUT", "GET", "DATA", "COMMIT", "REPLY", "SCAN", "SNAPSHOT", "MGET", "MPUT",
+    "ADD", "CAS", "BEGIN", "HELLO"
 };
 
 /*
@@ -47,3 +51,334 @@ void proto_init_packet(XACTO_PACKET *pkt, XACTO_PACKET_TYPE type, size_t size) {
     pkt->timestamp_nsec = ts.tv_nsec;
     pkt->size = size;
 }
+
+void proto_conn_init(XACTO_CONN *cp, int fd) {
+    memset(cp, 0, sizeof(*cp));
+    cp->fd = fd;
+    cp->in = Malloc(sizeof(rio_t));
+    rio_readinitb(cp->in, fd);
+    cp->out_cap = XACTO_OBUF_SIZE;
+    cp->out = Malloc(cp->out_cap);
+    cp->packet_max = XACTO_PACKET_MAX;
+}
+
+void proto_conn_init_event(XACTO_CONN *cp, int fd) {
+    memset(cp, 0, sizeof(*cp));
+    cp->fd = fd;
+    cp->event = 1;
+    cp->packet_max = XACTO_PACKET_MAX;
+}
+
+void proto_conn_set_packet_max(XACTO_CONN *cp, size_t max) {
+    cp->packet_max = max < UINT32_MAX ? max : UINT32_MAX;
+}
+
+void proto_conn_set_wait(XACTO_CONN *cp, XACTO_WAIT *wait) {
+    cp->wait = wait;
+}
+
+void proto_conn_fini(XACTO_CONN *cp) {
+    free(cp->in);
+    free(cp->out);
+    cp->in = NULL;
+    cp->out = NULL;
+    cp->out_len = cp->out_cap = 0;
+}
+
+void proto_conn_feed(XACTO_CONN *cp, const char *buf, size_t len) {
+    cp->src = buf;
+    cp->src_len = len;
+    cp->src_pos = 0;
+}
+
+/*
+ * Whether a system call that failed on the descriptor of a connection in
+ * blocking mode would only have blocked, and the connection has waited
+ * for the descriptor to be ready, so that the call can be tried again.
+ */
+static int conn_waited(XACTO_CONN *cp, int write) {
+    if(errno != EAGAIN && errno != EWOULDBLOCK)
+	return 0;
+    return cp->wait != NULL && cp->wait(cp->fd, write) == 0;
+}
+
+static ssize_t conn_sys_read(XACTO_CONN *cp, char *buf, size_t n) {
+    for(;;) {
+	ssize_t r = read(cp->fd, buf, n);
+	if(r >= 0)
+	    return r;
+	if(errno != EINTR && !conn_waited(cp, 0))
+	    return -1;
+    }
+}
+
+/*
+ * Refill the empty input buffer of a connection in blocking mode.  A
+ * connection that waits for input with nothing left to send gives up its
+ * buffers meanwhile, so that an idle connection costs little memory.
+ */
+static int conn_fill(XACTO_CONN *cp) {
+    for(;;) {
+	if(cp->in == NULL) {
+	    cp->in = Malloc(sizeof(rio_t));
+	    rio_readinitb(cp->in, cp->fd);
+	}
+	ssize_t r = read(cp->fd, cp->in->rio_buf, RIO_BUFSIZE);
+	if(r > 0) {
+	    cp->in->rio_bufptr = cp->in->rio_buf;
+	    cp->in->rio_cnt = r;
+	    return 0;
+	}
+	if(r == 0)
+	    return -1;
+	if(errno == EINTR)
+	    continue;
+	if((errno != EAGAIN && errno != EWOULDBLOCK) || cp->wait == NULL)
+	    return -1;
+	if(cp->out_len == 0) {
+	    free(cp->in);
+	    free(cp->out);
+	    cp->in = NULL;
+	    cp->out = NULL;
+	    cp->out_cap = 0;
+	}
+	if(cp->wait(cp->fd, 0) == -1)
+	    return -1;
+    }
+}
+
+/*
+ * Read exactly n bytes.  In blocking mode, they come first from the input
+ * buffer and then, for what is too big to be worth copying through it,
+ * straight from the descriptor.  Returns 0 if successful, -1 on error or
+ * EOF, or in event mode if not enough input was fed.
+ */
+static int conn_read(XACTO_CONN *cp, char *buf, size_t n) {
+    if(cp->event) {
+	if(cp->src_len - cp->src_pos < n)
+	    return -1;
+	memcpy(buf, cp->src + cp->src_pos, n);
+	cp->src_pos += n;
+	return 0;
+    }
+    while(n > 0) {
+	rio_t *rp = cp->in;
+	if(rp != NULL && rp->rio_cnt > 0) {
+	    size_t m = n < (size_t)rp->rio_cnt ? n : (size_t)rp->rio_cnt;
+	    memcpy(buf, rp->rio_bufptr, m);
+	    rp->rio_bufptr += m;
+	    rp->rio_cnt -= m;
+	    buf += m;
+	    n -= m;
+	    continue;
+	}
+	if(n >= RIO_BUFSIZE) {
+	    ssize_t r = conn_sys_read(cp, buf, n);
+	    if(r <= 0)
+		return -1;
+	    buf += r;
+	    n -= r;
+	} else if(conn_fill(cp) == -1) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+int proto_conn_recv_header(XACTO_CONN *cp, XACTO_PACKET *pkt) {
+    if(conn_read(cp, (char *)pkt, sizeof(*pkt)) == -1)
+	return -1;
+    pkt->size = ntohl(pkt->size);
+    pkt->timestamp_sec = ntohl(pkt->timestamp_sec);
+    pkt->timestamp_nsec = ntohl(pkt->timestamp_nsec);
+    if(pkt->size > cp->packet_max) {
+	debug("Packet over %lu bytes on connection %d", cp->packet_max, cp->fd);
+	return -1;
+    }
+    return pkt->type == XACTO_NO_PKT ? -1 : 0;
+}
+
+int proto_conn_recv_payload(XACTO_CONN *cp, void *buf, size_t size) {
+    return conn_read(cp, buf, size);
+}
+
+int proto_conn_recv(XACTO_CONN *cp, XACTO_PACKET *pkt, void **payload) {
+    if(proto_conn_recv_header(cp, pkt) == -1)
+	return -1;
+    if(pkt->size > 0) {
+	char *data = Malloc(pkt->size);
+	if(conn_read(cp, data, pkt->size) == -1) {
+	    free(data);
+	    return -1;
+	}
+	*payload = data;
+    }
+    return 0;
+}
+
+int proto_conn_pending(XACTO_CONN *cp) {
+    if(cp->event)
+	return cp->src_pos < cp->src_len;
+    return cp->in != NULL && cp->in->rio_cnt > 0;
+}
+
+/*
+ * Write the output buffer followed by n bytes from buf, handling short
+ * writes.
+ */
+static int conn_writev(XACTO_CONN *cp, char *buf, size_t n) {
+    struct iovec iov[2] = {
+	{ .iov_base = cp->out, .iov_len = cp->out_len },
+	{ .iov_base = buf, .iov_len = n }
+    };
+    struct iovec *vp = iov;
+    int cnt = 2;
+    while(cnt > 0) {
+	ssize_t w = writev(cp->fd, vp, cnt);
+	if(w < 0) {
+	    if(errno == EINTR || conn_waited(cp, 1))
+		continue;
+	    return -1;
+	}
+	while(cnt > 0 && (size_t)w >= vp->iov_len) {
+	    w -= vp->iov_len;
+	    vp++;
+	    cnt--;
+	}
+	if(cnt > 0) {
+	    vp->iov_base = (char *)vp->iov_base + w;
+	    vp->iov_len -= w;
+	}
+    }
+    cp->out_len = 0;
+    return 0;
+}
+
+/*
+ * Make room for n more bytes in the output buffer of a connection in
+ * event mode.
+ */
+static void conn_reserve(XACTO_CONN *cp, size_t n) {
+    if(cp->out_len + n <= cp->out_cap)
+	return;
+    size_t cap = cp->out_cap ? 2 * cp->out_cap : XACTO_OBUF_SIZE;
+    while(cap < cp->out_len + n)
+	cap *= 2;
+    cp->out = Realloc(cp->out, cap);
+    cp->out_cap = cap;
+}
+
+int proto_conn_send(XACTO_CONN *cp, XACTO_PACKET *pkt, void *payload) {
+    if(pkt->type == XACTO_NO_PKT)
+	return -1;
+    size_t n = payload != NULL ? pkt->size : 0;
+    XACTO_PACKET hdr = *pkt;
+    hdr.size = htonl(hdr.size);
+    hdr.timestamp_sec = htonl(hdr.timestamp_sec);
+    hdr.timestamp_nsec = htonl(hdr.timestamp_nsec);
+    if(cp->event) {
+	conn_reserve(cp, sizeof(hdr) + n);
+    } else if(cp->out == NULL) {
+	cp->out_cap = XACTO_OBUF_SIZE;
+	cp->out = Malloc(cp->out_cap);
+    } else if(cp->out_len + sizeof(hdr) > cp->out_cap && proto_conn_flush(cp) == -1) {
+	return -1;
+    }
+    memcpy(cp->out + cp->out_len, &hdr, sizeof(hdr));
+    cp->out_len += sizeof(hdr);
+    if(n == 0)
+	return 0;
+    if(cp->out_len + n <= cp->out_cap) {
+	memcpy(cp->out + cp->out_len, payload, n);
+	cp->out_len += n;
+	return 0;
+    }
+    return conn_writev(cp, payload, n);
+}
+
+char *proto_conn_output(XACTO_CONN *cp, size_t *lenp) {
+    *lenp = cp->out_len;
+    return cp->out;
+}
+
+void proto_conn_sent(XACTO_CONN *cp, size_t n) {
+    cp->out_len -= n;
+    if(cp->out_len > 0) {
+	memmove(cp->out, cp->out + n, cp->out_len);
+    } else {
+	free(cp->out);
+	cp->out = NULL;
+	cp->out_cap = 0;
+    }
+}
+
+/*
+ * Write what a descriptor in non-blocking mode takes of the output buffer,
+ * and free the buffer once it is empty.
+ */
+static int conn_write_some(XACTO_CONN *cp) {
+    size_t done = 0;
+    while(done < cp->out_len) {
+	ssize_t w = write(cp->fd, cp->out + done, cp->out_len - done);
+	if(w < 0) {
+	    if(errno == EINTR)
+		continue;
+	    if(errno == EAGAIN || errno == EWOULDBLOCK)
+		break;
+	    return -1;
+	}
+	done += w;
+    }
+    proto_conn_sent(cp, done);
+    return 0;
+}
+
+int proto_conn_flush(XACTO_CONN *cp) {
+    if(cp->out_len == 0)
+	return 0;
+    if(cp->event)
+	return conn_write_some(cp);
+    return conn_writev(cp, NULL, 0);
+}
+
+size_t proto_conn_unsent(XACTO_CONN *cp) {
+    return cp->out_len;
+}
+
+/*
+ * The number of DATA packets a client sends after a request of a type.
+ */
+static int request_data_packets(int type) {
+    switch(type) {
+    case XACTO_GET_PKT:
+    case XACTO_ADD_PKT:
+	return 1;
+    case XACTO_PUT_PKT:
+    case XACTO_SCAN_PKT:
+	return 2;
+    case XACTO_CAS_PKT:
+	return 3;
+    default:
+	return 0;
+    }
+}
+
+size_t proto_request_length(const char *buf, size_t len, size_t max) {
+    size_t off = 0;
+    int packets = 1;
+    for(int i = 0; i < packets; i++) {
+	if(len - off < sizeof(XACTO_PACKET))
+	    return 0;
+	uint32_t size;
+	memcpy(&size, buf + off + offsetof(XACTO_PACKET, size), sizeof(size));
+	if(i == 0)
+	    packets += request_data_packets((uint8_t)buf[off + offsetof(XACTO_PACKET, type)]);
+	off += sizeof(XACTO_PACKET);
+	if(ntohl(size) > max)
+	    return XACTO_TOO_LARGE;
+	if(len - off < ntohl(size))
+	    return 0;
+	off += ntohl(size);
+    }
+    return off;
+}
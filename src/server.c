@@ -1,180 +1,892 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 #include <unistd.h>
-#include <stdlib.h>
-#include <time.h>
+#include <endian.h>
+
 #include "debug.h"
 #include "csapp.h"
-#include <semaphore.h>
 #include "data.h"
 #include "server.h"
 #include "protocol.h"
+#include "protocol_funcs.h"
 #include "client_registry.h"
 #include "transaction.h"
 #include "store.h"
+#include "store_funcs.h"
+#include "data_funcs.h"
+#include "server_funcs.h"
+#include "fiber.h"
+#include "wal.h"
 
 CLIENT_REGISTRY *client_registry;
-void free_func(XACTO_PACKET *s, XACTO_PACKET *r, void **p, int fd);
-void main_free_func(XACTO_PACKET *s, XACTO_PACKET *r, void **p);
-char *pkt_type(XACTO_PACKET *r);
-int p_flag=0;
-int g_flag=0;
-
-void *xacto_client_service(void *arg)
-{
-    int fd = *( ( int* )arg );
+
+static size_t packet_max = XACTO_PACKET_MAX;
+
+/*
+ * State of a client session.  A transaction ends when the client commits,
+ * when an operation aborts it, or when the client disconnects.  It is only
+ * created by its first request, which may instead ask for it to be
+ * read-only, in which case the session holds a snapshot rather than a
+ * transaction.
+ *
+ * A session runs a single transaction and then closes the connection,
+ * unless the client has sent BEGIN, after which the connection stays open
+ * and each transaction that ends is followed by a new one.  If the client
+ * has asked for tagged requests with HELLO, a transaction that aborts only
+ * ends when the client commits it or sends BEGIN.
+ *
+ * A session given a wake function does not block in a commit that has to
+ * wait for other transactions, or for the log to make it durable before it
+ * is acknowledged.  It stops handling requests until the commit finishes,
+ * and the wake function is called once it can go on.  A session run by a
+ * fiber parks the fiber instead.
+ */
+struct session {
+    int fd;
+    XACTO_CONN conn;
+    int started;                  // Whether a request has been received.
+    int persistent;               // Whether the client has sent BEGIN.
+    int tagged;                   // Whether requests carry IDs.
+    uint32_t tag;                 // ID of the request being handled.
+    TRANSACTION *tp;
+    TRANS_SNAPSHOT *snap;
+    SESSION_WAKE *wake;
+    void *wake_arg;
+    FIBER *fiber;                 // Fiber running the session, if any.
+    int committing;               // Whether a commit is waiting.
+    TRANS_STATUS commit_status;   // How the commit turned out.
+    int logging;                  // Whether it waits for the log.
+    int log_status;               // How the wait for the log ended.
+    int event;                    // Whether the connection is in event mode.
+    int scanning;                 // Whether a scan stopped for its output.
+    int scan_stopped;             // Set by the scan function to stop.
+    BLOB *scan_lo, *scan_hi;      // Where the scan goes on from, and its end.
+    uint32_t scan_limit;          // Keys it may visit, or 0 for no limit.
+    uint32_t scan_count;          // Keys it has visited so far.
+};
+
+static TRANSACTION *session_trans(SESSION *sp) {
+    if(sp->tp == NULL)
+	sp->tp = trans_create();
+    return sp->tp;
+}
+
+/*
+ * End the current transaction, if any, aborting it if it has not yet
+ * committed, so that the next request starts a new one.
+ */
+static void session_end_trans(SESSION *sp) {
+    if(sp->tp != NULL) {
+	trans_abort(sp->tp);
+	sp->tp = NULL;
+    }
+    if(sp->snap != NULL) {
+	trans_snapshot_release(sp->snap);
+	sp->snap = NULL;
+    }
+}
+
+/*
+ * Leave the session with an aborted transaction, which answers any further
+ * requests with ABORTED until the client ends it.
+ */
+static void session_doom(SESSION *sp) {
+    if(sp->snap != NULL) {
+	trans_snapshot_release(sp->snap);
+	sp->snap = NULL;
+    }
+    TRANSACTION *tp = session_trans(sp);
+    trans_abort(trans_ref(tp, "for transaction left aborted"));
+}
+
+/*
+ * Receive the DATA packet that follows a request.  The payload is read
+ * straight into the blob that will hold it.
+ *
+ * @param bpp  Set to a blob holding the payload, or to NULL for a null
+ * data value.
+ * @return  0 if successful, -1 if the connection failed or the packet
+ * was not a DATA packet.
+ */
+static int recv_data(SESSION *sp, BLOB **bpp) {
+    XACTO_PACKET pkt;
+    if(proto_conn_recv_header(&sp->conn, &pkt) == -1)
+	return -1;
+    if(pkt.type != XACTO_DATA_PKT) {
+	debug("[%d] Expected DATA packet, got %s", sp->fd,
+	      pkt.type <= XACTO_LAST_PKT ? xacto_packet_type_names[pkt.type] : "?");
+	return -1;
+    }
+    if(pkt.null && pkt.size == 0) {
+	*bpp = NULL;
+	return 0;
+    }
+    // A null data value may still come with a payload, which is ignored.
+    BLOB *bp = blob_alloc(pkt.size);
+    if(pkt.size > 0 && proto_conn_recv_payload(&sp->conn, bp->content, pkt.size) == -1) {
+	blob_unref(bp, "for data not received");
+	return -1;
+    }
+    if(pkt.null) {
+	blob_unref(bp, "for null data value");
+	bp = NULL;
+    }
+    *bpp = bp;
+    return 0;
+}
+
+/*
+ * Receive a key, which may not be null.
+ */
+static int recv_key(SESSION *sp, KEY **kpp) {
+    BLOB *bp;
+    if(recv_data(sp, &bp) == -1)
+	return -1;
+    if(bp == NULL) {
+	debug("[%d] Null key", sp->fd);
+	return -1;
+    }
+    *kpp = key_create(bp);
+    return 0;
+}
+
+/*
+ * Send a REPLY with a payload, tagged with the ID of the request if the
+ * session uses tags.
+ */
+static int send_reply_payload(SESSION *sp, TRANS_STATUS status, void *payload, size_t size) {
+    XACTO_PACKET pkt;
+    char *buf = NULL;
+    if(sp->tagged) {
+	uint32_t tag = htonl(sp->tag);
+	buf = Malloc(sizeof(tag) + size);
+	memcpy(buf, &tag, sizeof(tag));
+	if(size > 0)
+	    memcpy(buf + sizeof(tag), payload, size);
+	payload = buf;
+	size += sizeof(tag);
+    }
+    proto_init_packet(&pkt, XACTO_REPLY_PKT, size);
+    pkt.status = status;
+    int ret = proto_conn_send(&sp->conn, &pkt, payload);
+    free(buf);
+    return ret;
+}
+
+static int send_reply(SESSION *sp, TRANS_STATUS status) {
+    return send_reply_payload(sp, status, NULL, 0);
+}
+
+static int send_data(SESSION *sp, BLOB *bp) {
+    XACTO_PACKET pkt;
+    proto_init_packet(&pkt, XACTO_DATA_PKT, bp != NULL ? bp->size : 0);
+    pkt.null = bp == NULL;
+    return proto_conn_send(&sp->conn, &pkt, bp != NULL ? bp->content : NULL);
+}
+
+/*
+ * Request handlers.  Each returns 0 if the transaction goes on, 1 if it
+ * has ended, by committing or aborting, or -1 if the connection failed or
+ * the client broke the protocol.
+ */
+static int do_put(SESSION *sp) {
+    KEY *key;
+    BLOB *value;
+    if(recv_key(sp, &key) == -1)
+	return -1;
+    if(recv_data(sp, &value) == -1) {
+	key_dispose(key);
+	return -1;
+    }
+    if(sp->snap != NULL) {
+	debug("[%d] PUT in read-only transaction", sp->fd);
+	key_dispose(key);
+	if(value != NULL)
+	    blob_unref(value, "for value not stored");
+	return send_reply(sp, TRANS_ABORTED) == -1 ? -1 : 1;
+    }
+    TRANS_STATUS status = store_put(session_trans(sp), key, value);
+    if(send_reply(sp, status) == -1)
+	return -1;
+    return status == TRANS_ABORTED;
+}
+
+static int do_get(SESSION *sp) {
+    KEY *key;
+    BLOB *value;
+    if(recv_key(sp, &key) == -1)
+	return -1;
+    TRANS_STATUS status;
+    if(sp->snap != NULL) {
+	value = store_get_snapshot(sp->snap, key);
+	status = TRANS_PENDING;
+    } else {
+	status = store_get(session_trans(sp), key, &value);
+    }
+    if(send_reply(sp, status) == -1) {
+	if(value != NULL)
+	    blob_unref(value, "for value not sent");
+	return -1;
+    }
+    if(status == TRANS_ABORTED)
+	return 1;
+    int ret = send_data(sp, value);
+    if(value != NULL)
+	blob_unref(value, "for value sent");
+    return ret;
+}
+
+static int do_add(SESSION *sp, XACTO_PACKET *pkt, void *payload) {
+    uint64_t delta;
+    if(pkt->size != sizeof(delta)) {
+	debug("[%d] Bad ADD payload", sp->fd);
+	return -1;
+    }
+    memcpy(&delta, payload, sizeof(delta));
+    delta = be64toh(delta);
+    KEY *key;
+    if(recv_key(sp, &key) == -1)
+	return -1;
+    if(sp->snap != NULL) {
+	debug("[%d] ADD in read-only transaction", sp->fd);
+	key_dispose(key);
+	return send_reply(sp, TRANS_ABORTED) == -1 ? -1 : 1;
+    }
+    BLOB *value;
+    TRANS_STATUS status = store_add(session_trans(sp), key, (long)delta, &value);
+    if(send_reply(sp, status) == -1) {
+	if(value != NULL)
+	    blob_unref(value, "for value not sent");
+	return -1;
+    }
+    if(status == TRANS_ABORTED)
+	return 1;
+    int ret = send_data(sp, value);
+    if(value != NULL)
+	blob_unref(value, "for value sent");
+    return ret;
+}
+
+static int do_cas(SESSION *sp) {
+    KEY *key;
+    BLOB *expected, *value;
+    if(recv_key(sp, &key) == -1)
+	return -1;
+    if(recv_data(sp, &expected) == -1) {
+	key_dispose(key);
+	return -1;
+    }
+    if(recv_data(sp, &value) == -1) {
+	key_dispose(key);
+	if(expected != NULL)
+	    blob_unref(expected, "for expected value not used");
+	return -1;
+    }
+    if(sp->snap != NULL) {
+	debug("[%d] CAS in read-only transaction", sp->fd);
+	key_dispose(key);
+	if(expected != NULL)
+	    blob_unref(expected, "for expected value not used");
+	if(value != NULL)
+	    blob_unref(value, "for value not stored");
+	return send_reply(sp, TRANS_ABORTED) == -1 ? -1 : 1;
+    }
+    int swapped;
+    BLOB *current;
+    TRANS_STATUS status = store_cas(session_trans(sp), key, expected, value, &swapped, &current);
+    char flag = swapped;
+    int ret = send_reply_payload(sp, status, &flag, 1);
+    if(ret == 0 && !swapped && status != TRANS_ABORTED)
+	ret = send_data(sp, current);
+    if(current != NULL)
+	blob_unref(current, "for value sent");
+    return ret == -1 ? -1 : status == TRANS_ABORTED;
+}
+
+/*
+ * Send a key and value visited by a scan.  In event mode the replies are
+ * only buffered, so the scan stops once they are past SESSION_OUTPUT_HIGH,
+ * to go on from the next key once they have been written.
+ */
+static int send_scanned(BLOB *key, BLOB *value, void *arg) {
+    SESSION *sp = arg;
+    if(send_data(sp, key) == -1 || send_data(sp, value) == -1)
+	return -1;
+    sp->scan_count++;
+    if(sp->event && proto_conn_unsent(&sp->conn) > SESSION_OUTPUT_HIGH) {
+	// The key just past this one, in the order of skiplist_compare().
+	char *content = Malloc(key->size + 1);
+	memcpy(content, key->content, key->size);
+	content[key->size] = '\0';
+	if(sp->scan_lo != NULL)
+	    blob_unref(sp->scan_lo, "for scan position passed");
+	sp->scan_lo = blob_create(content, key->size + 1);
+	free(content);
+	sp->scan_stopped = 1;
+	return 1;
+    }
+    return 0;
+}
+
+static void scan_end(SESSION *sp) {
+    if(sp->scan_lo != NULL)
+	blob_unref(sp->scan_lo, "for scan ended");
+    if(sp->scan_hi != NULL)
+	blob_unref(sp->scan_hi, "for scan ended");
+    sp->scan_lo = sp->scan_hi = NULL;
+}
+
+/*
+ * Run a scan, or go on with one that stopped for its output to be written.
+ * Going on from the key after the last one visited reads the same keys,
+ * and records the same range for the transaction, as a single scan would.
+ *
+ * @return  As for do_scan().
+ */
+static int scan_run(SESSION *sp) {
+    // store_scan() takes an int; no scan gets anywhere near that many keys.
+    int limit = 0;
+    if(sp->scan_limit > 0) {
+	uint32_t left = sp->scan_limit - sp->scan_count;
+	limit = left > INT_MAX ? INT_MAX : (int)left;
+    }
+    KEY *lokey = sp->scan_lo != NULL ? key_create(blob_ref(sp->scan_lo, "for scan bound")) : NULL;
+    KEY *hikey = sp->scan_hi != NULL ? key_create(blob_ref(sp->scan_hi, "for scan bound")) : NULL;
+    sp->scan_stopped = 0;
+    TRANS_STATUS status = TRANS_PENDING;
+    if(sp->snap != NULL)
+	store_scan_snapshot(sp->snap, lokey, hikey, limit, send_scanned, sp);
+    else
+	status = store_scan(session_trans(sp), lokey, hikey, limit, send_scanned, sp);
+    if(sp->scan_stopped && status != TRANS_ABORTED
+       && (sp->scan_limit == 0 || sp->scan_count < sp->scan_limit))
+	return 3;
+    scan_end(sp);
+    if(send_reply(sp, status) == -1)
+	return -1;
+    return status == TRANS_ABORTED;
+}
+
+/*
+ * @return  As for other requests, or 3 if the scan stopped for its output
+ * to be written, in which case it goes on when the session is served again.
+ */
+static int do_scan(SESSION *sp, XACTO_PACKET *pkt, void *payload) {
+    uint32_t limit = 0;
+    if(pkt->size >= sizeof(limit)) {
+	memcpy(&limit, payload, sizeof(limit));
+	limit = ntohl(limit);
+    }
+    BLOB *lo, *hi;
+    if(recv_data(sp, &lo) == -1)
+	return -1;
+    if(recv_data(sp, &hi) == -1) {
+	if(lo != NULL)
+	    blob_unref(lo, "for scan bound not used");
+	return -1;
+    }
+    sp->scan_lo = lo;
+    sp->scan_hi = hi;
+    sp->scan_limit = limit;
+    sp->scan_count = 0;
+    return scan_run(sp);
+}
+
+/*
+ * Take a 32-bit count or length from the payload of a batch request.
+ */
+static int take_word(char **pp, char *end, uint32_t *wp) {
+    if(end - *pp < (long)sizeof(*wp))
+	return -1;
+    memcpy(wp, *pp, sizeof(*wp));
+    *wp = ntohl(*wp);
+    *pp += sizeof(*wp);
+    return 0;
+}
+
+/*
+ * Take an item from the payload of a batch request, as a blob, or NULL
+ * for a null data value.
+ */
+static int take_item(char **pp, char *end, BLOB **bpp) {
+    uint32_t len;
+    if(take_word(pp, end, &len) == -1)
+	return -1;
+    if(len == XACTO_NULL_ITEM) {
+	*bpp = NULL;
+	return 0;
+    }
+    if((uint32_t)(end - *pp) < len)
+	return -1;
+    *bpp = blob_create(*pp, len);
+    *pp += len;
+    return 0;
+}
+
+static char *put_item(char *p, BLOB *bp) {
+    uint32_t len = htonl(bp != NULL ? bp->size : XACTO_NULL_ITEM);
+    memcpy(p, &len, sizeof(len));
+    p += sizeof(len);
+    if(bp != NULL) {
+	memcpy(p, bp->content, bp->size);
+	p += bp->size;
+    }
+    return p;
+}
+
+/*
+ * Decode the payload of an MGET or MPUT request into arrays of keys and,
+ * for MPUT, values.  The arrays have room for at least one element, and
+ * are freed, along with anything in them, if the payload is malformed.
+ *
+ * @return  The number of keys, or -1 if the payload is malformed.
+ */
+static int take_batch(SESSION *sp, XACTO_PACKET *pkt, void *payload,
+		      KEY ***keysp, BLOB ***valuesp, int put) {
+    char *p = payload, *end = p + pkt->size;
+    uint32_t n;
+    if(payload == NULL || take_word(&p, end, &n) == -1 || n > XACTO_BATCH_MAX) {
+	debug("[%d] Bad batch count", sp->fd);
+	return -1;
+    }
+    KEY **keys = Calloc(n + 1, sizeof(KEY *));
+    BLOB **values = Calloc(n + 1, sizeof(BLOB *));
+    uint32_t i;
+    for(i = 0; i < n; i++) {
+	BLOB *bp;
+	if(take_item(&p, end, &bp) == -1 || bp == NULL)
+	    break;
+	keys[i] = key_create(bp);
+	if(put && take_item(&p, end, &values[i]) == -1) {
+	    key_dispose(keys[i]);
+	    break;
+	}
+    }
+    if(i < n) {
+	debug("[%d] Malformed batch at item %d", sp->fd, i);
+	for(uint32_t j = 0; j < i; j++) {
+	    key_dispose(keys[j]);
+	    if(values[j] != NULL)
+		blob_unref(values[j], "for value in malformed batch");
+	}
+	free(keys);
+	free(values);
+	return -1;
+    }
+    *keysp = keys;
+    *valuesp = values;
+    return n;
+}
+
+static int do_mget(SESSION *sp, XACTO_PACKET *pkt, void *payload) {
+    KEY **keys;
+    BLOB **values;
+    int n = take_batch(sp, pkt, payload, &keys, &values, 0);
+    if(n == -1)
+	return -1;
+    TRANS_STATUS *statuses = Calloc(n + 1, sizeof(TRANS_STATUS));
+    TRANS_STATUS status = TRANS_PENDING;
+    if(sp->snap != NULL) {
+	for(int i = 0; i < n; i++) {
+	    values[i] = store_get_snapshot(sp->snap, keys[i]);
+	    statuses[i] = TRANS_PENDING;
+	}
+    } else {
+	status = store_get_many(session_trans(sp), n, keys, values, statuses);
+    }
+    /*
+     * A reply larger than the packet limit is not made.  The values are
+     * dropped, and the transaction aborts instead.
+     */
+    size_t size = 0, tag = sp->tagged ? sizeof(uint32_t) : 0;
+    int i;
+    for(i = 0; i < n; i++) {
+	size += 1 + sizeof(uint32_t) + (values[i] != NULL ? values[i]->size : 0);
+	if(tag + size > sp->conn.packet_max)
+	    break;
+    }
+    if(i < n) {
+	debug("[%d] MGET reply over %lu bytes", sp->fd, sp->conn.packet_max);
+	for(i = 0; i < n; i++) {
+	    if(values[i] != NULL)
+		blob_unref(values[i], "for value not sent");
+	    values[i] = NULL;
+	    statuses[i] = TRANS_ABORTED;
+	}
+	if(sp->snap != NULL)
+	    status = TRANS_ABORTED;
+	else
+	    status = trans_abort(trans_ref(sp->tp, "for MGET reply too large"));
+	size = n * (1 + sizeof(uint32_t));
+    }
+    char *buf = Malloc(size + 1), *p = buf;
+    for(i = 0; i < n; i++) {
+	*p++ = statuses[i];
+	p = put_item(p, values[i]);
+	if(values[i] != NULL)
+	    blob_unref(values[i], "for value sent");
+    }
+    int ret = send_reply_payload(sp, status, buf, size);
+    free(buf);
+    free(statuses);
+    free(values);
+    free(keys);
+    return ret == -1 ? -1 : status == TRANS_ABORTED;
+}
+
+static int do_mput(SESSION *sp, XACTO_PACKET *pkt, void *payload) {
+    KEY **keys;
+    BLOB **values;
+    int n = take_batch(sp, pkt, payload, &keys, &values, 1);
+    if(n == -1)
+	return -1;
+    TRANS_STATUS *statuses = Calloc(n + 1, sizeof(TRANS_STATUS));
+    TRANS_STATUS status = TRANS_ABORTED;
+    if(sp->snap != NULL) {
+	debug("[%d] MPUT in read-only transaction", sp->fd);
+	for(int i = 0; i < n; i++) {
+	    key_dispose(keys[i]);
+	    if(values[i] != NULL)
+		blob_unref(values[i], "for value not stored");
+	    statuses[i] = TRANS_ABORTED;
+	}
+    } else {
+	status = store_put_many(session_trans(sp), n, keys, values, statuses);
+    }
+    char *buf = Malloc(n + 1);
+    for(int i = 0; i < n; i++)
+	buf[i] = statuses[i];
+    int ret = send_reply_payload(sp, status, buf, n);
+    free(buf);
+    free(statuses);
+    free(values);
+    free(keys);
+    return ret == -1 ? -1 : status == TRANS_ABORTED;
+}
+
+static int do_snapshot(SESSION *sp) {
+    if(sp->tp != NULL || sp->snap != NULL) {
+	debug("[%d] SNAPSHOT after transaction has started", sp->fd);
+	return send_reply(sp, TRANS_ABORTED) == -1 ? -1 : 1;
+    }
+    sp->snap = trans_snapshot_create();
+    return send_reply(sp, TRANS_PENDING);
+}
+
+static int do_begin(SESSION *sp) {
+    if(sp->tp != NULL || sp->snap != NULL)
+	debug("[%d] BEGIN abandons the current transaction", sp->fd);
+    session_end_trans(sp);
+    sp->persistent = 1;
+    return send_reply(sp, TRANS_PENDING);
+}
+
+static int do_hello(SESSION *sp, XACTO_PACKET *pkt, void *payload, int first) {
+    uint32_t features;
+    if(!first || pkt->size != sizeof(features)) {
+	debug("[%d] Bad HELLO", sp->fd);
+	return -1;
+    }
+    memcpy(&features, payload, sizeof(features));
+    features = ntohl(features) & XACTO_FEATURES;
+    debug("[%d] HELLO, features %#x", sp->fd, features);
+    uint32_t reply = htonl(features);
+    if(send_reply_payload(sp, TRANS_PENDING, &reply, sizeof(reply)) == -1)
+	return -1;
+    if(features & XACTO_FEATURE_TAGS)
+	sp->tagged = sp->persistent = 1;
+    return 0;
+}
+
+static void session_committed(TRANS_STATUS status, void *arg) {
+    SESSION *sp = arg;
+    sp->commit_status = status;
+    if(sp->fiber != NULL)
+	fiber_wake(sp->fiber);
+    else
+	sp->wake(sp->wake_arg);
+}
+
+static void session_logged(int ret, void *arg) {
+    SESSION *sp = arg;
+    sp->log_status = ret;
+    if(sp->fiber != NULL)
+	fiber_wake(sp->fiber);
+    else
+	sp->wake(sp->wake_arg);
+}
+
+/*
+ * Wait for a commit that went through to be durable before it is
+ * acknowledged (see wal_wait_durable()).  The wait blocks only a session
+ * that has neither a wake function nor a fiber.
+ *
+ * @return  0 once it is durable, 2 if the session is to wait for the log
+ * and be called again, or -1 if the log has failed.
+ */
+static int commit_durable(SESSION *sp) {
+    if(sp->logging) {
+	sp->logging = 0;
+	return sp->log_status;
+    }
+    if(sp->commit_status != TRANS_COMMITTED)
+	return 0;
+    if(sp->wake == NULL && sp->fiber == NULL)
+	return wal_wait_durable(NULL, NULL);
+    int ret = wal_wait_durable(session_logged, sp);
+    if(ret != 1)
+	return ret;
+    if(sp->fiber == NULL) {
+	sp->logging = 1;
+	return 2;
+    }
+    fiber_park();
+    return sp->log_status;
+}
+
+/*
+ * @return  As for other requests, or 2 if the commit is waiting for other
+ * transactions or for the log, in which case the reply is sent when the
+ * session goes on.
+ */
+static int do_commit(SESSION *sp) {
+    TRANS_STATUS status = TRANS_COMMITTED;
+    if(sp->snap != NULL) {
+	trans_snapshot_release(sp->snap);
+	sp->snap = NULL;
+    } else {
+	// Committing may wait for other transactions, whose clients may be
+	// waiting for the replies to requests before this one.  Otherwise the
+	// replies go out with the reply to the commit, rather than ahead of it
+	// in a segment of their own that would hold it back under Nagle.
+	TRANSACTION *tp = session_trans(sp);
+	int may_block = tp->depends != NULL;
+	if(may_block && proto_conn_flush(&sp->conn) == -1)
+	    return -1;
+	sp->tp = NULL;
+	if(may_block && (sp->wake != NULL || sp->fiber != NULL))
+	    status = trans_commit_async(tp, session_committed, sp);
+	else
+	    status = trans_commit(tp);
+	if(status == TRANS_PENDING) {
+	    if(sp->fiber == NULL)
+		return 2;
+	    fiber_park();
+	    status = sp->commit_status;
+	}
+    }
+    sp->commit_status = status;
+    int ret = commit_durable(sp);
+    if(ret != 0)
+	return ret;
+    return send_reply(sp, status) == -1 ? -1 : 1;
+}
+
+/*
+ * Go on from a request of a given type once its handler has returned.
+ *
+ * @return  As for session_request().
+ */
+static int session_finish(SESSION *sp, int type, int ret) {
+    if(ret == 2) {
+	sp->committing = 1;
+	return 1;
+    }
+    if(ret == 3) {
+	sp->scanning = 1;
+	return 2;
+    }
+    if(ret == 1) {
+	if(sp->tagged && type != XACTO_COMMIT_PKT) {
+	    session_doom(sp);
+	    return 0;
+	}
+	session_end_trans(sp);
+	if(!sp->persistent)
+	    return -1;
+    }
+    return ret == -1 ? -1 : 0;
+}
+
+/*
+ * Receive a request and handle it.
+ *
+ * @return  0 if the session goes on, 1 if it waits for a commit, 2 if it
+ * has stopped in a scan for its output to be written, -1 if it is over.
+ */
+static int session_request(SESSION *sp) {
+    XACTO_PACKET pkt;
+    void *payload = NULL;
+    if(proto_conn_recv(&sp->conn, &pkt, &payload) == -1) {
+	debug("[%d] EOF on client connection", sp->fd);
+	return -1;
+    }
+    int first = !sp->started;
+    sp->started = 1;
+    // Take the request ID off the front of the payload.
+    void *body = payload;
+    if(sp->tagged) {
+	if(pkt.size < sizeof(sp->tag)) {
+	    debug("[%d] Untagged request", sp->fd);
+	    free(payload);
+	    return -1;
+	}
+	memcpy(&sp->tag, payload, sizeof(sp->tag));
+	sp->tag = ntohl(sp->tag);
+	pkt.size -= sizeof(sp->tag);
+	body = pkt.size > 0 ? (char *)payload + sizeof(sp->tag) : NULL;
+    }
+    int ret;
+    switch(pkt.type) {
+    case XACTO_PUT_PKT:
+	ret = do_put(sp);
+	break;
+    case XACTO_GET_PKT:
+	ret = do_get(sp);
+	break;
+    case XACTO_SCAN_PKT:
+	ret = do_scan(sp, &pkt, body);
+	break;
+    case XACTO_MGET_PKT:
+	ret = do_mget(sp, &pkt, body);
+	break;
+    case XACTO_MPUT_PKT:
+	ret = do_mput(sp, &pkt, body);
+	break;
+    case XACTO_ADD_PKT:
+	ret = do_add(sp, &pkt, body);
+	break;
+    case XACTO_CAS_PKT:
+	ret = do_cas(sp);
+	break;
+    case XACTO_SNAPSHOT_PKT:
+	ret = do_snapshot(sp);
+	break;
+    case XACTO_COMMIT_PKT:
+	ret = do_commit(sp);
+	break;
+    case XACTO_BEGIN_PKT:
+	ret = do_begin(sp);
+	break;
+    case XACTO_HELLO_PKT:
+	ret = do_hello(sp, &pkt, body, first);
+	break;
+    default:
+	debug("[%d] Unexpected packet type %d", sp->fd, pkt.type);
+	ret = -1;
+	break;
+    }
+    free(payload);
+    return session_finish(sp, pkt.type, ret);
+}
+
+SESSION *session_open(int fd, int event) {
+    SESSION *sp = Malloc(sizeof(SESSION));
+    memset(sp, 0, sizeof(*sp));
+    sp->fd = fd;
+    sp->event = event;
+    if(event)
+	proto_conn_init_event(&sp->conn, fd);
+    else
+	proto_conn_init(&sp->conn, fd);
+    proto_conn_set_packet_max(&sp->conn, packet_max);
+    debug("[%d] Starting client service", fd);
+    creg_register(client_registry, fd);
+    return sp;
+}
+
+void session_set_packet_max(size_t max) {
+    packet_max = max;
+}
+
+size_t session_packet_max(void) {
+    return packet_max;
+}
+
+XACTO_CONN *session_conn(SESSION *sp) {
+    return &sp->conn;
+}
+
+void session_set_wake(SESSION *sp, SESSION_WAKE *wake, void *arg) {
+    sp->wake = wake;
+    sp->wake_arg = arg;
+}
+
+int session_serve(SESSION *sp) {
+    if(sp->committing) {
+	int ret = commit_durable(sp);
+	if(ret == 2)
+	    return 1;
+	sp->committing = 0;
+	if(ret == -1 || send_reply(sp, sp->commit_status) == -1)
+	    return -1;
+	session_end_trans(sp);
+	if(!sp->persistent)
+	    return -1;
+    }
+    if(sp->scanning) {
+	sp->scanning = 0;
+	int ret = session_finish(sp, XACTO_SCAN_PKT, scan_run(sp));
+	if(ret != 0)
+	    return ret;
+    }
+    while(proto_conn_pending(&sp->conn)) {
+	// The client takes some of the replies before any more requests.
+	if(proto_conn_unsent(&sp->conn) > SESSION_OUTPUT_HIGH)
+	    return 2;
+	int ret = session_request(sp);
+	if(ret != 0)
+	    return ret;
+    }
+    return 0;
+}
+
+void session_close(SESSION *sp) {
+    proto_conn_flush(&sp->conn);
+    // A transaction that did not get to commit is aborted.
+    session_end_trans(sp);
+    scan_end(sp);
+    debug("[%d] Ending client service", sp->fd);
+    creg_unregister(client_registry, sp->fd);
+    close(sp->fd);
+    proto_conn_fini(&sp->conn);
+    free(sp);
+}
+
+/*
+ * Run a session in blocking mode from start to finish.
+ */
+static void session_run(SESSION *sp) {
+    for(;;) {
+	// Replies go out once the requests that have arrived are handled.
+	if(!proto_conn_pending(&sp->conn) && proto_conn_flush(&sp->conn) == -1)
+	    break;
+	if(session_request(sp) == -1)
+	    break;
+    }
+    session_close(sp);
+}
+
+void *xacto_client_service(void *arg) {
+    int fd = *(int *)arg;
     free(arg);
     pthread_detach(pthread_self());
-    creg_register(client_registry, fd);
-    TRANSACTION *transac = trans_create();
-    while(1)
-    {
-        BLOB *key_blob;
-        KEY *k;
-        BLOB *value_blob;
-        BLOB *data_blob;
-        XACTO_PACKET *send = Malloc(sizeof(XACTO_PACKET));
-        XACTO_PACKET *receive = Malloc(sizeof(XACTO_PACKET));
-        void **payload = Malloc(sizeof(void **));
-        if(proto_recv_packet(fd, receive, payload) < 0)
-        {
-            free_func(send,receive,payload,fd);
-            break;
-        }
-        if((receive->type==XACTO_PUT_PKT || receive->type==XACTO_DATA_PKT) && (g_flag==0))
-        {
-            if(p_flag==0)
-            {
-                p_flag++;
-                continue;
-            }
-            if(p_flag==1)
-            {
-                p_flag++;
-                key_blob = blob_create(*payload,strlen(*payload));
-                k = key_create(key_blob);
-                continue;
-            }
-            if(p_flag==2)
-            {
-                p_flag=0;
-                value_blob = blob_create(*payload,strlen(*payload));
-                int x = store_put(transac, k, value_blob);
-                if(x==TRANS_ABORTED)
-                {
-                    receive->type = XACTO_REPLY_PKT;
-                    receive->status = 2;
-                    receive->size = 0;
-                    receive->timestamp_sec = receive->timestamp_sec;
-                    receive->timestamp_nsec = receive->timestamp_nsec;
-                    proto_send_packet(fd,receive,NULL);
-                    free(payload);
-                    break;
-                }
-                store_show();
-                trans_show_all();
-                send->type = XACTO_REPLY_PKT;
-                send->status = transac->status;
-                send->null = 0;
-                send->size = 0;
-                send->timestamp_sec = receive->timestamp_sec;
-                send->timestamp_nsec = receive->timestamp_nsec;
-                proto_send_packet(fd, send, *payload);
-                continue;
-            }
-        }
-        else if((receive->type==XACTO_GET_PKT || receive->type==XACTO_DATA_PKT) && (p_flag==0))
-        {
-            if(g_flag==0)
-            {
-                g_flag=1;
-                continue;
-            }
-            if(g_flag==1)
-            {
-                g_flag=0;
-                key_blob = blob_create(*payload,strlen(*payload));
-                data_blob = Malloc(sizeof(BLOB*));
-                k = key_create(key_blob);
-                int x = store_get(transac, k, &data_blob);
-                if(x==TRANS_ABORTED)
-                {
-                    receive->type = XACTO_REPLY_PKT;
-                    receive->status = 2;
-                    receive->size = 0;
-                    receive->timestamp_sec = receive->timestamp_sec;
-                    receive->timestamp_nsec = receive->timestamp_nsec;
-                    proto_send_packet(fd,receive,NULL);
-                    free(payload);
-                    break;
-                }
-                store_show();
-                trans_show_all();
-                receive->type = XACTO_REPLY_PKT;
-                receive->status = 0;
-                receive->size = 0;
-                receive->timestamp_sec = receive->timestamp_sec;
-                receive->timestamp_nsec = receive->timestamp_nsec;
-                proto_send_packet(fd,receive,payload);
-                receive->type = XACTO_DATA_PKT;
-                receive->status = 0;
-                if(data_blob==NULL)
-                {
-                    receive->null = 1;
-                    receive->size = 0;
-                    proto_send_packet(fd,receive,NULL);
-                }
-                else
-                {
-                    receive->size = data_blob->size;
-                    proto_send_packet(fd,receive,data_blob->content);
-                }
-                continue;
-            }
-
-        }
-        else if(strcmp(pkt_type(receive),"COMMIT")==0)
-        {
-            trans_commit(transac);
-            receive->status = 1;
-            receive->type = XACTO_REPLY_PKT;
-            receive->timestamp_sec = receive->timestamp_sec;
-            receive->timestamp_nsec = receive->timestamp_nsec;
-            proto_send_packet(fd,receive,NULL);
-            break;
-        }
-        main_free_func(send,receive,payload);
-    }
-    creg_unregister(client_registry,fd);
-    shutdown(fd,SHUT_RD);
+    session_run(session_open(fd, 0));
     return NULL;
 }
-void free_func(XACTO_PACKET *s, XACTO_PACKET *r, void **p, int fd)
-{
-    free(s);
-    free(r);
-    free(p);
-    shutdown(fd,SHUT_RD);
-}
-void main_free_func(XACTO_PACKET *s, XACTO_PACKET *r, void **p)
-{
-    free(s);
-    free(r);
-    free(p);
-}
-char *pkt_type(XACTO_PACKET *r)
-{
-    if(r->type == XACTO_PUT_PKT)
-    {
-        return "PUT";
-    }
-    else if(r->type == XACTO_GET_PKT)
-    {
-        return "GET";
-    }
-    else if(r->type == XACTO_COMMIT_PKT)
-    {
-        return "COMMIT";
-    }
-    else return NULL;
-}
\ No newline at end of file
+
+void xacto_client_fiber(void *arg) {
+    int fd = *(int *)arg;
+    free(arg);
+    // Reads and writes that would block yield to other fibers instead.
+    int flags = fcntl(fd, F_GETFL);
+    if(flags == -1 || (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)) {
+	close(fd);
+	return;
+    }
+    SESSION *sp = session_open(fd, 0);
+    sp->fiber = fiber_self();
+    proto_conn_set_wait(&sp->conn, fiber_wait);
+    session_run(sp);
+}
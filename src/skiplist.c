@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "csapp.h"
+#include "skiplist.h"
+#include "epoch.h"
+
+/*
+ * Each node reaches the next level up with probability 1/4.
+ */
+static int random_height(void) {
+    static __thread unsigned int seed;
+    if(seed == 0)
+	seed = (unsigned int)(unsigned long)&seed | 1;
+    int h = 1;
+    while(h < SKIPLIST_MAX_LEVEL && (rand_r(&seed) & 3) == 0)
+	h++;
+    return h;
+}
+
+static SKIPLIST_NODE *node_create(MAP_ENTRY *ep, int height) {
+    SKIPLIST_NODE *np = Calloc(1, sizeof(SKIPLIST_NODE) + height * sizeof(SKIPLIST_NODE *));
+    np->entry = ep;
+    np->height = height;
+    return np;
+}
+
+int skiplist_compare(BLOB *bp1, BLOB *bp2) {
+    size_t n = bp1->size < bp2->size ? bp1->size : bp2->size;
+    int c = memcmp(bp1->content, bp2->content, n);
+    if(c != 0)
+	return c;
+    return bp1->size < bp2->size ? -1 : bp1->size > bp2->size;
+}
+
+void skiplist_init(SKIPLIST *sl) {
+    pthread_mutex_init(&sl->mutex, NULL);
+    sl->count = 0;
+    sl->head = node_create(NULL, SKIPLIST_MAX_LEVEL);
+}
+
+void skiplist_fini(SKIPLIST *sl) {
+    SKIPLIST_NODE *np = sl->head;
+    while(np != NULL) {
+	SKIPLIST_NODE *next = np->next[0];
+	free(np);
+	np = next;
+    }
+    sl->head = NULL;
+    pthread_mutex_destroy(&sl->mutex);
+}
+
+/*
+ * Find, at every level, the last node whose key comes before a given key.
+ * Called with the mutex held.
+ */
+static void find_preds(SKIPLIST *sl, BLOB *key, SKIPLIST_NODE **preds) {
+    SKIPLIST_NODE *np = sl->head;
+    for(int i = SKIPLIST_MAX_LEVEL - 1; i >= 0; i--) {
+	while(np->next[i] != NULL && skiplist_compare(np->next[i]->entry->key->blob, key) < 0)
+	    np = np->next[i];
+	preds[i] = np;
+    }
+}
+
+void skiplist_insert(SKIPLIST *sl, MAP_ENTRY *ep) {
+    SKIPLIST_NODE *preds[SKIPLIST_MAX_LEVEL];
+    SKIPLIST_NODE *np = node_create(ep, random_height());
+    pthread_mutex_lock(&sl->mutex);
+    find_preds(sl, ep->key->blob, preds);
+    for(int i = 0; i < np->height; i++) {
+	np->next[i] = preds[i]->next[i];
+	__atomic_store_n(&preds[i]->next[i], np, __ATOMIC_RELEASE);
+    }
+    sl->count++;
+    pthread_mutex_unlock(&sl->mutex);
+}
+
+void skiplist_remove(SKIPLIST *sl, MAP_ENTRY *ep) {
+    SKIPLIST_NODE *preds[SKIPLIST_MAX_LEVEL];
+    pthread_mutex_lock(&sl->mutex);
+    find_preds(sl, ep->key->blob, preds);
+    SKIPLIST_NODE *np = preds[0]->next[0];
+    if(np == NULL || np->entry != ep) {
+	pthread_mutex_unlock(&sl->mutex);
+	return;
+    }
+    for(int i = np->height - 1; i >= 0; i--)
+	__atomic_store_n(&preds[i]->next[i], np->next[i], __ATOMIC_RELEASE);
+    sl->count--;
+    pthread_mutex_unlock(&sl->mutex);
+    epoch_retire(np, free);
+}
+
+int skiplist_range(SKIPLIST *sl, BLOB *from, int after, BLOB *to, BLOB **keys, int max) {
+    int n = 0;
+    epoch_enter();
+    SKIPLIST_NODE *np = sl->head;
+    if(from != NULL) {
+	for(int i = SKIPLIST_MAX_LEVEL - 1; i >= 0; i--) {
+	    SKIPLIST_NODE *next;
+	    while((next = __atomic_load_n(&np->next[i], __ATOMIC_ACQUIRE)) != NULL
+		  && skiplist_compare(next->entry->key->blob, from) < 0)
+		np = next;
+	}
+    }
+    np = __atomic_load_n(&np->next[0], __ATOMIC_ACQUIRE);
+    if(np != NULL && from != NULL && after && !skiplist_compare(np->entry->key->blob, from))
+	np = __atomic_load_n(&np->next[0], __ATOMIC_ACQUIRE);
+    while(np != NULL && n < max) {
+	BLOB *bp = np->entry->key->blob;
+	if(to != NULL && skiplist_compare(bp, to) >= 0)
+	    break;
+	// The entry's own reference keeps the blob alive until the entry
+	// is freed, which cannot happen before we leave the critical section.
+	keys[n++] = blob_ref(bp, "for key returned from index");
+	np = __atomic_load_n(&np->next[0], __ATOMIC_ACQUIRE);
+    }
+    epoch_exit();
+    return n;
+}
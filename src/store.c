@@ -0,0 +1,1473 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "debug.h"
+#include "csapp.h"
+#include "store.h"
+#include "store_funcs.h"
+#include "data_funcs.h"
+#include "transaction_funcs.h"
+#include "flat_table.h"
+#include "skiplist.h"
+#include "epoch.h"
+#include "wal.h"
+
+static char *trans_status_names[] = { "pending", "committed", "aborted" };
+
+/*
+ * State for resizing the map.  While a rehash is in progress the entries
+ * are spread over the_map.table and old_table.  Buckets of old_table that
+ * have already been moved are empty.  The table pointers only change with
+ * every stripe locked; num_entries and rehash_remaining are updated
+ * atomically from under individual stripe locks.
+ *
+ * Lock-free readers cannot rely on the stripes, so every change to the table
+ * pointers is bracketed by map_seq, which is odd while a change is under way,
+ * and each stripe has a similar count around the migration of its buckets.
+ * Anything unlinked while readers may be looking at it goes through
+ * epoch_retire() rather than being freed directly.
+ */
+static struct {
+    MAP_ENTRY **old_table;
+    int old_num_buckets;
+    int rehash_remaining;
+    int min_buckets;
+    int num_entries;
+    unsigned long resizes;
+} resize;
+
+static unsigned int map_seq;
+
+/*
+ * Lock stripes.  A key belongs to stripe (hash & (num_stripes - 1)).
+ * Since the table never has fewer buckets than stripes and both counts
+ * are powers of two, all keys in a bucket of either table belong to the
+ * same stripe, and the stripe of a key does not change across resizes.
+ * Each stripe migrates its own share of the old table during a rehash.
+ */
+typedef struct store_stripe {
+    pthread_mutex_t mutex;
+    int rehash_cursor;       // Next old bucket (in units of num_stripes) to migrate.
+    unsigned int seq;        // Odd while buckets are being migrated.
+    FLAT_TABLE *flat;        // The stripe's table, with STORE_INDEX_FLAT.
+    struct scan_range *scans; // Ranges of scans, checked by keys of this stripe.
+} __attribute__((aligned(64))) STORE_STRIPE;
+
+static STORE_STRIPE *stripes;
+static int num_stripes;
+
+/*
+ * With STORE_INDEX_FLAT, the_map.table is not used.  Instead each stripe has
+ * an open-addressing table of its own, which is resized on its own, all at
+ * once, under the stripe lock.  Lock-free readers just follow the stripe's
+ * table pointer; a replaced table is retired like anything else they might
+ * be looking at.
+ */
+static STORE_INDEX store_index;
+static int flat_min_groups;
+
+/*
+ * Ordered index of all map entries, for SCAN.  Entries are added when they
+ * are created and removed when the garbage collector reclaims them.
+ */
+static SKIPLIST ordered;
+
+/*
+ * Key ranges read by scans.  A scan reads every key that is in the map and
+ * in its range with the same rules as GET, which protects those keys from
+ * being overwritten by older transactions, but that leaves the keys that
+ * were absent.  So a scan also records its range, and an older transaction
+ * that brings a new key in that range into existence aborts, just as it
+ * would on finding a version by a younger transaction.
+ *
+ * A record is put on the list of every stripe, under each stripe lock in
+ * turn, before the scan reads the ordered index, and a new key checks the
+ * list of its own stripe under the lock it already holds.  So a key added
+ * to the index before the scan got to its stripe is seen by the scan, and
+ * one added after sees the record, with no lock shared by all new keys.
+ * A record is dropped from a list, by whoever walks it, once its
+ * transaction has aborted, or has committed and is older than every
+ * pending transaction; the garbage collector walks them all, so that no
+ * record outlives that for long.  The scan itself holds one more link
+ * while it runs.  hi is exclusive and either bound may be NULL, for an
+ * open-ended range; hi is narrowed at most once, by the scan, and the
+ * bound it replaces is kept until the record is freed.
+ */
+typedef struct scan_range {
+    TRANSACTION *tp;
+    BLOB *lo;
+    BLOB *hi;
+    BLOB *wide;              // The bound hi replaced, if any.
+    int links;               // Lists that hold the record, plus the scan.
+    struct scan_range *next[]; // Next on the list of each stripe.
+} SCAN_RANGE;
+
+static int num_scan_ranges;
+
+/*
+ * State of the background garbage collector.  The sweep cursor and the
+ * statistics are protected by the mutex, which is held for the duration of
+ * each sweep and is always taken before any stripe.
+ */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;     // Signalled to stop the thread.
+    pthread_t thread;
+    int running;
+    int stop;
+    int batch;               // Buckets per sweep.
+    int interval_ms;         // Time between sweeps.
+    int stripe;              // Position of the next sweep, with STORE_INDEX_FLAT.
+    int group;
+    STORE_GC_STATS stats;
+} gc = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static int bucket_index(int hash, int nbuckets) {
+    return (unsigned int)hash & (nbuckets - 1);
+}
+
+static int round_up_pow2(int n) {
+    int p = 1;
+    while(p < n)
+	p <<= 1;
+    return p;
+}
+
+/*
+ * Sequence count updates for lock-free readers.  Writers of any one count
+ * are serialized by the store locks.
+ */
+static void seq_begin(unsigned int *seqp) {
+    __atomic_store_n(seqp, *seqp + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void seq_end(unsigned int *seqp) {
+    __atomic_store_n(seqp, *seqp + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * A version holding its value inline.  Its blob pointer is &inline_tag,
+ * which marks it as such; the value is in data, and no blob is referenced.
+ * NULL values are never inline.  An inline version is never changed once
+ * it is in a version list, so lock-free readers may copy its value.
+ */
+typedef struct inline_version {
+    VERSION version;
+    uint32_t size;
+    char data[];
+} INLINE_VERSION;
+
+static BLOB inline_tag;
+static size_t inline_max;
+
+#define IS_INLINE(vp) ((vp)->blob == &inline_tag)
+
+void store_set_inline_max(size_t max) {
+    inline_max = max;
+}
+
+static VERSION *inline_version_create(TRANSACTION *tp, char *data, size_t size) {
+    INLINE_VERSION *ivp = Malloc(offsetof(INLINE_VERSION, data) + size);
+    ivp->version.creator = trans_ref(tp, "for inline version");
+    ivp->version.blob = &inline_tag;
+    ivp->version.next = ivp->version.prev = NULL;
+    ivp->size = size;
+    memcpy(ivp->data, data, size);
+    return &ivp->version;
+}
+
+/*
+ * Create a version for a value that was put, inheriting the caller's
+ * reference to it.  A small value is copied inline and the blob released.
+ */
+static VERSION *make_version(TRANSACTION *tp, BLOB *value) {
+    if(value == NULL || value->size > inline_max)
+	return version_create(tp, value);
+    VERSION *vp = inline_version_create(tp, value->content, value->size);
+    blob_unref(value, "copied into inline version");
+    return vp;
+}
+
+/*
+ * Create a version for tp with the same value as an existing one.
+ */
+static VERSION *copy_version(TRANSACTION *tp, VERSION *vp) {
+    if(vp != NULL && IS_INLINE(vp)) {
+	INLINE_VERSION *ivp = (INLINE_VERSION *)vp;
+	return inline_version_create(tp, ivp->data, ivp->size);
+    }
+    BLOB *bp = vp != NULL ? vp->blob : NULL;
+    if(bp != NULL)
+	blob_ref(bp, "for version created by get");
+    return version_create(tp, bp);
+}
+
+/*
+ * Get a reference to the value of a version, or NULL if it has none.
+ */
+static BLOB *version_value(VERSION *vp, char *why) {
+    if(IS_INLINE(vp)) {
+	INLINE_VERSION *ivp = (INLINE_VERSION *)vp;
+	return blob_create(ivp->data, ivp->size);
+    }
+    return vp->blob != NULL ? blob_ref(vp->blob, why) : NULL;
+}
+
+static void dispose_version(VERSION *vp) {
+    if(IS_INLINE(vp)) {
+	trans_unref(vp->creator, "for inline version");
+	free(vp);
+    } else {
+	version_dispose(vp);
+    }
+}
+
+static void retire_version(VERSION *vp) {
+    epoch_retire(vp, (void (*)(void *))dispose_version);
+}
+
+static void free_map_entry(void *arg) {
+    MAP_ENTRY *ep = arg;
+    VERSION *vp = ep->versions;
+    while(vp != NULL) {
+	VERSION *next = vp->next;
+	dispose_version(vp);
+	vp = next;
+    }
+    key_dispose(ep->key);
+    free(ep);
+}
+
+static STORE_STRIPE *stripe_for(int hash) {
+    return &stripes[(unsigned int)hash & (num_stripes - 1)];
+}
+
+static void lock_all_stripes(void) {
+    for(int i = 0; i < num_stripes; i++)
+	pthread_mutex_lock(&stripes[i].mutex);
+}
+
+static void unlock_all_stripes(void) {
+    for(int i = num_stripes - 1; i >= 0; i--)
+	pthread_mutex_unlock(&stripes[i].mutex);
+}
+
+/*
+ * Move one bucket of the old table into the current table.
+ * Called with the stripe for that bucket locked.
+ */
+static void migrate_bucket(int i) {
+    MAP_ENTRY *ep = resize.old_table[i];
+    while(ep != NULL) {
+	MAP_ENTRY *next = ep->next;
+	int j = bucket_index(ep->key->hash, the_map.num_buckets);
+	__atomic_store_n(&ep->next, the_map.table[j], __ATOMIC_RELAXED);
+	__atomic_store_n(&the_map.table[j], ep, __ATOMIC_RELEASE);
+	ep = next;
+    }
+    __atomic_store_n(&resize.old_table[i], NULL, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&resize.rehash_remaining, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Migrate up to n of the old buckets that belong to a stripe.
+ * Called with that stripe locked.
+ */
+static void rehash_step(STORE_STRIPE *sp, int n) {
+    if(resize.old_table == NULL)
+	return;
+    int s = sp - stripes;
+    int per_stripe = resize.old_num_buckets / num_stripes;
+    if(sp->rehash_cursor == per_stripe)
+	return;
+    seq_begin(&sp->seq);
+    while(n-- > 0 && sp->rehash_cursor < per_stripe)
+	migrate_bucket(s + num_stripes * sp->rehash_cursor++);
+    seq_end(&sp->seq);
+}
+
+/*
+ * Move everything still in the old table and free it.
+ * Called with every stripe locked.
+ */
+static void finish_rehash(void) {
+    if(resize.old_table == NULL)
+	return;
+    for(int i = 0; i < num_stripes; i++)
+	rehash_step(&stripes[i], resize.old_num_buckets);
+    debug("Rehash from %d to %d buckets complete",
+	  resize.old_num_buckets, the_map.num_buckets);
+    seq_begin(&map_seq);
+    epoch_retire(resize.old_table, free);
+    __atomic_store_n(&resize.old_table, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&resize.old_num_buckets, 0, __ATOMIC_RELAXED);
+    seq_end(&map_seq);
+}
+
+/*
+ * Start a resize to a new bucket count.  Only the table swap happens here;
+ * entries move over in rehash_step().  Called with every stripe locked.
+ */
+static void start_resize(int nbuckets) {
+    finish_rehash();
+    debug("Resizing map from %d to %d buckets (%d entries)",
+	  the_map.num_buckets, nbuckets, resize.num_entries);
+    MAP_ENTRY **table = Calloc(nbuckets, sizeof(MAP_ENTRY *));
+    resize.rehash_remaining = the_map.num_buckets;
+    for(int i = 0; i < num_stripes; i++)
+	stripes[i].rehash_cursor = 0;
+    seq_begin(&map_seq);
+    __atomic_store_n(&resize.old_table, the_map.table, __ATOMIC_RELAXED);
+    __atomic_store_n(&resize.old_num_buckets, the_map.num_buckets, __ATOMIC_RELAXED);
+    __atomic_store_n(&the_map.table, table, __ATOMIC_RELAXED);
+    __atomic_store_n(&the_map.num_buckets, nbuckets, __ATOMIC_RELAXED);
+    seq_end(&map_seq);
+    __atomic_add_fetch(&resize.resizes, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Work out what size the table should be under the load-factor policy.
+ */
+static int wanted_buckets(void) {
+    int nb = the_map.num_buckets;
+    int n = __atomic_load_n(&resize.num_entries, __ATOMIC_RELAXED);
+    if(n > nb * STORE_MAX_LOAD)
+	return nb * 2;
+    if(nb > resize.min_buckets && n * STORE_MIN_LOAD_INV < nb)
+	return nb / 2;
+    return nb;
+}
+
+/*
+ * Apply the load-factor policy, and free the old table once a rehash
+ * has drained it.  Called after an operation has released its stripe,
+ * since it may need to take all of them; the_map.mutex keeps concurrent
+ * callers from queueing up on the stripes behind each other.
+ * The first test is an unlocked hint and is repeated with the stripes held.
+ */
+static void check_load(void) {
+    if(store_index == STORE_INDEX_FLAT)
+	return;
+    if(wanted_buckets() == the_map.num_buckets
+       && (resize.old_table == NULL
+	   || __atomic_load_n(&resize.rehash_remaining, __ATOMIC_RELAXED) > 0))
+	return;
+    if(pthread_mutex_trylock(&the_map.mutex))
+	return;
+    lock_all_stripes();
+    int nb = wanted_buckets();
+    if(nb != the_map.num_buckets)
+	start_resize(nb);
+    else if(resize.old_table != NULL && resize.rehash_remaining == 0)
+	finish_rehash();
+    unlock_all_stripes();
+    pthread_mutex_unlock(&the_map.mutex);
+}
+
+static MAP_ENTRY *new_map_entry(KEY *key, MAP_ENTRY *next) {
+    MAP_ENTRY *ep = Malloc(sizeof(MAP_ENTRY));
+    ep->key = key;
+    ep->versions = NULL;
+    ep->next = next;
+    __atomic_add_fetch(&resize.num_entries, 1, __ATOMIC_RELAXED);
+    return ep;
+}
+
+/*
+ * Replace the flat table of a stripe with one of a different size, or
+ * just without deleted slots.  Called with the stripe locked.
+ */
+static void replace_flat(STORE_STRIPE *sp, int num_groups) {
+    FLAT_TABLE *old = sp->flat;
+    __atomic_store_n(&sp->flat, flat_rebuild(old, num_groups), __ATOMIC_RELEASE);
+    epoch_retire(old, (void (*)(void *))flat_free);
+    __atomic_add_fetch(&resize.resizes, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Find the map entry for a key, looking in the old table as well if
+ * a rehash is in progress.  Called with the stripe for the key locked.
+ */
+static MAP_ENTRY *find_map_entry(STORE_STRIPE *sp, KEY *key) {
+    MAP_ENTRY *ep;
+    if(store_index == STORE_INDEX_FLAT)
+	return flat_find(sp->flat, key);
+    if(resize.old_table != NULL) {
+	int i = bucket_index(key->hash, resize.old_num_buckets);
+	for(ep = resize.old_table[i]; ep != NULL; ep = ep->next) {
+	    if(ep->key->hash == key->hash && !key_compare(ep->key, key))
+		return ep;
+	}
+    }
+    int i = bucket_index(key->hash, the_map.num_buckets);
+    for(ep = the_map.table[i]; ep != NULL; ep = ep->next) {
+	if(ep->key->hash == key->hash && !key_compare(ep->key, key))
+	    return ep;
+    }
+    return NULL;
+}
+
+/*
+ * Make a new map entry for a key that is not in the map, and add it to the
+ * current table and the ordered index.  The entry inherits the key.
+ * Called with the stripe for the key locked.
+ */
+static MAP_ENTRY *add_map_entry(STORE_STRIPE *sp, KEY *key) {
+    MAP_ENTRY *ep;
+    if(store_index == STORE_INDEX_FLAT) {
+	if(flat_needs_rebuild(sp->flat, 1, flat_min_groups))
+	    replace_flat(sp, flat_wanted_groups(sp->flat, 1, flat_min_groups));
+	ep = new_map_entry(key, NULL);
+	flat_insert(sp->flat, ep);
+    } else {
+	int i = bucket_index(key->hash, the_map.num_buckets);
+	ep = new_map_entry(key, the_map.table[i]);
+	__atomic_store_n(&the_map.table[i], ep, __ATOMIC_RELEASE);
+    }
+    skiplist_insert(&ordered, ep);
+    return ep;
+}
+
+/*
+ * Remove a map entry that has been unlinked from the table from the ordered
+ * index too, and arrange for it to be freed.
+ */
+static void retire_map_entry(MAP_ENTRY *ep) {
+    skiplist_remove(&ordered, ep);
+    __atomic_sub_fetch(&resize.num_entries, 1, __ATOMIC_RELAXED);
+    epoch_retire(ep, free_map_entry);
+}
+
+static int in_range(BLOB *bp, BLOB *lo, BLOB *hi) {
+    return (lo == NULL || skiplist_compare(bp, lo) >= 0)
+	&& (hi == NULL || skiplist_compare(bp, hi) < 0);
+}
+
+static void free_scan_range(SCAN_RANGE *rp) {
+    trans_unref(rp->tp, "for scan range discarded");
+    if(rp->lo != NULL)
+	blob_unref(rp->lo, "for scan range discarded");
+    if(rp->hi != NULL)
+	blob_unref(rp->hi, "for scan range discarded");
+    if(rp->wide != NULL)
+	blob_unref(rp->wide, "for scan range discarded");
+    free(rp);
+    __atomic_sub_fetch(&num_scan_ranges, 1, __ATOMIC_RELAXED);
+}
+
+static void unlink_scan_range(SCAN_RANGE *rp) {
+    if(__atomic_sub_fetch(&rp->links, 1, __ATOMIC_ACQ_REL) == 0)
+	free_scan_range(rp);
+}
+
+/*
+ * Drop the records on a stripe's list that can no longer matter, given
+ * an ID no younger than the oldest pending transaction.
+ * Called with the stripe locked.
+ */
+static void prune_scans(STORE_STRIPE *sp, unsigned int oldest) {
+    int s = sp - stripes;
+    SCAN_RANGE **rpp = &sp->scans;
+    while(*rpp != NULL) {
+	SCAN_RANGE *rp = *rpp;
+	TRANS_STATUS st = trans_get_status(rp->tp);
+	if(st == TRANS_ABORTED || (st == TRANS_COMMITTED && rp->tp->id < oldest)) {
+	    *rpp = rp->next[s];
+	    unlink_scan_range(rp);
+	    continue;
+	}
+	rpp = &rp->next[s];
+    }
+}
+
+/*
+ * Determine whether a key that has just been added to the map falls in
+ * the range of a scan by a transaction younger than tp, in which case tp
+ * may not proceed.  Records that can no longer matter are discarded,
+ * going by the horizon, which needs no lock to read.
+ * Called with the stripe for the key locked.
+ */
+static int scan_conflict(STORE_STRIPE *sp, TRANSACTION *tp, KEY *key) {
+    if(sp->scans == NULL)
+	return 0;
+    prune_scans(sp, trans_horizon());
+    int s = sp - stripes;
+    for(SCAN_RANGE *rp = sp->scans; rp != NULL; rp = rp->next[s]) {
+	BLOB *hi = __atomic_load_n(&rp->hi, __ATOMIC_ACQUIRE);
+	if(rp->tp->id > tp->id && in_range(key->blob, rp->lo, hi)) {
+	    debug("Transaction %d conflicts with scan by %d", tp->id, rp->tp->id);
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Drop the scan records that can no longer matter from every stripe.
+ */
+static void prune_all_scans(void) {
+    unsigned int oldest = trans_oldest_pending();
+    for(int i = 0; i < num_stripes; i++) {
+	pthread_mutex_lock(&stripes[i].mutex);
+	prune_scans(&stripes[i], oldest);
+	pthread_mutex_unlock(&stripes[i].mutex);
+    }
+}
+
+/*
+ * Garbage-collect the version list of a map entry: remove any aborted
+ * version together with all versions after it, aborting their creators,
+ * then, if full is nonzero, remove the committed versions that have been
+ * superseded as far as any snapshot can tell: those followed by a committed
+ * version whose creator is below the horizon (see trans_horizon()).
+ * Leaving superseded committed versions in place changes nothing that an
+ * operation can observe, but an aborted version must always go, because
+ * nothing may follow it.  Returns the number of versions removed.
+ */
+static int garbage_collect(MAP_ENTRY *ep, int full) {
+    int n = 0;
+    VERSION *vp;
+    for(vp = ep->versions; vp != NULL; vp = vp->next) {
+	if(trans_get_status(vp->creator) == TRANS_ABORTED)
+	    break;
+    }
+    if(vp != NULL) {
+	if(vp->prev != NULL)
+	    __atomic_store_n(&vp->prev->next, NULL, __ATOMIC_RELEASE);
+	else
+	    __atomic_store_n(&ep->versions, NULL, __ATOMIC_RELEASE);
+	while(vp != NULL) {
+	    VERSION *next = vp->next;
+	    trans_abort(trans_ref(vp->creator, "to abort creator of discarded version"));
+	    retire_version(vp);
+	    vp = next;
+	    n++;
+	}
+    }
+    if(!full)
+	return n;
+    unsigned int horizon = trans_horizon();
+    vp = ep->versions;
+    while(vp != NULL && vp->next != NULL && vp->next->creator->id < horizon
+	  && trans_get_status(vp->creator) == TRANS_COMMITTED
+	  && trans_get_status(vp->next->creator) == TRANS_COMMITTED) {
+	__atomic_store_n(&ep->versions, vp->next, __ATOMIC_RELEASE);
+	ep->versions->prev = NULL;
+	retire_version(vp);
+	vp = ep->versions;
+	n++;
+    }
+    return n;
+}
+
+/*
+ * Count the versions in a version list.
+ */
+static int count_versions(MAP_ENTRY *ep) {
+    int n = 0;
+    for(VERSION *vp = ep->versions; vp != NULL; vp = vp->next)
+	n++;
+    return n;
+}
+
+/*
+ * Determine whether a map entry can be removed from the map without any
+ * transaction being able to tell.  That is the case if it has no versions,
+ * or if its only version is a committed NULL value whose creator is below
+ * the horizon: no transaction that could still be refused access because
+ * of that version remains, every snapshot reads it as NULL, and to everyone
+ * else a missing entry reads the same as a deleted one.
+ */
+static int entry_is_dead(MAP_ENTRY *ep, unsigned int horizon) {
+    VERSION *vp = ep->versions;
+    if(vp == NULL)
+	return 1;
+    return vp->next == NULL && vp->blob == NULL && vp->creator->id < horizon
+	&& trans_get_status(vp->creator) == TRANS_COMMITTED;
+}
+
+/*
+ * Add a version created by tp to the end of a garbage-collected version list,
+ * or replace the last version if tp created it.  The creator becomes dependent
+ * on the creators of all pending versions ahead of the new one.
+ */
+static void add_version(MAP_ENTRY *ep, TRANSACTION *tp, VERSION *nvp) {
+    VERSION *last = NULL;
+    for(VERSION *vp = ep->versions; vp != NULL; vp = vp->next) {
+	last = vp;
+	if(vp->creator != tp && trans_get_status(vp->creator) == TRANS_PENDING)
+	    trans_add_dependency(tp, vp->creator);
+    }
+    if(last != NULL && last->creator == tp) {
+	nvp->prev = last->prev;
+	if(last->prev != NULL)
+	    __atomic_store_n(&last->prev->next, nvp, __ATOMIC_RELEASE);
+	else
+	    __atomic_store_n(&ep->versions, nvp, __ATOMIC_RELEASE);
+	retire_version(last);
+    } else {
+	nvp->prev = last;
+	if(last != NULL)
+	    __atomic_store_n(&last->next, nvp, __ATOMIC_RELEASE);
+	else
+	    __atomic_store_n(&ep->versions, nvp, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Get the last version in a version list, or NULL if the list is empty.
+ */
+static VERSION *last_version(MAP_ENTRY *ep) {
+    VERSION *vp = ep->versions;
+    while(vp != NULL && vp->next != NULL)
+	vp = vp->next;
+    return vp;
+}
+
+/*
+ * Common prologue for GET and PUT: advance any rehash, find (or create)
+ * the map entry and garbage-collect it, fully only if its version list has
+ * grown past STORE_GC_THRESHOLD.  Returns NULL, having aborted tp,
+ * if tp is not permitted to operate on the entry.  Called with the stripe
+ * for the key locked.
+ */
+static MAP_ENTRY *prepare_entry(STORE_STRIPE *sp, TRANSACTION *tp, KEY *key) {
+    rehash_step(sp, STORE_REHASH_STEP);
+    MAP_ENTRY *ep = find_map_entry(sp, key);
+    if(ep == NULL) {
+	// The entry has to be in the ordered index before the check,
+	// so that any scan that misses the check will see it.
+	ep = add_map_entry(sp, key);
+	if(scan_conflict(sp, tp, key)) {
+	    trans_abort(trans_ref(tp, "to abort for conflicting scan"));
+	    return NULL;
+	}
+    } else if(ep->key != key) {
+	key_dispose(key);
+    }
+    garbage_collect(ep, count_versions(ep) > STORE_GC_THRESHOLD);
+    VERSION *last = last_version(ep);
+    if(last != NULL && last->creator->id > tp->id) {
+	debug("Transaction %d conflicts with version by %d", tp->id, last->creator->id);
+	trans_abort(trans_ref(tp, "to abort for conflicting access"));
+	return NULL;
+    }
+    return ep;
+}
+
+void store_init_index(STORE_INDEX index, int nbuckets) {
+    if(nbuckets < 1)
+	nbuckets = NUM_BUCKETS;
+    nbuckets = round_up_pow2(nbuckets);
+    store_index = index;
+    pthread_mutex_init(&the_map.mutex, NULL);
+    memset(&resize, 0, sizeof(resize));
+    if(index == STORE_INDEX_FLAT) {
+	int ngroups = nbuckets > FLAT_GROUP_SIZE ? nbuckets / FLAT_GROUP_SIZE : 1;
+	num_stripes = ngroups < STORE_STRIPES ? ngroups : STORE_STRIPES;
+	flat_min_groups = ngroups / num_stripes;
+	the_map.table = NULL;
+	the_map.num_buckets = 0;
+    } else {
+	num_stripes = nbuckets < STORE_STRIPES ? nbuckets : STORE_STRIPES;
+	the_map.table = Calloc(nbuckets, sizeof(MAP_ENTRY *));
+	the_map.num_buckets = nbuckets;
+	resize.min_buckets = nbuckets;
+    }
+    if(posix_memalign((void **)&stripes, sizeof(STORE_STRIPE),
+		      num_stripes * sizeof(STORE_STRIPE)))
+	unix_error("posix_memalign error");
+    for(int i = 0; i < num_stripes; i++) {
+	pthread_mutex_init(&stripes[i].mutex, NULL);
+	stripes[i].rehash_cursor = 0;
+	stripes[i].seq = 0;
+	stripes[i].flat = index == STORE_INDEX_FLAT ? flat_create(flat_min_groups) : NULL;
+	stripes[i].scans = NULL;
+    }
+    skiplist_init(&ordered);
+    memset(&gc.stats, 0, sizeof(gc.stats));
+    gc.stripe = gc.group = 0;
+    debug("Initialize store with %s index of %d buckets, %d lock stripes",
+	  index == STORE_INDEX_FLAT ? "flat" : "chained", nbuckets, num_stripes);
+}
+
+void store_init_buckets(int nbuckets) {
+    store_init_index(STORE_INDEX_CHAINED, nbuckets);
+}
+
+void store_init(void) {
+    store_init_buckets(NUM_BUCKETS);
+}
+
+static void free_bucket(MAP_ENTRY *ep) {
+    while(ep != NULL) {
+	MAP_ENTRY *next = ep->next;
+	free_map_entry(ep);
+	ep = next;
+    }
+}
+
+void store_fini(void) {
+    debug("Finalize store");
+    store_gc_stop();
+    if(resize.old_table != NULL) {
+	for(int i = 0; i < resize.old_num_buckets; i++)
+	    free_bucket(resize.old_table[i]);
+	free(resize.old_table);
+	resize.old_table = NULL;
+    }
+    for(int i = 0; i < the_map.num_buckets; i++)
+	free_bucket(the_map.table[i]);
+    free(the_map.table);
+    the_map.table = NULL;
+    the_map.num_buckets = 0;
+    for(int i = 0; i < num_stripes; i++) {
+	FLAT_TABLE *ft = stripes[i].flat;
+	if(ft != NULL) {
+	    for(int j = 0; j < ft->num_groups * FLAT_GROUP_SIZE; j++) {
+		if(ft->ctrl[j] >= 0)
+		    free_map_entry(ft->slots[j].entry);
+	    }
+	    flat_free(ft);
+	}
+	while(stripes[i].scans != NULL) {
+	    SCAN_RANGE *rp = stripes[i].scans;
+	    stripes[i].scans = rp->next[i];
+	    unlink_scan_range(rp);
+	}
+	pthread_mutex_destroy(&stripes[i].mutex);
+    }
+    free(stripes);
+    stripes = NULL;
+    num_stripes = 0;
+    skiplist_fini(&ordered);
+    pthread_mutex_destroy(&the_map.mutex);
+    epoch_fini();
+}
+
+/*
+ * Put a value for a key, with the stripe for the key locked.
+ * Returns nonzero if the transaction aborted.
+ */
+static int put_locked(STORE_STRIPE *sp, TRANSACTION *tp, KEY *key, BLOB *value) {
+    MAP_ENTRY *ep = prepare_entry(sp, tp, key);
+    if(ep == NULL) {
+	blob_unref(value, "discarded by aborted put");
+	return -1;
+    }
+    wal_note_put(tp, ep->key, value);
+    add_version(ep, tp, make_version(tp, value));
+    return 0;
+}
+
+/*
+ * Get the value for a key, with the stripe for the key locked.
+ * Returns nonzero if the transaction aborted.
+ */
+static int get_locked(STORE_STRIPE *sp, TRANSACTION *tp, KEY *key, BLOB **valuep) {
+    MAP_ENTRY *ep = prepare_entry(sp, tp, key);
+    if(ep == NULL)
+	return -1;
+    VERSION *last = last_version(ep);
+    if(last == NULL || last->creator != tp)
+	add_version(ep, tp, copy_version(tp, last));
+    if(last != NULL)
+	*valuep = version_value(last, "returned from store_get");
+    return 0;
+}
+
+/*
+ * Parse a value as a signed decimal number, as ADD does.
+ * Returns 0 if successful, -1 if the value is not such a number.
+ */
+static int parse_number(BLOB *bp, long *np) {
+    char buf[24];
+    if(bp->size == 0 || bp->size >= sizeof(buf))
+	return -1;
+    memcpy(buf, bp->content, bp->size);
+    buf[bp->size] = '\0';
+    char *end;
+    errno = 0;
+    *np = strtol(buf, &end, 10);
+    if(errno != 0 || end != buf + bp->size || !(buf[0] == '-' || (buf[0] >= '0' && buf[0] <= '9')))
+	return -1;
+    return 0;
+}
+
+/*
+ * Add to the value of a key, with the stripe for the key locked.
+ * Returns nonzero if the transaction aborted.
+ */
+static int add_locked(STORE_STRIPE *sp, TRANSACTION *tp, KEY *key, long delta, BLOB **valuep) {
+    MAP_ENTRY *ep = prepare_entry(sp, tp, key);
+    if(ep == NULL)
+	return -1;
+    VERSION *last = last_version(ep);
+    BLOB *old = last != NULL ? version_value(last, "for value read by add") : NULL;
+    long n = 0;
+    int bad = old != NULL && parse_number(old, &n) == -1;
+    if(old != NULL)
+	blob_unref(old, "for value read by add");
+    if(bad || __builtin_add_overflow(n, delta, &n)) {
+	// Leave the value alone, but the key has still been read.
+	if(last == NULL || last->creator != tp)
+	    add_version(ep, tp, copy_version(tp, last));
+	return 0;
+    }
+    char buf[24];
+    BLOB *value = blob_create(buf, snprintf(buf, sizeof(buf), "%ld", n));
+    wal_note_put(tp, ep->key, value);
+    add_version(ep, tp, make_version(tp, blob_ref(value, "for version created by add")));
+    *valuep = value;
+    return 0;
+}
+
+TRANS_STATUS store_add(TRANSACTION *tp, KEY *key, long delta, BLOB **valuep) {
+    debug("Add %ld to value of key=%p in store for transaction %d", delta, key, tp->id);
+    *valuep = NULL;
+    if(trans_get_status(tp) == TRANS_ABORTED) {
+	key_dispose(key);
+	return TRANS_ABORTED;
+    }
+    STORE_STRIPE *sp = stripe_for(key->hash);
+    pthread_mutex_lock(&sp->mutex);
+    int aborted = add_locked(sp, tp, key, delta, valuep);
+    pthread_mutex_unlock(&sp->mutex);
+    if(aborted)
+	return TRANS_ABORTED;
+    check_load();
+    return trans_get_status(tp);
+}
+
+/*
+ * Compare and swap the value of a key, with the stripe for the key locked.
+ * Returns nonzero if the transaction aborted.
+ */
+static int cas_locked(STORE_STRIPE *sp, TRANSACTION *tp, KEY *key, BLOB *expected,
+		      BLOB *value, int *swappedp, BLOB **currentp) {
+    MAP_ENTRY *ep = prepare_entry(sp, tp, key);
+    if(ep == NULL) {
+	blob_unref(value, "discarded by aborted compare and swap");
+	return -1;
+    }
+    VERSION *last = last_version(ep);
+    BLOB *current = last != NULL ? version_value(last, "for value read by compare and swap") : NULL;
+    if(current == NULL ? expected == NULL : expected != NULL && !blob_compare(current, expected)) {
+	if(current != NULL)
+	    blob_unref(current, "for value read by compare and swap");
+	wal_note_put(tp, ep->key, value);
+	add_version(ep, tp, make_version(tp, value));
+	*swappedp = 1;
+    } else {
+	if(last == NULL || last->creator != tp)
+	    add_version(ep, tp, copy_version(tp, last));
+	blob_unref(value, "discarded by failed compare and swap");
+	*currentp = current;
+    }
+    return 0;
+}
+
+TRANS_STATUS store_cas(TRANSACTION *tp, KEY *key, BLOB *expected, BLOB *value,
+		       int *swappedp, BLOB **currentp) {
+    debug("Compare and swap (key=%p, expected=%p, value=%p) in store for transaction %d",
+	  key, expected, value, tp->id);
+    *swappedp = 0;
+    *currentp = NULL;
+    TRANS_STATUS status = TRANS_ABORTED;
+    if(trans_get_status(tp) == TRANS_ABORTED) {
+	key_dispose(key);
+	blob_unref(value, "discarded by compare and swap in aborted transaction");
+    } else {
+	STORE_STRIPE *sp = stripe_for(key->hash);
+	pthread_mutex_lock(&sp->mutex);
+	int aborted = cas_locked(sp, tp, key, expected, value, swappedp, currentp);
+	pthread_mutex_unlock(&sp->mutex);
+	if(!aborted) {
+	    check_load();
+	    status = trans_get_status(tp);
+	}
+    }
+    blob_unref(expected, "for expected value of compare and swap");
+    return status;
+}
+
+TRANS_STATUS store_put(TRANSACTION *tp, KEY *key, BLOB *value) {
+    debug("Put mapping (key=%p, value=%p) in store for transaction %d", key, value, tp->id);
+    if(trans_get_status(tp) == TRANS_ABORTED) {
+	key_dispose(key);
+	blob_unref(value, "discarded by put in aborted transaction");
+	return TRANS_ABORTED;
+    }
+    STORE_STRIPE *sp = stripe_for(key->hash);
+    pthread_mutex_lock(&sp->mutex);
+    int aborted = put_locked(sp, tp, key, value);
+    pthread_mutex_unlock(&sp->mutex);
+    if(aborted)
+	return TRANS_ABORTED;
+    check_load();
+    return trans_get_status(tp);
+}
+
+TRANS_STATUS store_get(TRANSACTION *tp, KEY *key, BLOB **valuep) {
+    debug("Get mapping of key=%p in store for transaction %d", key, tp->id);
+    *valuep = NULL;
+    if(trans_get_status(tp) == TRANS_ABORTED) {
+	key_dispose(key);
+	return TRANS_ABORTED;
+    }
+    STORE_STRIPE *sp = stripe_for(key->hash);
+    pthread_mutex_lock(&sp->mutex);
+    int aborted = get_locked(sp, tp, key, valuep);
+    pthread_mutex_unlock(&sp->mutex);
+    if(aborted)
+	return TRANS_ABORTED;
+    check_load();
+    return trans_get_status(tp);
+}
+
+/*
+ * Position of a key in a batch, for sorting the batch by lock stripe.
+ * Keys in the same stripe keep their order in the batch, so that
+ * repeated keys are accessed in the order given.
+ */
+typedef struct batch_slot {
+    int stripe;
+    int index;
+} BATCH_SLOT;
+
+static int compare_batch_slots(const void *a, const void *b) {
+    const BATCH_SLOT *s1 = a, *s2 = b;
+    if(s1->stripe != s2->stripe)
+	return s1->stripe - s2->stripe;
+    return s1->index - s2->index;
+}
+
+/*
+ * Common part of store_get_many() and store_put_many(): visit the keys in
+ * stripe order, locking each stripe once, and stop doing anything but
+ * disposing of arguments once the transaction has aborted.
+ */
+static TRANS_STATUS access_many(TRANSACTION *tp, int n, KEY **keys, BLOB **values,
+				TRANS_STATUS *statuses, int put) {
+    if(n == 0)
+	return trans_get_status(tp);
+    BATCH_SLOT *order = Malloc(n * sizeof(BATCH_SLOT));
+    for(int i = 0; i < n; i++) {
+	order[i].stripe = stripe_for(keys[i]->hash) - stripes;
+	order[i].index = i;
+	if(!put)
+	    values[i] = NULL;
+    }
+    qsort(order, n, sizeof(BATCH_SLOT), compare_batch_slots);
+    int aborted = trans_get_status(tp) == TRANS_ABORTED;
+    STORE_STRIPE *locked = NULL;
+    for(int j = 0; j < n; j++) {
+	int i = order[j].index;
+	STORE_STRIPE *sp = &stripes[order[j].stripe];
+	if(!aborted && sp != locked) {
+	    if(locked != NULL)
+		pthread_mutex_unlock(&locked->mutex);
+	    pthread_mutex_lock(&sp->mutex);
+	    locked = sp;
+	}
+	if(aborted) {
+	    key_dispose(keys[i]);
+	    if(put && values[i] != NULL)
+		blob_unref(values[i], "discarded by put in aborted transaction");
+	} else if(put) {
+	    aborted = put_locked(sp, tp, keys[i], values[i]);
+	} else {
+	    aborted = get_locked(sp, tp, keys[i], &values[i]);
+	}
+	if(statuses != NULL)
+	    statuses[i] = aborted ? TRANS_ABORTED : TRANS_PENDING;
+    }
+    if(locked != NULL)
+	pthread_mutex_unlock(&locked->mutex);
+    free(order);
+    if(aborted)
+	return TRANS_ABORTED;
+    check_load();
+    return trans_get_status(tp);
+}
+
+TRANS_STATUS store_get_many(TRANSACTION *tp, int n, KEY **keys, BLOB **values,
+			    TRANS_STATUS *statuses) {
+    debug("Get mappings of %d keys in store for transaction %d", n, tp->id);
+    return access_many(tp, n, keys, values, statuses, 0);
+}
+
+TRANS_STATUS store_put_many(TRANSACTION *tp, int n, KEY **keys, BLOB **values,
+			    TRANS_STATUS *statuses) {
+    debug("Put mappings of %d keys in store for transaction %d", n, tp->id);
+    return access_many(tp, n, keys, values, statuses, 1);
+}
+
+/*
+ * Make a blob for the key immediately after a given one in index order,
+ * which is the same key with a zero byte appended.
+ */
+static BLOB *key_successor(BLOB *bp) {
+    char *content = Malloc(bp->size + 1);
+    memcpy(content, bp->content, bp->size);
+    content[bp->size] = '\0';
+    BLOB *sbp = blob_create(content, bp->size + 1);
+    free(content);
+    return sbp;
+}
+
+TRANS_STATUS store_scan(TRANSACTION *tp, KEY *lo, KEY *hi, int limit,
+			int (*fn)(BLOB *key, BLOB *value, void *arg), void *arg) {
+    debug("Scan keys from %p to %p (limit %d) for transaction %d", lo, hi, limit, tp->id);
+    SCAN_RANGE *rp = Malloc(sizeof(SCAN_RANGE) + num_stripes * sizeof(SCAN_RANGE *));
+    rp->tp = trans_ref(tp, "for scan range");
+    rp->wide = NULL;
+    __atomic_add_fetch(&num_scan_ranges, 1, __ATOMIC_RELAXED);
+    rp->lo = lo != NULL ? blob_ref(lo->blob, "for scan range") : NULL;
+    rp->hi = hi != NULL ? blob_ref(hi->blob, "for scan range") : NULL;
+    if(lo != NULL)
+	key_dispose(lo);
+    if(hi != NULL)
+	key_dispose(hi);
+    if(trans_get_status(tp) == TRANS_ABORTED) {
+	free_scan_range(rp);
+	return TRANS_ABORTED;
+    }
+    // The range must be recorded before the index is read; see prepare_entry().
+    rp->links = num_stripes + 1;
+    unsigned int oldest = trans_oldest_pending();
+    for(int i = 0; i < num_stripes; i++) {
+	pthread_mutex_lock(&stripes[i].mutex);
+	prune_scans(&stripes[i], oldest);
+	rp->next[i] = stripes[i].scans;
+	stripes[i].scans = rp;
+	pthread_mutex_unlock(&stripes[i].mutex);
+    }
+
+    BLOB *keys[STORE_SCAN_BATCH];
+    BLOB *from = rp->lo != NULL ? blob_ref(rp->lo, "for scan position") : NULL;
+    int after = 0, count = 0, stop = 0, n;
+    TRANS_STATUS status = TRANS_PENDING;
+    while(!stop && (n = skiplist_range(&ordered, from, after, rp->hi, keys, STORE_SCAN_BATCH)) > 0) {
+	for(int i = 0; i < n; i++) {
+	    if(stop || status == TRANS_ABORTED) {
+		blob_unref(keys[i], "for key skipped by scan");
+		continue;
+	    }
+	    BLOB *value;
+	    status = store_get(tp, key_create(blob_ref(keys[i], "for key read by scan")), &value);
+	    if(status == TRANS_ABORTED) {
+		blob_unref(keys[i], "for key read by aborted scan");
+		continue;
+	    }
+	    if(value != NULL) {
+		if(fn != NULL && fn(keys[i], value, arg))
+		    stop = 1;
+		blob_unref(value, "for value passed to scan function");
+		if(limit > 0 && ++count == limit)
+		    stop = 1;
+		if(stop) {
+		    // Keys after this one have not been read, so stop protecting them.
+		    rp->wide = rp->hi;
+		    __atomic_store_n(&rp->hi, key_successor(keys[i]), __ATOMIC_RELEASE);
+		}
+	    }
+	    if(from != NULL)
+		blob_unref(from, "for scan position");
+	    from = blob_ref(keys[i], "for scan position");
+	    after = 1;
+	    blob_unref(keys[i], "for key read by scan");
+	}
+	if(status == TRANS_ABORTED)
+	    stop = 1;
+    }
+    if(from != NULL)
+	blob_unref(from, "for scan position");
+    unlink_scan_range(rp);
+    return trans_get_status(tp);
+}
+
+/*
+ * The tables as seen by a lock-free reader, together with the value of
+ * map_seq at which they were read.
+ */
+typedef struct table_view {
+    MAP_ENTRY **table;
+    int num_buckets;
+    MAP_ENTRY **old_table;
+    int old_num_buckets;
+    unsigned int seq;
+} TABLE_VIEW;
+
+static void read_tables(TABLE_VIEW *vp) {
+    do {
+	while((vp->seq = __atomic_load_n(&map_seq, __ATOMIC_ACQUIRE)) & 1)
+	    ;
+	vp->table = __atomic_load_n(&the_map.table, __ATOMIC_RELAXED);
+	vp->num_buckets = __atomic_load_n(&the_map.num_buckets, __ATOMIC_RELAXED);
+	vp->old_table = __atomic_load_n(&resize.old_table, __ATOMIC_RELAXED);
+	vp->old_num_buckets = __atomic_load_n(&resize.old_num_buckets, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while(__atomic_load_n(&map_seq, __ATOMIC_RELAXED) != vp->seq);
+}
+
+static MAP_ENTRY *search_chain(MAP_ENTRY **bucketp, KEY *key) {
+    for(MAP_ENTRY *ep = __atomic_load_n(bucketp, __ATOMIC_ACQUIRE); ep != NULL;
+	ep = __atomic_load_n(&ep->next, __ATOMIC_ACQUIRE)) {
+	if(ep->key->hash == key->hash && !key_compare(ep->key, key))
+	    return ep;
+    }
+    return NULL;
+}
+
+/*
+ * Find the map entry for a key without taking any locks.  Called inside an
+ * epoch critical section.  A migration can move an entry out from under a
+ * reader walking the old table, so a miss only counts if neither the tables
+ * nor the stripe's buckets changed during the search.
+ */
+static MAP_ENTRY *find_map_entry_lockfree(KEY *key) {
+    STORE_STRIPE *sp = stripe_for(key->hash);
+    if(store_index == STORE_INDEX_FLAT)
+	return flat_find(__atomic_load_n(&sp->flat, __ATOMIC_ACQUIRE), key);
+    for(;;) {
+	TABLE_VIEW view;
+	read_tables(&view);
+	unsigned int s = __atomic_load_n(&sp->seq, __ATOMIC_ACQUIRE);
+	if(s & 1)
+	    continue;
+	MAP_ENTRY *ep = NULL;
+	if(view.old_table != NULL)
+	    ep = search_chain(&view.old_table[bucket_index(key->hash, view.old_num_buckets)], key);
+	if(ep == NULL)
+	    ep = search_chain(&view.table[bucket_index(key->hash, view.num_buckets)], key);
+	if(ep != NULL)
+	    return ep;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&map_seq, __ATOMIC_RELAXED) == view.seq
+	   && __atomic_load_n(&sp->seq, __ATOMIC_RELAXED) == s)
+	    return NULL;
+    }
+}
+
+/*
+ * Find, without locking, the value of the last committed version of a key
+ * whose creator ID is less than a given one, and return a reference to it.
+ */
+static BLOB *read_committed(KEY *key, unsigned int below, char *why) {
+    BLOB *bp = NULL;
+    epoch_enter();
+    MAP_ENTRY *ep = find_map_entry_lockfree(key);
+    if(ep != NULL) {
+	// Committed versions come first, so the current value is the
+	// last version before the first one that has not committed.
+	// When reading as of a snapshot, aborted versions below the snapshot
+	// may not have been collected yet, and are skipped, but everything
+	// from the snapshot's ID on is invisible.
+	VERSION *found = NULL;
+	for(VERSION *vp = __atomic_load_n(&ep->versions, __ATOMIC_ACQUIRE); vp != NULL;
+	    vp = __atomic_load_n(&vp->next, __ATOMIC_ACQUIRE)) {
+	    if(vp->creator->id >= below)
+		break;
+	    TRANS_STATUS status = __atomic_load_n(&vp->creator->status, __ATOMIC_ACQUIRE);
+	    if(status == TRANS_COMMITTED)
+		found = vp;
+	    else if(status == TRANS_PENDING)
+		break;
+	}
+	if(found != NULL)
+	    bp = version_value(found, why);
+    }
+    epoch_exit();
+    key_dispose(key);
+    return bp;
+}
+
+BLOB *store_get_committed(KEY *key) {
+    return read_committed(key, UINT_MAX, "returned from store_get_committed");
+}
+
+BLOB *store_get_snapshot(TRANS_SNAPSHOT *ssp, KEY *key) {
+    debug("Get key %p as of snapshot %d", key, ssp->id);
+    return read_committed(key, ssp->id, "returned from store_get_snapshot");
+}
+
+/*
+ * Visit the keys in a range with the values read_committed() finds for them.
+ */
+static void scan_committed(unsigned int below, KEY *lo, KEY *hi, int limit,
+			   int (*fn)(BLOB *key, BLOB *value, void *arg), void *arg) {
+    BLOB *from = lo != NULL ? blob_ref(lo->blob, "for scan position") : NULL;
+    BLOB *to = hi != NULL ? blob_ref(hi->blob, "for scan bound") : NULL;
+    if(lo != NULL)
+	key_dispose(lo);
+    if(hi != NULL)
+	key_dispose(hi);
+    BLOB *keys[STORE_SCAN_BATCH];
+    int after = 0, count = 0, stop = 0, n;
+    while(!stop && (n = skiplist_range(&ordered, from, after, to, keys, STORE_SCAN_BATCH)) > 0) {
+	for(int i = 0; i < n; i++) {
+	    if(!stop) {
+		BLOB *value = read_committed(key_create(blob_ref(keys[i], "for key read by scan")),
+					     below, "for value passed to scan function");
+		if(value != NULL) {
+		    if((fn != NULL && fn(keys[i], value, arg))
+		       || (limit > 0 && ++count == limit))
+			stop = 1;
+		    blob_unref(value, "for value passed to scan function");
+		}
+	    }
+	    if(i < n - 1)
+		blob_unref(keys[i], "for key read by scan");
+	}
+	if(from != NULL)
+	    blob_unref(from, "for scan position");
+	from = keys[n - 1];
+	after = 1;
+    }
+    if(from != NULL)
+	blob_unref(from, "for scan position");
+    if(to != NULL)
+	blob_unref(to, "for scan bound");
+}
+
+void store_scan_snapshot(TRANS_SNAPSHOT *ssp, KEY *lo, KEY *hi, int limit,
+			 int (*fn)(BLOB *key, BLOB *value, void *arg), void *arg) {
+    debug("Scan keys from %p to %p (limit %d) as of snapshot %d", lo, hi, limit, ssp->id);
+    scan_committed(ssp->id, lo, hi, limit, fn, arg);
+}
+
+void store_scan_committed(KEY *lo, KEY *hi, int limit,
+			  int (*fn)(BLOB *key, BLOB *value, void *arg), void *arg) {
+    debug("Scan committed keys from %p to %p (limit %d)", lo, hi, limit);
+    scan_committed(UINT_MAX, lo, hi, limit, fn, arg);
+}
+
+/*
+ * Fully garbage-collect every entry in a bucket of the current table,
+ * unlinking and retiring entries that are dead.  Called with the stripe
+ * for the bucket locked.
+ */
+static void sweep_bucket(MAP_ENTRY **bucketp, unsigned int horizon) {
+    MAP_ENTRY *ep;
+    while((ep = *bucketp) != NULL) {
+	gc.stats.versions_reclaimed += garbage_collect(ep, 1);
+	if(entry_is_dead(ep, horizon)) {
+	    __atomic_store_n(bucketp, ep->next, __ATOMIC_RELEASE);
+	    retire_map_entry(ep);
+	    gc.stats.entries_reclaimed++;
+	} else {
+	    bucketp = &ep->next;
+	}
+    }
+}
+
+/*
+ * Sweep the bucket of the current table at the cursor.
+ * Returns nonzero if that completed a pass over the table.
+ */
+static int sweep_next_bucket(unsigned int horizon) {
+    int i = gc.stats.cursor;
+    STORE_STRIPE *sp = &stripes[i & (num_stripes - 1)];
+    pthread_mutex_lock(&sp->mutex);
+    // Sweeping cold stripes is a chance to move their rehash along too.
+    rehash_step(sp, STORE_REHASH_STEP);
+    int nb = the_map.num_buckets;
+    if(i < nb)
+	sweep_bucket(&the_map.table[i], horizon);
+    pthread_mutex_unlock(&sp->mutex);
+    return i + 1 >= nb;
+}
+
+/*
+ * Sweep the next group of slots in the flat tables, going through the
+ * stripes one at a time.  Once it has swept the last group of a stripe's
+ * table, this also shrinks it, or clears out deleted slots, if need be.
+ * Returns nonzero if that completed a pass over all the stripes.
+ */
+static int sweep_next_group(unsigned int horizon) {
+    STORE_STRIPE *sp = &stripes[gc.stripe];
+    pthread_mutex_lock(&sp->mutex);
+    FLAT_TABLE *ft = sp->flat;
+    if(gc.group < ft->num_groups) {
+	for(int i = gc.group * FLAT_GROUP_SIZE; i < (gc.group + 1) * FLAT_GROUP_SIZE; i++) {
+	    if(ft->ctrl[i] < 0)
+		continue;
+	    MAP_ENTRY *ep = ft->slots[i].entry;
+	    gc.stats.versions_reclaimed += garbage_collect(ep, 1);
+	    if(entry_is_dead(ep, horizon)) {
+		flat_erase(ft, i);
+		retire_map_entry(ep);
+		gc.stats.entries_reclaimed++;
+	    }
+	}
+    }
+    if(++gc.group >= ft->num_groups) {
+	if(flat_needs_rebuild(ft, 0, flat_min_groups))
+	    replace_flat(sp, flat_wanted_groups(ft, 0, flat_min_groups));
+	gc.group = 0;
+	gc.stripe++;
+    }
+    pthread_mutex_unlock(&sp->mutex);
+    if(gc.stripe < num_stripes)
+	return 0;
+    gc.stripe = 0;
+    return 1;
+}
+
+int store_gc_sweep(int nbuckets) {
+    pthread_mutex_lock(&gc.mutex);
+    prune_all_scans();
+    unsigned int horizon = trans_horizon();
+    int n;
+    for(n = 0; n < nbuckets; n++) {
+	int done = store_index == STORE_INDEX_FLAT
+	    ? sweep_next_group(horizon) : sweep_next_bucket(horizon);
+	gc.stats.buckets_swept++;
+	if(done) {
+	    gc.stats.cursor = 0;
+	    gc.stats.sweeps++;
+	} else {
+	    gc.stats.cursor++;
+	}
+    }
+    pthread_mutex_unlock(&gc.mutex);
+    check_load();
+    return n;
+}
+
+/*
+ * Body of the background collector: sweep a batch of buckets, then sleep
+ * for the interval or until told to stop.
+ */
+static void *gc_thread(void *arg) {
+    debug("Background garbage collector started");
+    pthread_mutex_lock(&gc.mutex);
+    while(!gc.stop) {
+	int batch = gc.batch;
+	pthread_mutex_unlock(&gc.mutex);
+	store_gc_sweep(batch);
+	pthread_mutex_lock(&gc.mutex);
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += gc.interval_ms / 1000;
+	ts.tv_nsec += (long)(gc.interval_ms % 1000) * 1000000;
+	if(ts.tv_nsec >= 1000000000) {
+	    ts.tv_sec++;
+	    ts.tv_nsec -= 1000000000;
+	}
+	while(!gc.stop && pthread_cond_timedwait(&gc.cond, &gc.mutex, &ts) == 0)
+	    ;
+    }
+    pthread_mutex_unlock(&gc.mutex);
+    debug("Background garbage collector stopped");
+    return NULL;
+}
+
+void store_gc_start(int batch, int interval_ms) {
+    pthread_mutex_lock(&gc.mutex);
+    if(gc.running) {
+	pthread_mutex_unlock(&gc.mutex);
+	return;
+    }
+    gc.batch = batch > 0 ? batch : STORE_GC_BATCH;
+    gc.interval_ms = interval_ms >= 0 ? interval_ms : STORE_GC_INTERVAL_MS;
+    gc.stop = 0;
+    gc.running = 1;
+    pthread_mutex_unlock(&gc.mutex);
+    debug("Start background garbage collector (%d buckets every %d ms)",
+	  gc.batch, gc.interval_ms);
+    Pthread_create(&gc.thread, NULL, gc_thread, NULL);
+}
+
+void store_gc_stop(void) {
+    pthread_mutex_lock(&gc.mutex);
+    if(!gc.running) {
+	pthread_mutex_unlock(&gc.mutex);
+	return;
+    }
+    gc.stop = 1;
+    pthread_cond_signal(&gc.cond);
+    pthread_mutex_unlock(&gc.mutex);
+    Pthread_join(gc.thread, NULL);
+    pthread_mutex_lock(&gc.mutex);
+    gc.running = 0;
+    pthread_mutex_unlock(&gc.mutex);
+}
+
+void store_gc_get_stats(STORE_GC_STATS *sp) {
+    pthread_mutex_lock(&gc.mutex);
+    *sp = gc.stats;
+    sp->running = gc.running;
+    sp->scan_ranges = __atomic_load_n(&num_scan_ranges, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&gc.mutex);
+}
+
+void store_rehash_finish(void) {
+    pthread_mutex_lock(&the_map.mutex);
+    lock_all_stripes();
+    finish_rehash();
+    unlock_all_stripes();
+    pthread_mutex_unlock(&the_map.mutex);
+}
+
+void store_get_stats(STORE_STATS *sp) {
+    pthread_mutex_lock(&the_map.mutex);
+    lock_all_stripes();
+    sp->index = store_index;
+    sp->num_entries = resize.num_entries;
+    sp->num_buckets = the_map.num_buckets;
+    for(int i = 0; i < num_stripes; i++) {
+	if(stripes[i].flat != NULL)
+	    sp->num_buckets += stripes[i].flat->num_groups * FLAT_GROUP_SIZE;
+    }
+    sp->old_num_buckets = resize.old_num_buckets;
+    sp->rehash_remaining = resize.old_table != NULL ? resize.rehash_remaining : 0;
+    sp->num_stripes = num_stripes;
+    sp->resizes = resize.resizes;
+    unlock_all_stripes();
+    pthread_mutex_unlock(&the_map.mutex);
+}
+
+static void show_bucket(MAP_ENTRY *ep) {
+    for(; ep != NULL; ep = ep->next) {
+	fprintf(stderr, "\t{key: %p [%s], versions: ", ep->key, blob_prefix(ep->key->blob));
+	for(VERSION *vp = ep->versions; vp != NULL; vp = vp->next) {
+	    fprintf(stderr, "{creator=%d (%s), blob=%p [%s]}", vp->creator->id,
+		    trans_status_names[vp->creator->status], vp->blob,
+		    IS_INLINE(vp) ? "inline" : vp->blob != NULL ? blob_prefix(vp->blob) : "NULL");
+	}
+	fprintf(stderr, "}\n");
+    }
+}
+
+void store_show(void) {
+    if(store_index == STORE_INDEX_FLAT) {
+	fprintf(stderr, "CONTENTS OF STORE (%d entries, %d stripes):\n",
+		resize.num_entries, num_stripes);
+	for(int i = 0; i < num_stripes; i++) {
+	    FLAT_TABLE *ft = stripes[i].flat;
+	    for(int j = 0; j < ft->num_groups * FLAT_GROUP_SIZE; j++) {
+		if(ft->ctrl[j] >= 0)
+		    show_bucket(ft->slots[j].entry);
+	    }
+	}
+	return;
+    }
+    fprintf(stderr, "CONTENTS OF STORE (%d entries, %d buckets):\n",
+	    resize.num_entries, the_map.num_buckets);
+    for(int i = 0; i < the_map.num_buckets; i++)
+	show_bucket(the_map.table[i]);
+    if(resize.old_table != NULL) {
+	fprintf(stderr, "(rehashing from %d buckets)\n", resize.old_num_buckets);
+	for(int i = 0; i < resize.old_num_buckets; i++)
+	    show_bucket(resize.old_table[i]);
+    }
+}
@@ -0,0 +1,448 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+
+#include "debug.h"
+#include "csapp.h"
+#include "transaction.h"
+#include "transaction_funcs.h"
+
+static char *trans_status_names[] = { "pending", "committed", "aborted" };
+
+/*
+ * Transaction IDs are handed out in increasing order.  To find the oldest
+ * pending transaction cheaply, the IDs from oldest_id up to next_id are
+ * tracked in a circular array of flags, indexed by ID modulo its size, that
+ * records which of them have committed or aborted.  oldest_id advances past
+ * resolved IDs as they are marked, so it is always the ID of the oldest
+ * pending transaction, or next_id if there is none.  The array doubles when
+ * the window of IDs outgrows it.
+ *
+ * Snapshots are kept in a list in order of creation, which is also the
+ * order of their IDs, since oldest_id never decreases.  horizon_id is the
+ * smaller of oldest_id and the ID of the oldest snapshot, and is updated
+ * whenever either changes, so that it can be read without locking.
+ * All of this, and trans_list, is protected by list_mutex.
+ */
+#define TRANS_WINDOW_INIT 1024
+
+static unsigned int next_id;
+static unsigned int oldest_id;
+static unsigned char *resolved;
+static unsigned int window_size;
+static TRANS_SNAPSHOT snapshots;
+static unsigned int horizon_id;
+static pthread_mutex_t list_mutex;
+static TRANS_HOOK *resolve_hook;
+
+/*
+ * Held for reading from the time a committing transaction calls the hook
+ * until it is resolved, so that taking it for writing waits for all such
+ * transactions.  Writers are preferred, or a steady stream of commits
+ * could hold off trans_hook_barrier() indefinitely.
+ */
+static pthread_rwlock_t hook_lock;
+
+/*
+ * An asynchronous commit waiting for a transaction in the dependency set
+ * of the committing transaction.  Waiters are kept in a table hashed by
+ * the ID of the transaction waited for, since there is no room for them in
+ * a TRANSACTION.  A waiter is added while that transaction is locked and
+ * pending, and taken out when it resolves, so none is ever missed.
+ */
+#define TRANS_WAITER_BUCKETS 256
+
+typedef struct trans_waiter {
+    TRANSACTION *tp;              // Transaction trying to commit.
+    DEPENDENCY *dp;               // Dependency being waited for.
+    TRANS_CALLBACK *cb;
+    void *arg;
+    struct trans_waiter *next;
+} TRANS_WAITER;
+
+static TRANS_WAITER *waiters[TRANS_WAITER_BUCKETS];
+static int num_waiters;
+static pthread_mutex_t waiter_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void update_horizon(void) {
+    unsigned int h = oldest_id;
+    if(snapshots.next != &snapshots && snapshots.next->id < h)
+	h = snapshots.next->id;
+    __atomic_store_n(&horizon_id, h, __ATOMIC_RELEASE);
+}
+
+static void grow_window(void) {
+    unsigned char *new = Calloc(window_size * 2, 1);
+    for(unsigned int id = oldest_id; id != next_id; id++)
+	new[id & (window_size * 2 - 1)] = resolved[id & (window_size - 1)];
+    free(resolved);
+    resolved = new;
+    window_size *= 2;
+}
+
+void trans_init(void) {
+    debug("Initialize transaction manager");
+    next_id = oldest_id = horizon_id = 0;
+    snapshots.next = snapshots.prev = &snapshots;
+    window_size = TRANS_WINDOW_INIT;
+    resolved = Calloc(window_size, 1);
+    trans_list.next = trans_list.prev = &trans_list;
+    pthread_mutex_init(&list_mutex, NULL);
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&hook_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+void trans_fini(void) {
+    debug("Finalize transaction manager");
+    free(resolved);
+    resolved = NULL;
+    pthread_mutex_destroy(&list_mutex);
+    pthread_rwlock_destroy(&hook_lock);
+}
+
+TRANSACTION *trans_create(void) {
+    TRANSACTION *tp = Malloc(sizeof(TRANSACTION));
+    tp->refcnt = 0;
+    tp->status = TRANS_PENDING;
+    tp->depends = NULL;
+    tp->waitcnt = 0;
+    Sem_init(&tp->sem, 0, 0);
+    pthread_mutex_init(&tp->mutex, NULL);
+    pthread_mutex_lock(&list_mutex);
+    if(next_id - oldest_id == window_size)
+	grow_window();
+    tp->id = next_id++;
+    resolved[tp->id & (window_size - 1)] = 0;
+    tp->prev = trans_list.prev;
+    tp->next = &trans_list;
+    trans_list.prev->next = tp;
+    trans_list.prev = tp;
+    pthread_mutex_unlock(&list_mutex);
+    debug("Create new transaction %d", tp->id);
+    return trans_ref(tp, "for newly created transaction");
+}
+
+/*
+ * Reference counts are updated atomically, with the same ordering as for
+ * blobs: taking a reference is relaxed, dropping one is a release, and the
+ * thread that drops the last one acquires before freeing the transaction.
+ */
+TRANSACTION *trans_ref(TRANSACTION *tp, char *why) {
+    debug("Increase ref count on transaction %d for %s", tp->id, why);
+    __atomic_add_fetch(&tp->refcnt, 1, __ATOMIC_RELAXED);
+    return tp;
+}
+
+void trans_unref(TRANSACTION *tp, char *why) {
+    unsigned int n = __atomic_sub_fetch(&tp->refcnt, 1, __ATOMIC_RELEASE);
+    debug("Decrease ref count on transaction %d (%d -> %d) for %s", tp->id, n + 1, n, why);
+    if(n == UINT_MAX) {
+	fprintf(stderr, "Reference count on transaction %d is already zero\n", tp->id);
+	abort();
+    }
+    if(n > 0)
+	return;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    debug("Free transaction %d", tp->id);
+    pthread_mutex_lock(&list_mutex);
+    tp->prev->next = tp->next;
+    tp->next->prev = tp->prev;
+    pthread_mutex_unlock(&list_mutex);
+    while(tp->depends != NULL) {
+	DEPENDENCY *dp = tp->depends;
+	tp->depends = dp->next;
+	trans_unref(dp->trans, "for dependency of freed transaction");
+	free(dp);
+    }
+    sem_destroy(&tp->sem);
+    pthread_mutex_destroy(&tp->mutex);
+    free(tp);
+}
+
+void trans_add_dependency(TRANSACTION *tp, TRANSACTION *dtp) {
+    pthread_mutex_lock(&tp->mutex);
+    for(DEPENDENCY *dp = tp->depends; dp != NULL; dp = dp->next) {
+	if(dp->trans == dtp) {
+	    pthread_mutex_unlock(&tp->mutex);
+	    return;
+	}
+    }
+    debug("Make transaction %d dependent on transaction %d", tp->id, dtp->id);
+    DEPENDENCY *dp = Malloc(sizeof(DEPENDENCY));
+    dp->trans = trans_ref(dtp, "for transaction in dependency set");
+    dp->next = tp->depends;
+    tp->depends = dp;
+    pthread_mutex_unlock(&tp->mutex);
+}
+
+/*
+ * Make an asynchronous commit wait for the transaction its dependency
+ * refers to.  Called with that transaction locked.
+ */
+static void waiter_add(TRANS_WAITER *wp) {
+    TRANS_WAITER **bucket = &waiters[wp->dp->trans->id % TRANS_WAITER_BUCKETS];
+    pthread_mutex_lock(&waiter_mutex);
+    wp->next = *bucket;
+    *bucket = wp;
+    num_waiters++;
+    pthread_mutex_unlock(&waiter_mutex);
+}
+
+/*
+ * Take out the asynchronous commits waiting for a transaction, and add them
+ * to a list.  Called with the transaction locked.
+ */
+static void waiter_take(TRANSACTION *tp, TRANS_WAITER **listp) {
+    // A waiter is added with the transaction locked, so none can be missed.
+    if(__atomic_load_n(&num_waiters, __ATOMIC_RELAXED) == 0)
+	return;
+    pthread_mutex_lock(&waiter_mutex);
+    TRANS_WAITER **wpp = &waiters[tp->id % TRANS_WAITER_BUCKETS];
+    while(*wpp != NULL) {
+	TRANS_WAITER *wp = *wpp;
+	if(wp->dp->trans == tp) {
+	    *wpp = wp->next;
+	    wp->next = *listp;
+	    *listp = wp;
+	    num_waiters--;
+	} else {
+	    wpp = &wp->next;
+	}
+    }
+    pthread_mutex_unlock(&waiter_mutex);
+}
+
+/*
+ * Set the final status of a pending transaction and release any threads
+ * waiting for it.  Asynchronous commits waiting for it are added to a list,
+ * to be gone on with once it is unlocked.  Called with the transaction
+ * locked.
+ */
+static void trans_resolve(TRANSACTION *tp, TRANS_STATUS status, TRANS_WAITER **wokenp) {
+    __atomic_store_n(&tp->status, status, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&list_mutex);
+    resolved[tp->id & (window_size - 1)] = 1;
+    while(oldest_id != next_id && resolved[oldest_id & (window_size - 1)])
+	oldest_id++;
+    update_horizon();
+    pthread_mutex_unlock(&list_mutex);
+    while(tp->waitcnt > 0) {
+	V(&tp->sem);
+	tp->waitcnt--;
+    }
+    waiter_take(tp, wokenp);
+}
+
+/*
+ * Wait for a transaction to commit or abort, and return its final status.
+ */
+static TRANS_STATUS trans_wait(TRANSACTION *tp) {
+    pthread_mutex_lock(&tp->mutex);
+    if(tp->status == TRANS_PENDING) {
+	tp->waitcnt++;
+	pthread_mutex_unlock(&tp->mutex);
+	P(&tp->sem);
+    } else {
+	pthread_mutex_unlock(&tp->mutex);
+    }
+    return trans_get_status(tp);
+}
+
+/*
+ * Commit a transaction whose dependencies have all committed, and consume
+ * a reference to it.
+ */
+static TRANS_STATUS commit_finish(TRANSACTION *tp, TRANS_WAITER **wokenp) {
+    pthread_mutex_lock(&tp->mutex);
+    if(tp->status == TRANS_PENDING) {
+	TRANS_HOOK *hook = resolve_hook;
+	if(hook != NULL)
+	    pthread_rwlock_rdlock(&hook_lock);
+	if(hook != NULL && hook(tp, TRANS_COMMITTED)) {
+	    debug("Transaction %d aborts because it could not be made durable", tp->id);
+	    trans_resolve(tp, TRANS_ABORTED, wokenp);
+	} else {
+	    debug("Transaction %d commits", tp->id);
+	    trans_resolve(tp, TRANS_COMMITTED, wokenp);
+	}
+	if(hook != NULL)
+	    pthread_rwlock_unlock(&hook_lock);
+    }
+    TRANS_STATUS status = tp->status;
+    pthread_mutex_unlock(&tp->mutex);
+    trans_unref(tp, "attempting to commit transaction");
+    return status;
+}
+
+/*
+ * Abort a transaction and consume a reference to it.
+ */
+static void abort_finish(TRANSACTION *tp, TRANS_WAITER **wokenp) {
+    pthread_mutex_lock(&tp->mutex);
+    if(tp->status == TRANS_COMMITTED) {
+	fprintf(stderr, "Attempt to abort committed transaction %d\n", tp->id);
+	abort();
+    }
+    if(tp->status == TRANS_PENDING) {
+	debug("Transaction %d aborts", tp->id);
+	if(resolve_hook != NULL)
+	    resolve_hook(tp, TRANS_ABORTED);
+	trans_resolve(tp, TRANS_ABORTED, wokenp);
+    }
+    pthread_mutex_unlock(&tp->mutex);
+    trans_unref(tp, "aborting transaction");
+}
+
+/*
+ * Go through the dependencies of an asynchronous commit from the one it
+ * is at, until one is pending, in which case the commit waits for it, or
+ * one has aborted.
+ *
+ * @return  TRANS_PENDING if the commit is waiting, TRANS_ABORTED if a
+ * dependency aborted, or TRANS_COMMITTED if all of them committed.
+ */
+static TRANS_STATUS waiter_advance(TRANS_WAITER *wp) {
+    for(; wp->dp != NULL; wp->dp = wp->dp->next) {
+	TRANSACTION *dtp = wp->dp->trans;
+	pthread_mutex_lock(&dtp->mutex);
+	TRANS_STATUS status = dtp->status;
+	if(status == TRANS_PENDING) {
+	    debug("Transaction %d waits for transaction %d", wp->tp->id, dtp->id);
+	    waiter_add(wp);
+	}
+	pthread_mutex_unlock(&dtp->mutex);
+	if(status != TRANS_COMMITTED)
+	    return status;
+    }
+    return TRANS_COMMITTED;
+}
+
+/*
+ * Go on with asynchronous commits whose dependency has resolved.  Those
+ * that finish may release others in turn, which are handled in the same
+ * loop rather than by recursion, however long the chain of dependencies.
+ */
+static void trans_wake(TRANS_WAITER *list) {
+    while(list != NULL) {
+	TRANS_WAITER *wp = list;
+	list = wp->next;
+	TRANS_STATUS status = waiter_advance(wp);
+	if(status == TRANS_PENDING)
+	    continue;
+	if(status == TRANS_ABORTED)
+	    abort_finish(wp->tp, &list);
+	else
+	    status = commit_finish(wp->tp, &list);
+	wp->cb(status, wp->arg);
+	free(wp);
+    }
+}
+
+TRANS_STATUS trans_commit(TRANSACTION *tp) {
+    debug("Transaction %d trying to commit", tp->id);
+    TRANS_STATUS status = TRANS_COMMITTED;
+    for(DEPENDENCY *dp = tp->depends; dp != NULL; dp = dp->next) {
+	if(trans_wait(dp->trans) == TRANS_ABORTED) {
+	    status = TRANS_ABORTED;
+	    break;
+	}
+    }
+    if(status == TRANS_ABORTED)
+	return trans_abort(tp);
+    TRANS_WAITER *woken = NULL;
+    status = commit_finish(tp, &woken);
+    trans_wake(woken);
+    return status;
+}
+
+TRANS_STATUS trans_commit_async(TRANSACTION *tp, TRANS_CALLBACK *cb, void *arg) {
+    debug("Transaction %d trying to commit asynchronously", tp->id);
+    TRANS_WAITER *wp = Malloc(sizeof(TRANS_WAITER));
+    wp->tp = tp;
+    wp->dp = tp->depends;
+    wp->cb = cb;
+    wp->arg = arg;
+    TRANS_STATUS status = waiter_advance(wp);
+    // A commit that waits may already have finished on another thread.
+    if(status == TRANS_PENDING)
+	return TRANS_PENDING;
+    free(wp);
+    if(status == TRANS_ABORTED)
+	return trans_abort(tp);
+    TRANS_WAITER *woken = NULL;
+    status = commit_finish(tp, &woken);
+    trans_wake(woken);
+    return status;
+}
+
+TRANS_STATUS trans_abort(TRANSACTION *tp) {
+    TRANS_WAITER *woken = NULL;
+    abort_finish(tp, &woken);
+    trans_wake(woken);
+    return TRANS_ABORTED;
+}
+
+TRANS_STATUS trans_get_status(TRANSACTION *tp) {
+    return __atomic_load_n(&tp->status, __ATOMIC_ACQUIRE);
+}
+
+unsigned int trans_oldest_pending(void) {
+    pthread_mutex_lock(&list_mutex);
+    unsigned int id = oldest_id;
+    pthread_mutex_unlock(&list_mutex);
+    return id;
+}
+
+void trans_set_hook(TRANS_HOOK *hook) {
+    resolve_hook = hook;
+}
+
+void trans_hook_barrier(void) {
+    pthread_rwlock_wrlock(&hook_lock);
+    pthread_rwlock_unlock(&hook_lock);
+}
+
+unsigned int trans_horizon(void) {
+    return __atomic_load_n(&horizon_id, __ATOMIC_ACQUIRE);
+}
+
+TRANS_SNAPSHOT *trans_snapshot_create(void) {
+    TRANS_SNAPSHOT *ssp = Malloc(sizeof(TRANS_SNAPSHOT));
+    pthread_mutex_lock(&list_mutex);
+    ssp->id = oldest_id;
+    ssp->prev = snapshots.prev;
+    ssp->next = &snapshots;
+    snapshots.prev->next = ssp;
+    snapshots.prev = ssp;
+    update_horizon();
+    pthread_mutex_unlock(&list_mutex);
+    debug("Create snapshot as of transaction %d", ssp->id);
+    return ssp;
+}
+
+void trans_snapshot_release(TRANS_SNAPSHOT *ssp) {
+    debug("Release snapshot as of transaction %d", ssp->id);
+    pthread_mutex_lock(&list_mutex);
+    ssp->prev->next = ssp->next;
+    ssp->next->prev = ssp->prev;
+    update_horizon();
+    pthread_mutex_unlock(&list_mutex);
+    free(ssp);
+}
+
+void trans_show(TRANSACTION *tp) {
+    fprintf(stderr, "[id=%d, status=%d (%s), refcnt=%d, waitcnt=%d, depends=[",
+	    tp->id, tp->status, trans_status_names[tp->status], tp->refcnt, tp->waitcnt);
+    for(DEPENDENCY *dp = tp->depends; dp != NULL; dp = dp->next)
+	fprintf(stderr, "%d%s", dp->trans->id, dp->next != NULL ? ", " : "");
+    fprintf(stderr, "]]\n");
+}
+
+void trans_show_all(void) {
+    fprintf(stderr, "TRANSACTIONS:\n");
+    for(TRANSACTION *tp = trans_list.next; tp != &trans_list; tp = tp->next)
+	trans_show(tp);
+}
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "debug.h"
+#include "csapp.h"
+#include "uring.h"
+
+int uring_init(URING *rp, unsigned entries) {
+    struct io_uring_params p;
+    memset(rp, 0, sizeof(*rp));
+    memset(&p, 0, sizeof(p));
+    // Multishot operations can complete many times for each submission.
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = 8 * entries;
+    if((rp->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1)
+	return -1;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+	close(rp->fd);
+	return -1;
+    }
+    rp->entries = p.sq_entries;
+    rp->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    rp->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(rp->cq_map_size > rp->sq_map_size)
+	rp->sq_map_size = rp->cq_map_size;
+    rp->sq_map = mmap(NULL, rp->sq_map_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, rp->fd, IORING_OFF_SQ_RING);
+    rp->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    rp->sqes = mmap(NULL, rp->sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, rp->fd, IORING_OFF_SQES);
+    if(rp->sq_map == MAP_FAILED || rp->sqes == MAP_FAILED) {
+	uring_fini(rp);
+	return -1;
+    }
+    rp->cq_map = rp->sq_map;
+    char *sq = rp->sq_map, *cq = rp->cq_map;
+    rp->sq_head = (unsigned *)(sq + p.sq_off.head);
+    rp->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    rp->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    rp->sq_array = (unsigned *)(sq + p.sq_off.array);
+    rp->cq_head = (unsigned *)(cq + p.cq_off.head);
+    rp->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    rp->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    rp->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    rp->sq_local = *rp->sq_tail;
+    return 0;
+}
+
+void uring_fini(URING *rp) {
+    if(rp->sqes != NULL && rp->sqes != MAP_FAILED)
+	munmap(rp->sqes, rp->sqes_size);
+    if(rp->sq_map != NULL && rp->sq_map != MAP_FAILED)
+	munmap(rp->sq_map, rp->sq_map_size);
+    close(rp->fd);
+}
+
+/*
+ * Make the entries prepared so far visible to the kernel, and return how
+ * many are waiting to be consumed.
+ */
+static unsigned publish(URING *rp) {
+    __atomic_store_n(rp->sq_tail, rp->sq_local, __ATOMIC_RELEASE);
+    return rp->sq_local - __atomic_load_n(rp->sq_head, __ATOMIC_ACQUIRE);
+}
+
+int uring_submit(URING *rp, int wait) {
+    for(;;) {
+	unsigned n = publish(rp);
+	if(n == 0 && !wait)
+	    return 0;
+	if(syscall(__NR_io_uring_enter, rp->fd, n, wait ? 1 : 0,
+		   wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) != -1)
+	    return 0;
+	// The kernel is short of resources until completions are reaped.
+	if(errno == EAGAIN || errno == EBUSY)
+	    return 0;
+	if(errno != EINTR)
+	    return -1;
+    }
+}
+
+struct io_uring_sqe *uring_get_sqe(URING *rp) {
+    while(rp->sq_local - __atomic_load_n(rp->sq_head, __ATOMIC_ACQUIRE) >= rp->entries) {
+	if(uring_submit(rp, 0) == -1)
+	    unix_error("io_uring_enter error");
+    }
+    unsigned idx = rp->sq_local & *rp->sq_mask;
+    struct io_uring_sqe *sqe = &rp->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    rp->sq_array[idx] = idx;
+    rp->sq_local++;
+    return sqe;
+}
+
+struct io_uring_cqe *uring_peek_cqe(URING *rp) {
+    unsigned head = *rp->cq_head;
+    if(head == __atomic_load_n(rp->cq_tail, __ATOMIC_ACQUIRE))
+	return NULL;
+    return &rp->cqes[head & *rp->cq_mask];
+}
+
+void uring_cqe_seen(URING *rp) {
+    __atomic_store_n(rp->cq_head, *rp->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_bufs_init(URING *rp, URING_BUFS *bp, int group, unsigned count, unsigned size) {
+    memset(bp, 0, sizeof(*bp));
+    size_t ring_size = count * sizeof(struct io_uring_buf);
+    bp->ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(bp->ring == MAP_FAILED)
+	return -1;
+    struct io_uring_buf_reg reg = {
+	.ring_addr = (unsigned long)bp->ring, .ring_entries = count, .bgid = group
+    };
+    if(syscall(__NR_io_uring_register, rp->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+	munmap(bp->ring, ring_size);
+	return -1;
+    }
+    bp->base = Malloc((size_t)count * size);
+    bp->count = count;
+    bp->size = size;
+    bp->group = group;
+    for(unsigned i = 0; i < count; i++)
+	uring_buf_recycle(bp, i);
+    return 0;
+}
+
+char *uring_buf(URING_BUFS *bp, unsigned id) {
+    return bp->base + (size_t)id * bp->size;
+}
+
+void uring_buf_recycle(URING_BUFS *bp, unsigned id) {
+    unsigned short tail = bp->ring->tail;
+    struct io_uring_buf *buf = &bp->ring->bufs[tail & (bp->count - 1)];
+    buf->addr = (unsigned long)uring_buf(bp, id);
+    buf->len = bp->size;
+    buf->bid = id;
+    __atomic_store_n(&bp->ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,645 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "csapp.h"
+#include "wal.h"
+#include "store_funcs.h"
+#include "transaction_funcs.h"
+
+/*
+ * A put waiting in the write set of a pending transaction.
+ */
+typedef struct wal_write {
+    BLOB *key;
+    BLOB *value;
+    struct wal_write *next;
+} WAL_WRITE;
+
+/*
+ * Write set of a pending transaction, in the order of the puts.
+ */
+typedef struct wal_txn {
+    TRANSACTION *tp;
+    WAL_WRITE *writes;
+    WAL_WRITE **last;
+    uint32_t count;
+    size_t size;                  // Size of the record payload.
+    struct wal_txn *next;
+} WAL_TXN;
+
+/*
+ * A wait for the log to be written or durable, to be ended by the log
+ * thread.
+ */
+typedef struct wal_waiter {
+    int sync;                     // Whether it is to be synced too.
+    WAL_DONE_FUNC *done;
+    void *arg;
+    struct wal_waiter *next;
+} WAL_WAITER;
+
+typedef struct wal_header {
+    uint32_t size;                // Size of the payload.
+    uint32_t sum;                 // Checksum of the payload.
+} WAL_HEADER;
+
+/*
+ * Positions in the log are counted in bytes from the start of the file.
+ * Records are appended to buf under mutex, and moved from there to the
+ * file under io_mutex, which is taken first.  Whoever holds io_mutex swaps
+ * buf with spare, so that appending can go on while the old buffer is
+ * written out; since only one thread writes at a time, the file receives
+ * the records in the order they were appended.  written and synced only
+ * change with both mutexes held.  Since a checkpoint starts a new file,
+ * these positions are only compared with each other, never with offsets
+ * in the file.
+ */
+static struct {
+    int open;
+    int fd;
+    char *path;
+    char *prev_path;              // Where the log goes while a checkpoint is taken.
+    char *ckpt_path;
+    int has_prev;                 // Whether prev_path is yet to be dropped.
+    WAL_SYNC policy;
+    int interval_ms;
+    int failed;                   // Set once a write or sync has failed.
+    pthread_mutex_t mutex;
+    pthread_mutex_t io_mutex;
+    pthread_cond_t cond;          // Broadcast to stop the background threads.
+    pthread_cond_t sync_cond;     // Signalled when the log thread has work.
+    WAL_WAITER *waiters;          // Waits for the log thread.
+    int kicked;                   // Whether the log thread is to write out.
+    pthread_mutex_t ckpt_mutex;   // Held while taking a checkpoint.
+    char *buf;
+    size_t len, cap;
+    char *spare;
+    size_t spare_cap;
+    unsigned long appended;       // End of the last record appended.
+    unsigned long written;        // End of what has been written to the file.
+    unsigned long synced;         // End of what is known to be durable.
+    pthread_t thread;
+    pthread_t ckpt_thread;
+    int ckpt_interval_ms;         // Zero if there is no checkpoint thread.
+    int stop;
+    WAL_STATS stats;
+    struct {
+	pthread_mutex_t mutex;
+	WAL_TXN *list;
+    } txns[WAL_TXN_BUCKETS];
+} wal;
+
+static uint32_t checksum(const char *p, size_t n) {
+    uint32_t h = 2166136261u;
+    while(n-- > 0) {
+	h ^= (unsigned char)*p++;
+	h *= 16777619u;
+    }
+    return h;
+}
+
+static WAL_TXN *take_txn(TRANSACTION *tp) {
+    int b = tp->id % WAL_TXN_BUCKETS;
+    pthread_mutex_lock(&wal.txns[b].mutex);
+    WAL_TXN **txpp = &wal.txns[b].list;
+    while(*txpp != NULL && (*txpp)->tp != tp)
+	txpp = &(*txpp)->next;
+    WAL_TXN *txp = *txpp;
+    if(txp != NULL)
+	*txpp = txp->next;
+    pthread_mutex_unlock(&wal.txns[b].mutex);
+    return txp;
+}
+
+static void free_txn(WAL_TXN *txp) {
+    WAL_WRITE *wp = txp->writes;
+    while(wp != NULL) {
+	WAL_WRITE *next = wp->next;
+	blob_unref(wp->key, "for key in write set");
+	if(wp->value != NULL)
+	    blob_unref(wp->value, "for value in write set");
+	free(wp);
+	wp = next;
+    }
+    free(txp);
+}
+
+void wal_note_put(TRANSACTION *tp, KEY *key, BLOB *value) {
+    if(!__atomic_load_n(&wal.open, __ATOMIC_ACQUIRE))
+	return;
+    WAL_WRITE *wp = Malloc(sizeof(WAL_WRITE));
+    wp->key = blob_ref(key->blob, "for key in write set");
+    wp->value = value != NULL ? blob_ref(value, "for value in write set") : NULL;
+    wp->next = NULL;
+    int b = tp->id % WAL_TXN_BUCKETS;
+    pthread_mutex_lock(&wal.txns[b].mutex);
+    WAL_TXN *txp = wal.txns[b].list;
+    while(txp != NULL && txp->tp != tp)
+	txp = txp->next;
+    if(txp == NULL) {
+	txp = Malloc(sizeof(WAL_TXN));
+	txp->tp = tp;
+	txp->writes = NULL;
+	txp->last = &txp->writes;
+	txp->count = 0;
+	txp->size = sizeof(uint32_t);
+	txp->next = wal.txns[b].list;
+	wal.txns[b].list = txp;
+    }
+    *txp->last = wp;
+    txp->last = &wp->next;
+    txp->count++;
+    txp->size += 2 * sizeof(uint32_t) + key->blob->size + (value != NULL ? value->size : 0);
+    pthread_mutex_unlock(&wal.txns[b].mutex);
+}
+
+static char *put_word(char *p, uint32_t w) {
+    memcpy(p, &w, sizeof(w));
+    return p + sizeof(w);
+}
+
+static char *put_item(char *p, BLOB *bp) {
+    if(bp == NULL)
+	return put_word(p, WAL_NULL_ITEM);
+    p = put_word(p, bp->size);
+    memcpy(p, bp->content, bp->size);
+    return p + bp->size;
+}
+
+/*
+ * Append the record for a write set to the buffer, and have the log thread
+ * write it out if the buffer has grown past WAL_BUFFER_MAX.
+ */
+static void append_record(WAL_TXN *txp) {
+    size_t n = sizeof(WAL_HEADER) + txp->size;
+    pthread_mutex_lock(&wal.mutex);
+    if(wal.len + n > wal.cap) {
+	while(wal.len + n > wal.cap)
+	    wal.cap = wal.cap ? 2 * wal.cap : 4096;
+	wal.buf = Realloc(wal.buf, wal.cap);
+    }
+    char *start = wal.buf + wal.len;
+    char *p = start + sizeof(WAL_HEADER);
+    p = put_word(p, txp->count);
+    for(WAL_WRITE *wp = txp->writes; wp != NULL; wp = wp->next) {
+	p = put_item(p, wp->key);
+	p = put_item(p, wp->value);
+    }
+    WAL_HEADER h = { txp->size, checksum(start + sizeof(WAL_HEADER), txp->size) };
+    memcpy(start, &h, sizeof(h));
+    wal.len += n;
+    wal.appended += n;
+    wal.stats.commits++;
+    wal.stats.bytes += n;
+    if(wal.len > WAL_BUFFER_MAX && !wal.kicked) {
+	wal.kicked = 1;
+	pthread_cond_signal(&wal.sync_cond);
+    }
+    pthread_mutex_unlock(&wal.mutex);
+}
+
+/*
+ * Write out everything appended so far, and sync it if requested.
+ * Called with io_mutex held.  Returns 0 if successful, -1 otherwise.
+ */
+static int write_out(int sync) {
+    if(wal.failed)
+	return -1;
+    pthread_mutex_lock(&wal.mutex);
+    char *buf = wal.buf;
+    size_t len = wal.len, cap = wal.cap;
+    unsigned long end = wal.appended;
+    wal.buf = wal.spare;
+    wal.cap = wal.spare_cap;
+    wal.len = 0;
+    pthread_mutex_unlock(&wal.mutex);
+    int ret = 0;
+    if(len > 0 && rio_writen(wal.fd, buf, len) != (ssize_t)len)
+	ret = -1;
+    if(ret == 0 && sync && end > wal.synced && fdatasync(wal.fd) == -1)
+	ret = -1;
+    if(ret == -1) {
+	fprintf(stderr, "Write-ahead log failed: %s\n", strerror(errno));
+	wal.failed = 1;
+    }
+    pthread_mutex_lock(&wal.mutex);
+    wal.spare = buf;
+    wal.spare_cap = cap;
+    if(ret == 0) {
+	if(len > 0)
+	    wal.stats.writes++;
+	if(sync && end > wal.synced)
+	    wal.stats.syncs++;
+	wal.written = end;
+	if(sync)
+	    wal.synced = end;
+    }
+    pthread_mutex_unlock(&wal.mutex);
+    return ret;
+}
+
+/*
+ * Wait until the log is written, and if sync is nonzero synced, at least
+ * up to a given position.  If some other thread is writing out, by the time
+ * it is done it may have taken care of this position too.
+ */
+static int wait_for(unsigned long end, int sync) {
+    pthread_mutex_lock(&wal.io_mutex);
+    int ret = wal.failed ? -1 : 0;
+    if(ret == 0 && (sync ? wal.synced : wal.written) < end)
+	ret = write_out(sync);
+    pthread_mutex_unlock(&wal.io_mutex);
+    return ret;
+}
+
+static int wal_hook(TRANSACTION *tp, TRANS_STATUS status) {
+    WAL_TXN *txp = take_txn(tp);
+    if(txp == NULL)
+	return 0;
+    if(status != TRANS_COMMITTED) {
+	free_txn(txp);
+	return 0;
+    }
+    // The record is only written out, and synced, by the log thread, and
+    // waited for before the commit is acknowledged (wal_wait_durable()), so
+    // that the transaction is not held locked meanwhile.
+    append_record(txp);
+    free_txn(txp);
+    return wal.failed ? -1 : 0;
+}
+
+static void deadline(struct timespec *ts, int ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if(ts->tv_nsec >= 1000000000L) {
+	ts->tv_sec++;
+	ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/*
+ * Body of the thread that writes the log out, and syncs it, for commits:
+ * for the waits of wal_wait_durable() that do not block, whenever the
+ * buffer is to be written without waiting, and under WAL_SYNC_INTERVAL
+ * every interval.  Waits added while it writes are taken together, and
+ * share the next write and sync.
+ */
+static void *log_thread(void *arg) {
+    struct timespec ts;
+    deadline(&ts, wal.interval_ms);
+    pthread_mutex_lock(&wal.mutex);
+    for(;;) {
+	int timeout = 0;
+	while(wal.waiters == NULL && !wal.kicked && !wal.stop && !timeout) {
+	    if(wal.policy == WAL_SYNC_INTERVAL)
+		timeout = pthread_cond_timedwait(&wal.sync_cond, &wal.mutex, &ts) == ETIMEDOUT;
+	    else
+		pthread_cond_wait(&wal.sync_cond, &wal.mutex);
+	}
+	WAL_WAITER *list = wal.waiters;
+	wal.waiters = NULL;
+	if(list == NULL && wal.stop)
+	    break;
+	int sync = timeout;
+	for(WAL_WAITER *wp = list; wp != NULL; wp = wp->next)
+	    sync |= wp->sync;
+	if(timeout)
+	    deadline(&ts, wal.interval_ms);
+	wal.kicked = 0;
+	unsigned long end = wal.appended;
+	pthread_mutex_unlock(&wal.mutex);
+	int ret = wait_for(end, sync);
+	while(list != NULL) {
+	    WAL_WAITER *wp = list;
+	    list = wp->next;
+	    wp->done(ret, wp->arg);
+	    free(wp);
+	}
+	pthread_mutex_lock(&wal.mutex);
+    }
+    pthread_mutex_unlock(&wal.mutex);
+    return NULL;
+}
+
+static uint32_t get_word(const char **pp) {
+    uint32_t w;
+    memcpy(&w, *pp, sizeof(w));
+    *pp += sizeof(w);
+    return w;
+}
+
+/*
+ * Check the payload of a record, and if tp is not NULL put its writes in
+ * the store for that transaction.  Returns 0 if the payload is well formed,
+ * -1 otherwise.
+ */
+static int replay_record(TRANSACTION *tp, const char *p, size_t size) {
+    const char *end = p + size;
+    if(size < sizeof(uint32_t))
+	return -1;
+    uint32_t count = get_word(&p);
+    for(uint32_t i = 0; i < 2 * count; i++) {
+	if(end - p < (long)sizeof(uint32_t))
+	    return -1;
+	uint32_t len = get_word(&p);
+	if(len == WAL_NULL_ITEM) {
+	    if(i % 2 == 0)
+		return -1;
+	    continue;
+	}
+	if((size_t)(end - p) < len)
+	    return -1;
+	p += len;
+    }
+    if(p != end)
+	return -1;
+    if(tp == NULL)
+	return 0;
+    p = end - size + sizeof(uint32_t);
+    for(uint32_t i = 0; i < count; i++) {
+	uint32_t klen = get_word(&p);
+	KEY *key = key_create(blob_create((char *)p, klen));
+	p += klen;
+	uint32_t vlen = get_word(&p);
+	BLOB *value = NULL;
+	if(vlen != WAL_NULL_ITEM) {
+	    value = blob_create((char *)p, vlen);
+	    p += vlen;
+	}
+	store_put(tp, key, value);
+    }
+    return 0;
+}
+
+/*
+ * Replay the records in a log file into the store for a transaction, and
+ * if truncate is nonzero cut off anything after the last good one.
+ * Returns the size of what is left.
+ */
+static unsigned long replay(int fd, TRANSACTION *tp, int truncate) {
+    struct stat st;
+    if(fstat(fd, &st) == -1 || st.st_size == 0)
+	return 0;
+    size_t size = st.st_size;
+    char *data = Malloc(size);
+    if(rio_readn(fd, data, size) != (ssize_t)size) {
+	free(data);
+	return 0;
+    }
+    size_t off = 0;
+    while(size - off >= sizeof(WAL_HEADER)) {
+	WAL_HEADER h;
+	memcpy(&h, data + off, sizeof(h));
+	const char *payload = data + off + sizeof(h);
+	if(h.size > size - off - sizeof(h) || checksum(payload, h.size) != h.sum
+	   || replay_record(NULL, payload, h.size) == -1)
+	    break;
+	replay_record(tp, payload, h.size);
+	off += sizeof(h) + h.size;
+	wal.stats.recovered++;
+    }
+    free(data);
+    if(off < size) {
+	debug("Discarding %lu bytes of torn records at end of log", size - off);
+	wal.stats.discarded += size - off;
+	if(truncate && ftruncate(fd, off) == -1)
+	    unix_error("ftruncate error");
+    }
+    return off;
+}
+
+static char *path_with(char *path, char *suffix) {
+    size_t n = strlen(path) + strlen(suffix) + 1;
+    char *p = Malloc(n);
+    snprintf(p, n, "%s%s", path, suffix);
+    return p;
+}
+
+static void free_paths(void) {
+    free(wal.path);
+    free(wal.prev_path);
+    free(wal.ckpt_path);
+}
+
+int wal_open(char *path, WAL_SYNC policy, int interval_ms) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd == -1)
+	return -1;
+    memset(&wal, 0, sizeof(wal));
+    wal.fd = fd;
+    wal.path = path_with(path, "");
+    wal.prev_path = path_with(path, ".prev");
+    wal.ckpt_path = path_with(path, ".ckpt");
+    wal.policy = policy;
+    wal.interval_ms = interval_ms > 0 ? interval_ms : 1;
+    pthread_mutex_init(&wal.mutex, NULL);
+    pthread_mutex_init(&wal.io_mutex, NULL);
+    pthread_mutex_init(&wal.ckpt_mutex, NULL);
+    pthread_cond_init(&wal.cond, NULL);
+    pthread_cond_init(&wal.sync_cond, NULL);
+    for(int i = 0; i < WAL_TXN_BUCKETS; i++)
+	pthread_mutex_init(&wal.txns[i].mutex, NULL);
+    if(ckpt_load(wal.ckpt_path, 0, &wal.stats.load) == -1) {
+	fprintf(stderr, "Checkpoint %s is not valid\n", wal.ckpt_path);
+	close(fd);
+	free_paths();
+	return -1;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TRANSACTION *tp = trans_create();
+    int prev_fd = open(wal.prev_path, O_RDONLY);
+    if(prev_fd != -1) {
+	debug("Replaying log %s left by an unfinished checkpoint", wal.prev_path);
+	replay(prev_fd, tp, 0);
+	close(prev_fd);
+	wal.has_prev = 1;
+    }
+    wal.appended = wal.written = wal.synced = replay(fd, tp, 1);
+    trans_commit(tp);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    wal.stats.replay_nsecs = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+    debug("Replayed %lu records from log", wal.stats.recovered);
+    if(lseek(fd, wal.appended, SEEK_SET) == -1)
+	unix_error("lseek error");
+    trans_set_hook(wal_hook);
+    __atomic_store_n(&wal.open, 1, __ATOMIC_RELEASE);
+    Pthread_create(&wal.thread, NULL, log_thread, NULL);
+    return 0;
+}
+
+/*
+ * Move the log aside to prev_path and start a new one, once everything
+ * appended to the old one is durable.  Called with io_mutex held.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int rotate(void) {
+    if(write_out(1) == -1)
+	return -1;
+    if(rename(wal.path, wal.prev_path) == -1)
+	return -1;
+    int fd = open(wal.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1 || ckpt_sync_dir(wal.path) == -1) {
+	if(fd != -1)
+	    close(fd);
+	rename(wal.prev_path, wal.path);
+	return -1;
+    }
+    close(wal.fd);
+    wal.fd = fd;
+    wal.has_prev = 1;
+    return 0;
+}
+
+/*
+ * Make everything appended so far durable.  A checkpoint does this before
+ * it is put in place: a transaction that committed while the values were
+ * being read may be in the checkpoint while its record is still in the
+ * buffer, and the checkpoint would then hold part of a transaction that a
+ * crash loses the rest of.
+ */
+static int sync_log(void) {
+    pthread_mutex_lock(&wal.io_mutex);
+    int ret = write_out(1);
+    pthread_mutex_unlock(&wal.io_mutex);
+    return ret;
+}
+
+int wal_checkpoint(void) {
+    if(!wal.open)
+	return -1;
+    pthread_mutex_lock(&wal.ckpt_mutex);
+    int ret = 0;
+    /*
+     * If an earlier checkpoint was not finished, its old log is still there,
+     * and the current log has every record since; in that case there is no
+     * need to move the current log aside, and the checkpoint can go ahead.
+     */
+    if(!wal.has_prev) {
+	pthread_mutex_lock(&wal.io_mutex);
+	ret = rotate();
+	pthread_mutex_unlock(&wal.io_mutex);
+    }
+    if(ret == 0) {
+	/*
+	 * Some transactions whose records are in the old log may not be marked
+	 * committed yet, so their values would be missed by the checkpoint.
+	 * Wait for them before starting.
+	 */
+	trans_hook_barrier();
+	CKPT_STATS cs;
+	ret = ckpt_write(wal.ckpt_path, sync_log, &cs);
+	if(ret == 0 && (unlink(wal.prev_path) == -1 || ckpt_sync_dir(wal.prev_path) == -1))
+	    ret = -1;
+	if(ret == 0) {
+	    wal.has_prev = 0;
+	    pthread_mutex_lock(&wal.mutex);
+	    wal.stats.checkpoints++;
+	    wal.stats.checkpoint = cs;
+	    pthread_mutex_unlock(&wal.mutex);
+	}
+    }
+    pthread_mutex_unlock(&wal.ckpt_mutex);
+    if(ret == -1)
+	fprintf(stderr, "Checkpoint failed: %s\n", strerror(errno));
+    return ret;
+}
+
+/*
+ * Body of the thread that takes checkpoints at intervals.
+ */
+static void *checkpoint_thread(void *arg) {
+    pthread_mutex_lock(&wal.mutex);
+    while(!wal.stop) {
+	struct timespec ts;
+	deadline(&ts, wal.ckpt_interval_ms);
+	if(pthread_cond_timedwait(&wal.cond, &wal.mutex, &ts) != ETIMEDOUT || wal.stop)
+	    continue;
+	pthread_mutex_unlock(&wal.mutex);
+	wal_checkpoint();
+	pthread_mutex_lock(&wal.mutex);
+    }
+    pthread_mutex_unlock(&wal.mutex);
+    return NULL;
+}
+
+void wal_checkpoint_start(int interval_ms) {
+    if(!wal.open || wal.ckpt_interval_ms > 0 || interval_ms <= 0)
+	return;
+    wal.ckpt_interval_ms = interval_ms;
+    Pthread_create(&wal.ckpt_thread, NULL, checkpoint_thread, NULL);
+}
+
+void wal_close(void) {
+    if(!wal.open)
+	return;
+    pthread_mutex_lock(&wal.mutex);
+    wal.stop = 1;
+    pthread_cond_broadcast(&wal.cond);
+    pthread_cond_broadcast(&wal.sync_cond);
+    pthread_mutex_unlock(&wal.mutex);
+    // The log thread ends the waits it has before it stops.
+    Pthread_join(wal.thread, NULL);
+    if(wal.ckpt_interval_ms > 0)
+	Pthread_join(wal.ckpt_thread, NULL);
+    trans_set_hook(NULL);
+    __atomic_store_n(&wal.open, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&wal.io_mutex);
+    write_out(1);
+    pthread_mutex_unlock(&wal.io_mutex);
+    for(int i = 0; i < WAL_TXN_BUCKETS; i++) {
+	while(wal.txns[i].list != NULL) {
+	    WAL_TXN *txp = wal.txns[i].list;
+	    wal.txns[i].list = txp->next;
+	    free_txn(txp);
+	}
+	pthread_mutex_destroy(&wal.txns[i].mutex);
+    }
+    close(wal.fd);
+    free(wal.buf);
+    free(wal.spare);
+    free_paths();
+}
+
+int wal_wait_durable(WAL_DONE_FUNC *done, void *arg) {
+    if(!__atomic_load_n(&wal.open, __ATOMIC_ACQUIRE))
+	return 0;
+    // Most commits under WAL_SYNC_INTERVAL have nothing to wait for.
+    if(wal.policy == WAL_SYNC_INTERVAL
+       && __atomic_load_n(&wal.appended, __ATOMIC_RELAXED)
+       - __atomic_load_n(&wal.written, __ATOMIC_RELAXED) <= WAL_BUFFER_MAX)
+	return wal.failed ? -1 : 0;
+    pthread_mutex_lock(&wal.mutex);
+    unsigned long end = wal.appended;
+    int sync = wal.policy == WAL_SYNC_COMMIT;
+    int wait = (sync ? wal.synced : wal.written) < end;
+    if(wal.policy == WAL_SYNC_INTERVAL)
+	wait = end - wal.written > WAL_BUFFER_MAX;
+    int ret = wal.failed ? -1 : 0;
+    if(ret == 0 && wait && done != NULL && !wal.stop) {
+	WAL_WAITER *wp = Malloc(sizeof(WAL_WAITER));
+	wp->sync = sync;
+	wp->done = done;
+	wp->arg = arg;
+	wp->next = wal.waiters;
+	wal.waiters = wp;
+	pthread_cond_signal(&wal.sync_cond);
+	ret = 1;
+    }
+    pthread_mutex_unlock(&wal.mutex);
+    if(ret == 0 && wait)
+	ret = wait_for(end, sync);
+    return ret;
+}
+
+void wal_get_stats(WAL_STATS *sp) {
+    pthread_mutex_lock(&wal.mutex);
+    *sp = wal.stats;
+    pthread_mutex_unlock(&wal.mutex);
+}
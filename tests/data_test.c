@@ -3,9 +3,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
 
 #include "debug.h"
 #include "data.h"
+#include "data_funcs.h"
 #include "transaction.h"
 #include "excludes.h"
 
@@ -208,3 +210,100 @@ Test(data_suite, many_threads_ref_unref_blob, .init = init, .timeout = 10) {
     // Check final reference count.
     cr_assert_eq(bp->refcnt, 1, "Final blob refcount is %d, not 1", bp->refcnt);
 }
+
+/*
+ * Content with embedded null bytes is kept intact and followed by a null
+ * byte, and the debugging prefix is bounded.
+ */
+Test(data_suite, blob_layout_test, .init = init, .timeout = 5) {
+#ifdef NO_DATA
+    cr_assert_fail("Data module was not implemented");
+#endif
+    char content[3 * BLOB_PREFIX_MAX];
+    for(int i = 0; i < sizeof(content); i++)
+	content[i] = i % 8 ? 'A' + i % 26 : '\0';
+    BLOB *bp = blob_create(content, sizeof(content));
+    cr_assert_eq(memcmp(bp->content, content, sizeof(content)), 0, "Content was incorrect");
+    cr_assert_eq(bp->content[sizeof(content)], '\0', "Content was not null-terminated");
+    cr_assert(strlen(blob_prefix(bp)) <= BLOB_PREFIX_MAX + 3, "Prefix was too long");
+    blob_unref(bp, "");
+    bp = blob_create("", 0);
+    cr_assert_eq(bp->size, 0, "Expected size 0, was %lu", bp->size);
+    cr_assert_eq(bp->content[0], '\0', "Content was not null-terminated");
+    blob_unref(bp, "");
+}
+
+Test(data_suite, blob_alloc_test, .init = init, .timeout = 5) {
+#ifdef NO_DATA
+    cr_assert_fail("Data module was not implemented");
+#endif
+    char content[] = "filled in\0later";
+    BLOB *bp = blob_alloc(sizeof(content));
+    cr_assert_eq(bp->size, sizeof(content), "Size was incorrect");
+    cr_assert_eq(bp->content[sizeof(content)], '\0', "Content was not null-terminated");
+    memcpy(bp->content, content, sizeof(content));
+    BLOB *cp = blob_create(content, sizeof(content));
+    cr_assert(blob_compare(bp, cp) == 0, "Blobs were not equal");
+    cr_assert_eq(blob_hash(bp), blob_hash(cp), "Hashes were not equal");
+    blob_unref(bp, "");
+    blob_unref(cp, "");
+}
+
+/*
+ * Keys are compared over their whole size, so binary keys with embedded
+ * null bytes are told apart, and equal keys hash the same every time.
+ */
+Test(data_suite, binary_key_test, .init = init, .timeout = 5) {
+#ifdef NO_DATA
+    cr_assert_fail("Data module was not implemented");
+#endif
+    KEY *kp1 = key_create(blob_create("a\0b", 3));
+    KEY *kp2 = key_create(blob_create("a\0c", 3));
+    KEY *kp3 = key_create(blob_create("a\0b", 3));
+    KEY *kp4 = key_create(blob_create("a\0b\0", 4));
+    cr_assert_neq(key_compare(kp1, kp2), 0, "Keys differing after a null byte compared equal");
+    cr_assert_neq(key_compare(kp1, kp4), 0, "Keys of different sizes compared equal");
+    cr_assert_eq(key_compare(kp1, kp3), 0, "Equal keys compared unequal");
+    cr_assert_eq(kp1->hash, kp3->hash, "Equal keys hashed differently");
+    cr_assert_eq(blob_hash(kp1->blob), kp1->hash, "Hash was not stable");
+    cr_assert_eq(memcmp(kp1->blob->content, "a\0b", 3), 0, "Hashing changed the content");
+}
+
+/*
+ * Keys that differ only in a counter spread evenly over the buckets, with a
+ * chi-square over 1024 buckets near the 1023 of a uniform hash, and flipping
+ * any one input bit changes about half of the 64 output bits.
+ */
+Test(data_suite, hash_quality_test, .init = init, .timeout = 5) {
+#ifdef NO_DATA
+    cr_assert_fail("Data module was not implemented");
+#endif
+    size_t lens[] = { 8, 16, 64, 256 };
+    char buf[256];
+    int nkeys = 1 << 16;
+    for(int l = 0; l < 4; l++) {
+	size_t len = lens[l];
+	memset(buf, 'k', len);
+	static int buckets[1024];
+	memset(buckets, 0, sizeof(buckets));
+	for(int i = 0; i < nkeys; i++) {
+	    memcpy(buf + len - 2, &i, 2);
+	    buckets[hash_bytes(buf, len, BLOB_HASH_SEED) & 1023]++;
+	}
+	double expected = nkeys / 1024.0, chi2 = 0;
+	for(int b = 0; b < 1024; b++)
+	    chi2 += (buckets[b] - expected) * (buckets[b] - expected) / expected;
+	cr_assert(chi2 < 1250, "Chi-square for %lu-byte keys was %.1f", len, chi2);
+	long flips = 0, trials = 0;
+	for(size_t bit = 0; bit < 8 * len; bit++) {
+	    uint64_t h1 = hash_bytes(buf, len, BLOB_HASH_SEED);
+	    buf[bit / 8] ^= 1 << (bit % 8);
+	    uint64_t h2 = hash_bytes(buf, len, BLOB_HASH_SEED);
+	    buf[bit / 8] ^= 1 << (bit % 8);
+	    flips += __builtin_popcountll(h1 ^ h2);
+	    trials++;
+	}
+	double avg = (double)flips / trials;
+	cr_assert(avg > 30 && avg < 34, "%.1f bits flipped on average for %lu-byte keys", avg, len);
+    }
+}
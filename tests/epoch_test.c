@@ -0,0 +1,91 @@
+#include <criterion/criterion.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "epoch.h"
+
+/* Number of threads we create in multithreaded tests. */
+#define NTHREAD (10)
+
+/* Number of iterations we use in several tests. */
+#define NITER (100000)
+
+static volatile int freed;
+
+static void count_free(void *ptr) {
+    __atomic_add_fetch(&freed, 1, __ATOMIC_RELAXED);
+    free(ptr);
+}
+
+static void init() {
+    freed = 0;
+}
+
+/*
+ * Thread that stays inside a critical section until told to leave.
+ */
+struct reader_args {
+    volatile int entered;
+    volatile int leave;
+};
+
+static void *reader_thread(void *arg) {
+    struct reader_args *ap = arg;
+    epoch_enter();
+    ap->entered = 1;
+    while(!ap->leave)
+	usleep(1000);
+    epoch_exit();
+    return NULL;
+}
+
+static void *barrier_thread(void *arg) {
+    epoch_barrier();
+    *(volatile int *)arg = 1;
+    return NULL;
+}
+
+Test(epoch_suite, retire_waits_for_reader, .init = init, .timeout = 5) {
+    struct reader_args args = { 0, 0 };
+    pthread_t tid;
+    pthread_create(&tid, NULL, reader_thread, &args);
+    while(!args.entered)
+	usleep(1000);
+    epoch_retire(malloc(16), count_free);
+    // The barrier cannot complete while the reader is in its critical section.
+    volatile int done = 0;
+    pthread_t btid;
+    pthread_create(&btid, NULL, barrier_thread, (void *)&done);
+    sleep(1);
+    cr_assert_eq(freed, 0, "Object was freed while a reader could see it");
+    args.leave = 1;
+    pthread_join(tid, NULL);
+    epoch_barrier();
+    cr_assert_eq(freed, 1, "Object was not freed after the reader left");
+    pthread_join(btid, NULL);
+}
+
+static void *retire_thread(void *arg) {
+    for(int i = 0; i < NITER; i++) {
+	epoch_enter();
+	epoch_retire(malloc(16), count_free);
+	epoch_exit();
+    }
+    return NULL;
+}
+
+Test(epoch_suite, many_threads_retire, .init = init, .timeout = 10) {
+    pthread_t tid[NTHREAD];
+    for(int i = 0; i < NTHREAD; i++)
+	pthread_create(&tid[i], NULL, retire_thread, NULL);
+    for(int i = 0; i < NTHREAD; i++)
+	pthread_join(tid[i], NULL);
+    // Exited threads leave their pending objects behind for others to free.
+    cr_assert(freed > 0, "Nothing was freed while threads were running");
+    epoch_fini();
+    cr_assert_eq(freed, NTHREAD * NITER, "Freed %d objects, expected %d",
+		 freed, NTHREAD * NITER);
+}
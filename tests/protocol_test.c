@@ -3,8 +3,10 @@
 #include <unistd.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <sys/socket.h>
 
 #include "protocol.h"
+#include "protocol_funcs.h"
 #include "transaction.h"
 #include "excludes.h"
 
@@ -246,3 +248,128 @@ Test(protocol_suite, recv_error, .init = init, .timeout = 5) {
     int ret = proto_recv_packet(fd, &pkt, &payload);
     cr_assert_eq(ret, -1, "Returned value was not -1");
 }
+
+/*
+ * Packets sent through a buffered connection arrive as proto_recv_packet()
+ * would expect, including payloads too big for the buffer, and packets
+ * sent by proto_send_packet() are received intact through one.
+ */
+Test(protocol_suite, conn_round_trip, .init = init, .timeout = 5) {
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "Failed to create socket pair");
+    size_t sizes[] = { 0, 15, 5000, 20000 };
+    int n = sizeof(sizes) / sizeof(sizes[0]);
+    char *big = malloc(20000);
+    for(int i = 0; i < 20000; i++)
+	big[i] = i % 251;
+    XACTO_CONN *cp = malloc(sizeof(XACTO_CONN));
+    proto_conn_init(cp, sv[0]);
+    for(int i = 0; i < n; i++) {
+	XACTO_PACKET pkt;
+	proto_init_packet(&pkt, XACTO_DATA_PKT, sizes[i]);
+	pkt.null = sizes[i] == 0;
+	cr_assert_eq(proto_conn_send(cp, &pkt, sizes[i] ? big : NULL), 0, "Send failed");
+    }
+    cr_assert_eq(proto_conn_flush(cp), 0, "Flush failed");
+    for(int i = 0; i < n; i++) {
+	XACTO_PACKET pkt;
+	void *payload = NULL;
+	cr_assert_eq(proto_recv_packet(sv[1], &pkt, &payload), 0, "Receive failed");
+	cr_assert_eq(pkt.type, XACTO_DATA_PKT, "Wrong type");
+	cr_assert_eq(pkt.null, sizes[i] == 0, "Wrong null flag");
+	cr_assert_eq(pkt.size, sizes[i], "Wrong size");
+	if(sizes[i])
+	    cr_assert(!memcmp(payload, big, sizes[i]), "Wrong payload");
+	free(payload);
+    }
+    for(int i = n - 1; i >= 0; i--) {
+	XACTO_PACKET pkt = {0};
+	pkt.type = XACTO_REPLY_PKT;
+	pkt.size = sizes[i];
+	cr_assert_eq(proto_send_packet(sv[1], &pkt, big), 0, "Send failed");
+    }
+    for(int i = n - 1; i >= 0; i--) {
+	XACTO_PACKET pkt;
+	void *payload = NULL;
+	cr_assert_eq(proto_conn_recv(cp, &pkt, &payload), 0, "Receive failed");
+	cr_assert_eq(pkt.type, XACTO_REPLY_PKT, "Wrong type");
+	cr_assert_eq(pkt.size, sizes[i], "Wrong size");
+	if(sizes[i])
+	    cr_assert(!memcmp(payload, big, sizes[i]), "Wrong payload");
+	free(payload);
+    }
+    cr_assert(!proto_conn_pending(cp), "Input left over");
+    close(sv[1]);
+    XACTO_PACKET pkt;
+    void *payload = NULL;
+    cr_assert_eq(proto_conn_recv(cp, &pkt, &payload), -1, "Expected EOF");
+    close(sv[0]);
+    proto_conn_fini(cp);
+    free(cp);
+    free(big);
+}
+
+/*
+ * A request is only complete once the DATA packets that go with it have
+ * all arrived.
+ */
+Test(protocol_suite, request_length, .init = init, .timeout = 5) {
+    XACTO_PACKET pkts[3] = {
+	{ .type = XACTO_PUT_PKT },
+	{ .type = XACTO_DATA_PKT, .size = htonl(3) },
+	{ .type = XACTO_DATA_PKT, .size = htonl(0), .null = 1 },
+    };
+    char buf[3 * sizeof(XACTO_PACKET) + 3 + sizeof(XACTO_PACKET)];
+    size_t len = 0;
+    memcpy(buf, &pkts[0], sizeof(XACTO_PACKET));
+    len += sizeof(XACTO_PACKET);
+    memcpy(buf + len, &pkts[1], sizeof(XACTO_PACKET));
+    len += sizeof(XACTO_PACKET);
+    memcpy(buf + len, "abc", 3);
+    len += 3;
+    memcpy(buf + len, &pkts[2], sizeof(XACTO_PACKET));
+    len += sizeof(XACTO_PACKET);
+    XACTO_PACKET commit = { .type = XACTO_COMMIT_PKT };
+    memcpy(buf + len, &commit, sizeof(XACTO_PACKET));
+    size_t put_len = len;
+    for(size_t n = 0; n < put_len; n++)
+	cr_assert_eq(proto_request_length(buf, n, 3), 0, "Request of %lu bytes was complete", n);
+    cr_assert_eq(proto_request_length(buf, put_len, 3), put_len, "PUT was not complete");
+    cr_assert_eq(proto_request_length(buf, sizeof(buf), 3), put_len, "PUT had the wrong length");
+    cr_assert_eq(proto_request_length(buf + put_len, sizeof(XACTO_PACKET), 3),
+		 sizeof(XACTO_PACKET), "COMMIT was not complete");
+    // A payload over the limit is refused as soon as its header is in.
+    for(size_t n = 2 * sizeof(XACTO_PACKET); n <= put_len; n++)
+	cr_assert_eq(proto_request_length(buf, n, 2), XACTO_TOO_LARGE,
+		     "Request of %lu bytes with a payload over the limit was accepted", n);
+    cr_assert_eq(proto_request_length(buf, sizeof(XACTO_PACKET), 2), 0,
+		 "Request was refused before the large packet arrived");
+}
+
+/*
+ * A connection refuses a packet whose header declares a payload over its
+ * limit, without waiting for the payload.
+ */
+Test(protocol_suite, conn_packet_max, .init = init, .timeout = 5) {
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "Failed to create socket pair");
+    XACTO_CONN *cp = malloc(sizeof(XACTO_CONN));
+    proto_conn_init(cp, sv[0]);
+    proto_conn_set_packet_max(cp, 100);
+    char buf[100] = { 0 };
+    XACTO_PACKET pkt = { .type = XACTO_DATA_PKT, .size = sizeof(buf) };
+    cr_assert_eq(proto_send_packet(sv[1], &pkt, buf), 0, "Send failed");
+    void *payload = NULL;
+    cr_assert_eq(proto_conn_recv(cp, &pkt, &payload), 0, "Packet at the limit was refused");
+    cr_assert_eq(pkt.size, sizeof(buf), "Wrong size");
+    free(payload);
+    pkt = (XACTO_PACKET){ .type = XACTO_DATA_PKT, .size = htonl(1 << 30) };
+    cr_assert_eq(write(sv[1], &pkt, sizeof(pkt)), sizeof(pkt), "Write failed");
+    payload = NULL;
+    cr_assert_eq(proto_conn_recv(cp, &pkt, &payload), -1, "Packet over the limit was accepted");
+    cr_assert_null(payload, "Payload left to free");
+    close(sv[1]);
+    close(sv[0]);
+    proto_conn_fini(cp);
+    free(cp);
+}
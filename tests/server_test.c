@@ -436,3 +436,67 @@ Test(server_suite, 05_bank_simulation, .init = init, .fini = fini, .timeout = 30
 		 "Funds were not conserved (expected: %d, was: %d)",
 		 NUM_ACCOUNTS * INITIAL_FUNDS, total);
 }
+
+/*
+ * An MGET whose reply would be larger than a packet the server accepts
+ * aborts, rather than have the server make the reply, and the server goes
+ * on serving other clients.
+ */
+#define BIG_VALUE_SIZE (1 << 20)
+
+Test(server_suite, 06_oversized_mget, .init = init, .fini = fini, .timeout = 30) {
+    int sfd;
+    XACTO_PACKET pkt;
+    void *payload = NULL;
+
+    if(get_server_address())
+	abort();
+
+    char *value = malloc(BIG_VALUE_SIZE + 1);
+    memset(value, 'x', BIG_VALUE_SIZE);
+    value[BIG_VALUE_SIZE] = '\0';
+    sfd = proto_connect();
+    cr_assert_neq(sfd, -1, "Connection to server failed");
+    req_put(sfd, "big", value);
+    EXPECT_REPLY(sfd, &pkt);
+    req_commit(sfd);
+    EXPECT_REPLY(sfd, &pkt);
+    close(sfd);
+    free(value);
+    cr_assert_eq(pkt.status, TRANS_COMMITTED, "PUT of the large value did not commit");
+
+    // The same key, as many times as a batch may hold.
+    size_t item = sizeof(uint32_t) + 3;
+    size_t size = sizeof(uint32_t) + XACTO_BATCH_MAX * item;
+    char *batch = malloc(size), *p = batch;
+    uint32_t word = htonl(XACTO_BATCH_MAX);
+    memcpy(p, &word, sizeof(word));
+    p += sizeof(word);
+    for(int i = 0; i < XACTO_BATCH_MAX; i++) {
+	word = htonl(3);
+	memcpy(p, &word, sizeof(word));
+	memcpy(p + sizeof(word), "big", 3);
+	p += item;
+    }
+    sfd = proto_connect();
+    cr_assert_neq(sfd, -1, "Connection to server failed");
+    proto_init_packet(&pkt, XACTO_MGET_PKT, size);
+    cr_assert_eq(proto_send_packet(sfd, &pkt, batch), 0, "Send MGET failed");
+    free(batch);
+    cr_assert_eq(proto_recv_packet(sfd, &pkt, &payload), 0, "Receive reply failed");
+    cr_assert_eq(pkt.type, XACTO_REPLY_PKT, "Expected a REPLY packet");
+    cr_assert_eq(pkt.status, TRANS_ABORTED, "Oversized MGET did not abort");
+    cr_assert_eq(pkt.size, XACTO_BATCH_MAX * (1 + sizeof(uint32_t)),
+		 "Reply of the wrong size (%u)", pkt.size);
+    free(payload);
+    close(sfd);
+
+    sfd = proto_connect();
+    cr_assert_neq(sfd, -1, "Server did not survive the oversized MGET");
+    req_put(sfd, "small", "1");
+    EXPECT_REPLY(sfd, &pkt);
+    req_commit(sfd);
+    EXPECT_REPLY(sfd, &pkt);
+    close(sfd);
+    cr_assert_eq(pkt.status, TRANS_COMMITTED, "Transaction after the oversized MGET did not commit");
+}
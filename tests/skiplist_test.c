@@ -0,0 +1,124 @@
+#include <criterion/criterion.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "skiplist.h"
+#include "epoch.h"
+#include "excludes.h"
+
+/* Number of entries we use in the tests. */
+#define NENTRIES (1000)
+
+/* Number of reader threads in the concurrent test. */
+#define NTHREAD (4)
+
+static SKIPLIST sl;
+static MAP_ENTRY entries[NENTRIES];
+
+static void init() {
+    char content[20];
+    skiplist_init(&sl);
+    for(int i = 0; i < NENTRIES; i++) {
+	snprintf(content, sizeof(content), "%06d", i);
+	entries[i].key = key_create(blob_create(content, strlen(content)));
+	entries[i].versions = NULL;
+	entries[i].next = NULL;
+    }
+}
+
+static void fini() {
+    skiplist_fini(&sl);
+    epoch_fini();
+    for(int i = 0; i < NENTRIES; i++)
+	key_dispose(entries[i].key);
+}
+
+/*
+ * Insert entries in a scrambled order and check that ranges come back sorted.
+ */
+Test(skiplist_suite, insert_range, .init = init, .fini = fini, .timeout = 5) {
+    for(int i = 0; i < NENTRIES; i++)
+	skiplist_insert(&sl, &entries[(i * 7919) % NENTRIES]);
+    cr_assert_eq(sl.count, NENTRIES, "Wrong count %d", sl.count);
+    BLOB *keys[NENTRIES];
+    int n = skiplist_range(&sl, NULL, 0, NULL, keys, NENTRIES);
+    cr_assert_eq(n, NENTRIES, "Wrong number of keys %d", n);
+    for(int i = 0; i < n; i++) {
+	cr_assert_eq(keys[i], entries[i].key->blob, "Key %d out of order", i);
+	blob_unref(keys[i], "");
+    }
+    n = skiplist_range(&sl, entries[10].key->blob, 1, entries[20].key->blob, keys, NENTRIES);
+    cr_assert_eq(n, 9, "Wrong number of keys %d", n);
+    cr_assert_eq(keys[0], entries[11].key->blob, "Wrong first key");
+    for(int i = 0; i < n; i++)
+	blob_unref(keys[i], "");
+    n = skiplist_range(&sl, entries[10].key->blob, 0, NULL, keys, 5);
+    cr_assert_eq(n, 5, "Wrong number of keys %d", n);
+    cr_assert_eq(keys[0], entries[10].key->blob, "Wrong first key");
+    for(int i = 0; i < n; i++)
+	blob_unref(keys[i], "");
+}
+
+/*
+ * Remove every other entry and check what is left.
+ */
+Test(skiplist_suite, remove, .init = init, .fini = fini, .timeout = 5) {
+    for(int i = 0; i < NENTRIES; i++)
+	skiplist_insert(&sl, &entries[i]);
+    for(int i = 0; i < NENTRIES; i += 2)
+	skiplist_remove(&sl, &entries[i]);
+    skiplist_remove(&sl, &entries[0]);
+    cr_assert_eq(sl.count, NENTRIES / 2, "Wrong count %d", sl.count);
+    BLOB *keys[NENTRIES];
+    int n = skiplist_range(&sl, NULL, 0, NULL, keys, NENTRIES);
+    cr_assert_eq(n, NENTRIES / 2, "Wrong number of keys %d", n);
+    for(int i = 0; i < n; i++) {
+	cr_assert_eq(keys[i], entries[2 * i + 1].key->blob, "Wrong key at %d", i);
+	blob_unref(keys[i], "");
+    }
+}
+
+/*
+ * Readers scan the list while a writer keeps removing and reinserting
+ * the even entries.  The odd entries must always be seen, in order.
+ */
+static volatile int stop;
+
+static void *reader_thread(void *arg) {
+    BLOB *keys[NENTRIES];
+    while(!stop) {
+	int n = skiplist_range(&sl, NULL, 0, NULL, keys, NENTRIES);
+	int odd = 0;
+	for(int i = 0; i < n; i++) {
+	    if(i > 0)
+		cr_assert(skiplist_compare(keys[i - 1], keys[i]) < 0, "Keys out of order");
+	    if(atoi(keys[i]->content) % 2)
+		odd++;
+	    blob_unref(keys[i], "");
+	}
+	cr_assert_eq(odd, NENTRIES / 2, "Missed odd entries (saw %d)", odd);
+    }
+    return NULL;
+}
+
+Test(skiplist_suite, concurrent_readers, .init = init, .fini = fini, .timeout = 10) {
+    pthread_t tids[NTHREAD];
+    for(int i = 0; i < NENTRIES; i++)
+	skiplist_insert(&sl, &entries[i]);
+    stop = 0;
+    for(int i = 0; i < NTHREAD; i++)
+	pthread_create(&tids[i], NULL, reader_thread, NULL);
+    for(int round = 0; round < 50; round++) {
+	for(int i = 0; i < NENTRIES; i += 2)
+	    skiplist_remove(&sl, &entries[i]);
+	for(int i = 0; i < NENTRIES; i += 2)
+	    skiplist_insert(&sl, &entries[i]);
+    }
+    stop = 1;
+    for(int i = 0; i < NTHREAD; i++)
+	pthread_join(tids[i], NULL);
+    epoch_barrier();
+}
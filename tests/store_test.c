@@ -2,10 +2,12 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "debug.h"
 #include "store.h"
+#include "store_funcs.h"
 #include "excludes.h"
 
 /* Number of keys we use in some tests. */
@@ -24,7 +26,8 @@
  * Get the list of versions for a key.
  */
 static VERSION *get_versions_for_key(KEY *kp) {
-    for(int i = 0; i < NUM_BUCKETS; i++) {
+    store_rehash_finish();
+    for(int i = 0; i < the_map.num_buckets; i++) {
 	for(MAP_ENTRY *ep = the_map.table[i]; ep != NULL; ep = ep->next) {
 	    if(!key_compare(kp, ep->key))
 		return(ep->versions);
@@ -54,7 +57,8 @@ static void assert_number_of_versions(KEY *kp, int exp) {
  */
 static void assert_key_present(KEY *kp) {
     int n = 0;
-    for(int i = 0; i < NUM_BUCKETS; i++) {
+    store_rehash_finish();
+    for(int i = 0; i < the_map.num_buckets; i++) {
 	for(MAP_ENTRY *ep = the_map.table[i]; ep != NULL; ep = ep->next) {
 	    if(!key_compare(kp, ep->key))
 		n++;
@@ -69,7 +73,8 @@ static void assert_key_present(KEY *kp) {
  */
 static void assert_key_absent(KEY *kp) {
     int n = 0;
-    for(int i = 0; i < NUM_BUCKETS; i++) {
+    store_rehash_finish();
+    for(int i = 0; i < the_map.num_buckets; i++) {
 	for(MAP_ENTRY *ep = the_map.table[i]; ep != NULL; ep = ep->next) {
 	    if(!key_compare(kp, ep->key))
 		n++;
@@ -83,7 +88,8 @@ static void assert_key_absent(KEY *kp) {
  */
 static void assert_number_of_keys(int exp) {
     int n = 0;
-    for(int i = 0; i < NUM_BUCKETS; i++) {
+    store_rehash_finish();
+    for(int i = 0; i < the_map.num_buckets; i++) {
 	for(MAP_ENTRY *ep = the_map.table[i]; ep != NULL; ep = ep->next)
 	    n++;
     }
@@ -285,6 +291,95 @@ Test(store_suite, collisions, .init = init, .timeout = 5) {
     }
 }
 
+/*
+ * Put enough keys in the table to force it to grow, checking that every
+ * key is still reachable while the rehash is in progress and after it
+ * has finished.
+ */
+Test(store_suite, resize_grow, .init = init, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    char content[10];
+    TRANSACTION *tp = trans_create();
+    BLOB *blobs[NKEYS];
+    for(int i = 0; i < NKEYS; i++) {
+	snprintf(content, 10, "%8d", i);
+	blobs[i] = blob_create(content, 8);
+	store_put(tp, make_key(content, 8), blobs[i]);
+    }
+    STORE_STATS stats;
+    store_get_stats(&stats);
+    cr_assert_eq(stats.num_entries, NKEYS, "Wrong number of entries %d", stats.num_entries);
+    cr_assert(stats.num_buckets > NUM_BUCKETS, "Table did not grow (%d buckets)",
+	      stats.num_buckets);
+    cr_assert(stats.num_entries <= 2 * STORE_MAX_LOAD * stats.num_buckets,
+	      "Load factor too high (%d entries, %d buckets)", stats.num_entries, stats.num_buckets);
+    for(int i = 0; i < NKEYS; i++) {
+	snprintf(content, 10, "%8d", i);
+	BLOB *value = NULL;
+	store_get(tp, make_key(content, 8), &value);
+	cr_assert_eq(value, blobs[i], "Wrong blob returned");
+    }
+    store_rehash_finish();
+    store_get_stats(&stats);
+    cr_assert_eq(stats.old_num_buckets, 0, "Rehash did not finish");
+    assert_number_of_keys(NKEYS);
+}
+
+/*
+ * Check that a pre-sized store starts with the requested (rounded) size
+ * and does not resize for a number of keys it can hold.
+ */
+Test(store_suite, resize_presized, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    trans_init();
+    store_init_buckets(100);
+    cr_assert_eq(the_map.num_buckets, 128, "Number of buckets %d is incorrect",
+		 the_map.num_buckets);
+    char content[10];
+    TRANSACTION *tp = trans_create();
+    for(int i = 0; i < NKEYS; i++) {
+	snprintf(content, 10, "%8d", i);
+	store_put(tp, make_key(content, 8), blob_create(content, 8));
+    }
+    STORE_STATS stats;
+    store_get_stats(&stats);
+    cr_assert_eq(stats.resizes, 0, "Pre-sized table was resized %lu times", stats.resizes);
+    cr_assert_eq(stats.num_buckets, 128, "Number of buckets %d is incorrect", stats.num_buckets);
+}
+
+/*
+ * Check that store_get_committed sees only committed values, and
+ * leaves the version list alone.
+ */
+Test(store_suite, get_committed, .init = init, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    char content[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    cr_assert_null(store_get_committed(make_key(content, 26)),
+		   "Value returned for absent key");
+    TRANSACTION *tp1 = trans_create();
+    BLOB *bp1 = blob_create(content, 26);
+    store_put(tp1, make_key(content, 26), bp1);
+    cr_assert_null(store_get_committed(make_key(content, 26)),
+		   "Value returned before creator committed");
+    trans_commit(tp1);
+    TRANSACTION *tp2 = trans_create();
+    store_put(tp2, make_key(content, 26), blob_create(content, 25));
+    BLOB *value = store_get_committed(make_key(content, 26));
+    cr_assert_eq(value, bp1, "Wrong value returned, was %p, expected %p", value, bp1);
+    blob_unref(value, "");
+    KEY *kp = make_key(content, 26);
+    assert_number_of_versions(kp, 2);
+    trans_abort(tp2);
+    value = store_get_committed(make_key(content, 26));
+    cr_assert_eq(value, bp1, "Wrong value returned, was %p, expected %p", value, bp1);
+}
+
 /*
  * Put the same key in the map several times, with different transactions,
  * verify the number of versions, etc.,
@@ -349,6 +444,108 @@ Test(store_suite, multi_trans_forward_gc, .init = init, .timeout = 5) {
     assert_number_of_versions(kp, 2);
 }
 
+/*
+ * Commit a short run of values for the same key, one transaction at a time,
+ * and check that superseded versions are left for the collector until the
+ * list grows past the threshold, and that a sweep then removes them.
+ */
+Test(store_suite, gc_threshold, .init = init, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    char *key = "KEY";
+    char content[10];
+    for(int i = 0; i < STORE_GC_THRESHOLD; i++) {
+	snprintf(content, 10, "%8d", i);
+	TRANSACTION *tp = trans_create();
+	store_put(tp, make_key(key, 3), blob_create(content, 8));
+	trans_commit(tp);
+    }
+    KEY *kp = make_key(key, 3);
+    assert_number_of_versions(kp, STORE_GC_THRESHOLD);
+    store_gc_sweep(the_map.num_buckets);
+    assert_number_of_versions(kp, 1);
+    STORE_GC_STATS stats;
+    store_gc_get_stats(&stats);
+    cr_assert_eq(stats.versions_reclaimed, STORE_GC_THRESHOLD - 1,
+		 "Wrong number of versions reclaimed, was %lu, expected %d",
+		 stats.versions_reclaimed, STORE_GC_THRESHOLD - 1);
+    cr_assert_eq(stats.sweeps, 1, "Wrong number of sweeps, was %lu, expected 1", stats.sweeps);
+    BLOB *value = store_get_committed(make_key(key, 3));
+    cr_assert_not_null(value, "No value for key after sweep");
+    cr_assert(!memcmp(value->content, content, 8), "Wrong value for key after sweep");
+    blob_unref(value, "");
+}
+
+/*
+ * Delete a key and check that a sweep removes its map entry,
+ * but not while a transaction older than the deletion is pending.
+ */
+Test(store_suite, gc_deleted_entry, .init = init, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    char *key = "KEY";
+    TRANSACTION *tp = trans_create();
+    store_put(tp, make_key(key, 3), blob_create("VALUE", 5));
+    trans_commit(tp);
+    TRANSACTION *old = trans_create();
+    tp = trans_create();
+    store_put(tp, make_key(key, 3), NULL);
+    trans_commit(tp);
+    KEY *kp = make_key(key, 3);
+    store_gc_sweep(the_map.num_buckets);
+    assert_key_present(kp);
+    // A snapshot taken now would still read the value before the deletion.
+    assert_number_of_versions(kp, 2);
+    BLOB *value;
+    TRANS_STATUS st = store_get(old, make_key(key, 3), &value);
+    cr_assert_eq(st, TRANS_ABORTED, "Older transaction should have aborted, but did not");
+    trans_abort(old);
+    store_gc_sweep(the_map.num_buckets);
+    assert_key_absent(kp);
+    assert_number_of_keys(0);
+    STORE_GC_STATS stats;
+    store_gc_get_stats(&stats);
+    cr_assert_eq(stats.entries_reclaimed, 1, "Wrong number of entries reclaimed, was %lu, expected 1",
+		 stats.entries_reclaimed);
+}
+
+/*
+ * Run the background collector while keys are written and deleted,
+ * and check that it cleans up after them.
+ */
+Test(store_suite, gc_thread, .init = init, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    char content[10];
+    store_gc_start(16, 1);
+    for(int i = 0; i < NKEYS; i++) {
+	snprintf(content, 10, "%8d", i);
+	TRANSACTION *tp = trans_create();
+	store_put(tp, make_key(content, 8), blob_create(content, 8));
+	trans_commit(tp);
+	tp = trans_create();
+	store_put(tp, make_key(content, 8), NULL);
+	trans_commit(tp);
+    }
+    STORE_GC_STATS stats;
+    store_gc_get_stats(&stats);
+    unsigned long sweeps = stats.sweeps;
+    while(stats.sweeps < sweeps + 2) {
+	usleep(1000);
+	store_gc_get_stats(&stats);
+    }
+    cr_assert(stats.running, "Collector is not running");
+    store_gc_stop();
+    store_gc_get_stats(&stats);
+    cr_assert(!stats.running, "Collector is still running");
+    cr_assert_eq(stats.entries_reclaimed, NKEYS, "Wrong number of entries reclaimed, was %lu, expected %d",
+		 stats.entries_reclaimed, NKEYS);
+    assert_number_of_keys(0);
+}
+
 /*
  * Thread that attempts to commit a transaction, then set a done flag.
  */
@@ -504,3 +701,502 @@ Test(store_suite, stress_test, .init = init, .timeout = 5) {
     }
     cr_assert_eq(num_committed, 0, "Something was wrong with the 'read-from' relation"); 
 }
+
+static void init_flat() {
+    trans_init();
+    store_init_index(STORE_INDEX_FLAT, NUM_BUCKETS);
+}
+
+/*
+ * Put enough keys in a store with a flat index to make it grow several times,
+ * and check that they can all be read back, in and out of transactions.
+ */
+Test(store_suite, flat_put_get, .init = init_flat, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    char content[20];
+    int nkeys = 50 * NKEYS;
+    TRANSACTION *tp = trans_create();
+    for(int i = 0; i < nkeys; i++) {
+	snprintf(content, sizeof(content), "%6d", i);
+	store_put(tp, make_key(content, strlen(content)), blob_create(content, strlen(content)));
+    }
+    trans_commit(tp);
+    STORE_STATS stats;
+    store_get_stats(&stats);
+    cr_assert_eq(stats.index, STORE_INDEX_FLAT, "Store is not using a flat index");
+    cr_assert_eq(stats.num_entries, nkeys, "Wrong number of entries, was %d, expected %d",
+		 stats.num_entries, nkeys);
+    cr_assert(stats.resizes > 0, "Flat index never grew");
+    cr_assert(stats.num_buckets >= nkeys, "Too few slots (%d) for %d keys", stats.num_buckets, nkeys);
+    tp = trans_create();
+    for(int i = 0; i < nkeys; i++) {
+	snprintf(content, sizeof(content), "%6d", i);
+	BLOB *value = store_get_committed(make_key(content, strlen(content)));
+	cr_assert_not_null(value, "No committed value for key [%s]", content);
+	cr_assert(!memcmp(value->content, content, strlen(content)), "Wrong value for key [%s]", content);
+	blob_unref(value, "");
+	TRANS_STATUS st = store_get(tp, make_key(content, strlen(content)), &value);
+	cr_assert_eq(st, TRANS_PENDING, "Get of key [%s] did not succeed", content);
+	cr_assert_not_null(value, "No value for key [%s]", content);
+	blob_unref(value, "");
+    }
+    snprintf(content, sizeof(content), "%6d", nkeys);
+    cr_assert_null(store_get_committed(make_key(content, strlen(content))),
+		   "Value returned for absent key");
+    trans_commit(tp);
+    store_get_stats(&stats);
+    cr_assert_eq(stats.num_entries, nkeys, "Wrong number of entries, was %d, expected %d",
+		 stats.num_entries, nkeys);
+}
+
+/*
+ * Delete all the keys in a store with a flat index, and check that
+ * the collector removes them and shrinks the index back down.
+ */
+Test(store_suite, flat_gc, .init = init_flat, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    char content[20];
+    int nkeys = 10 * NKEYS;
+    TRANSACTION *tp = trans_create();
+    for(int i = 0; i < nkeys; i++) {
+	snprintf(content, sizeof(content), "%6d", i);
+	store_put(tp, make_key(content, strlen(content)), blob_create(content, strlen(content)));
+    }
+    trans_commit(tp);
+    STORE_STATS stats;
+    store_get_stats(&stats);
+    int grown = stats.num_buckets;
+    tp = trans_create();
+    for(int i = 0; i < nkeys; i++) {
+	snprintf(content, sizeof(content), "%6d", i);
+	store_put(tp, make_key(content, strlen(content)), NULL);
+    }
+    trans_commit(tp);
+    for(int i = 0; i < 8; i++)
+	store_gc_sweep(grown);
+    store_get_stats(&stats);
+    cr_assert_eq(stats.num_entries, 0, "Wrong number of entries, was %d, expected 0",
+		 stats.num_entries);
+    cr_assert(stats.num_buckets < grown, "Flat index did not shrink from %d slots", grown);
+    snprintf(content, sizeof(content), "%6d", 0);
+    cr_assert_null(store_get_committed(make_key(content, strlen(content))),
+		   "Value returned for deleted key");
+}
+
+/*
+ * Function for scans: record the keys visited and check the values, and
+ * stop the scan once stop keys have been visited, if stop is not 0.
+ */
+struct scan_result {
+    int n;
+    int stop;
+    char keys[NKEYS][10];
+};
+
+static int scan_collect(BLOB *key, BLOB *value, void *arg) {
+    struct scan_result *rp = arg;
+    cr_assert(key->size < 10, "Key too long");
+    cr_assert(value->size == key->size && !memcmp(key->content, value->content, key->size),
+	      "Value does not match key");
+    memcpy(rp->keys[rp->n], key->content, key->size);
+    rp->keys[rp->n][key->size] = '\0';
+    rp->n++;
+    return rp->stop > 0 && rp->n == rp->stop;
+}
+
+/*
+ * Commit keys "k00" through "k19", each with itself as value, then delete
+ * one of them.
+ */
+static void scan_setup(void) {
+    char content[10];
+    TRANSACTION *tp = trans_create();
+    for(int i = 19; i >= 0; i--) {
+	snprintf(content, sizeof(content), "k%02d", i);
+	store_put(tp, make_key(content, 3), blob_create(content, 3));
+    }
+    trans_commit(tp);
+    tp = trans_create();
+    store_put(tp, make_key("k05", 3), NULL);
+    trans_commit(tp);
+}
+
+/*
+ * Scan ranges, with and without limits, and check that the right keys
+ * come back in order.
+ */
+Test(store_suite, scan_range, .init = init, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    static char *expected[] = { "k03", "k04", "k06", "k07", "k08", "k09" };
+    struct scan_result res = { 0 };
+    scan_setup();
+    TRANSACTION *tp = trans_create();
+    TRANS_STATUS st = store_scan(tp, make_key("k03", 3), make_key("k10", 3), 0, scan_collect, &res);
+    cr_assert_eq(st, TRANS_PENDING, "Scan did not succeed");
+    cr_assert_eq(res.n, 6, "Wrong number of keys scanned, was %d, expected 6", res.n);
+    for(int i = 0; i < 6; i++)
+	cr_assert(!strcmp(res.keys[i], expected[i]), "Wrong key at position %d", i);
+    res.n = 0;
+    st = store_scan(tp, NULL, NULL, 3, scan_collect, &res);
+    cr_assert_eq(st, TRANS_PENDING, "Scan did not succeed");
+    cr_assert_eq(res.n, 3, "Wrong number of keys scanned, was %d, expected 3", res.n);
+    cr_assert(!strcmp(res.keys[2], "k02"), "Wrong last key");
+    res.n = 0;
+    st = store_scan(tp, make_key("k1", 2), NULL, 0, scan_collect, &res);
+    cr_assert_eq(res.n, 10, "Wrong number of keys scanned, was %d, expected 10", res.n);
+    st = trans_commit(tp);
+    cr_assert_eq(st, TRANS_COMMITTED, "Scanning transaction did not commit");
+}
+
+/*
+ * A scan by one transaction must keep an older transaction from creating
+ * keys in the range it covered, but not beyond the point where a limit
+ * stopped it, and not for younger transactions.
+ */
+Test(store_suite, scan_phantom, .init = init, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    struct scan_result res = { 0 };
+    scan_setup();
+    TRANSACTION *old1 = trans_create();
+    TRANSACTION *old2 = trans_create();
+    TRANSACTION *scanner = trans_create();
+    TRANS_STATUS st = store_scan(scanner, make_key("k00", 3), make_key("k15", 3), 2,
+				 scan_collect, &res);
+    cr_assert_eq(st, TRANS_PENDING, "Scan did not succeed");
+    cr_assert_eq(res.n, 2, "Wrong number of keys scanned, was %d, expected 2", res.n);
+    st = store_put(old1, make_key("k00a", 4), blob_create("X", 1));
+    cr_assert_eq(st, TRANS_ABORTED, "Older transaction created a key in the scanned range");
+    st = store_put(old2, make_key("k01a", 4), blob_create("X", 1));
+    cr_assert_eq(st, TRANS_PENDING, "Older transaction blocked past the end of the scan");
+    TRANSACTION *young = trans_create();
+    st = store_put(young, make_key("k00b", 4), blob_create("X", 1));
+    cr_assert_eq(st, TRANS_PENDING, "Younger transaction blocked by scan");
+    trans_abort(old1);
+    cr_assert_eq(trans_commit(old2), TRANS_COMMITTED, "Older transaction did not commit");
+    cr_assert_eq(trans_commit(scanner), TRANS_COMMITTED, "Scanning transaction did not commit");
+    cr_assert_eq(trans_commit(young), TRANS_COMMITTED, "Younger transaction did not commit");
+}
+
+/*
+ * Likewise when the scan function stops the scan, rather than a limit.
+ */
+Test(store_suite, scan_phantom_stopped, .init = init, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    struct scan_result res = { .stop = 2 };
+    scan_setup();
+    TRANSACTION *old1 = trans_create();
+    TRANSACTION *old2 = trans_create();
+    TRANSACTION *scanner = trans_create();
+    TRANS_STATUS st = store_scan(scanner, make_key("k00", 3), make_key("k15", 3), 0,
+				 scan_collect, &res);
+    cr_assert_eq(st, TRANS_PENDING, "Scan did not succeed");
+    cr_assert_eq(res.n, 2, "Wrong number of keys scanned, was %d, expected 2", res.n);
+    st = store_put(old1, make_key("k00a", 4), blob_create("X", 1));
+    cr_assert_eq(st, TRANS_ABORTED, "Older transaction created a key in the scanned range");
+    st = store_put(old2, make_key("k01a", 4), blob_create("X", 1));
+    cr_assert_eq(st, TRANS_PENDING, "Older transaction blocked past where the scan stopped");
+    trans_abort(old1);
+    cr_assert_eq(trans_commit(old2), TRANS_COMMITTED, "Older transaction did not commit");
+    cr_assert_eq(trans_commit(scanner), TRANS_COMMITTED, "Scanning transaction did not commit");
+}
+
+/*
+ * The record of a scan's range, which holds a reference to its transaction,
+ * is dropped once the transaction aborts, or commits and no older one is
+ * pending, even if no new key is ever created afterwards.
+ */
+Test(store_suite, scan_range_pruned, .init = init, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    struct scan_result res = { 0 };
+    scan_setup();
+    TRANSACTION *old = trans_create();
+    TRANSACTION *committed = trans_create();
+    TRANSACTION *aborted = trans_create();
+    store_scan(committed, NULL, NULL, 0, scan_collect, &res);
+    res.n = 0;
+    store_scan(aborted, make_key("k00", 3), make_key("k05", 3), 0, scan_collect, &res);
+    STORE_GC_STATS stats;
+    store_gc_get_stats(&stats);
+    cr_assert_eq(stats.scan_ranges, 2, "Wrong number of scan ranges, was %d, expected 2",
+		 stats.scan_ranges);
+    cr_assert_eq(trans_commit(committed), TRANS_COMMITTED, "Scanning transaction did not commit");
+    trans_abort(aborted);
+    store_gc_sweep(1);
+    // The older transaction could still create a key in the committed scan's range.
+    store_gc_get_stats(&stats);
+    cr_assert_eq(stats.scan_ranges, 1, "Wrong number of scan ranges, was %d, expected 1",
+		 stats.scan_ranges);
+    trans_commit(old);
+    store_gc_sweep(1);
+    store_gc_get_stats(&stats);
+    cr_assert_eq(stats.scan_ranges, 0, "Wrong number of scan ranges, was %d, expected 0",
+		 stats.scan_ranges);
+}
+
+/*
+ * A snapshot sees the committed state as of its creation, whatever is
+ * committed or collected afterwards, and keeps the garbage collector
+ * from discarding the versions it needs until it is released.
+ */
+Test(store_suite, snapshot_read, .init = init, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    char content[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    TRANSACTION *tp1 = trans_create();
+    BLOB *bp1 = blob_create(content, 26);
+    store_put(tp1, make_key(content, 26), bp1);
+    TRANSACTION *pending = trans_create();
+    trans_commit(tp1);
+    TRANS_SNAPSHOT *ssp = trans_snapshot_create();
+    cr_assert_eq(ssp->id, pending->id, "Wrong snapshot ID, was %d, expected %d",
+		 ssp->id, pending->id);
+    for(int i = 0; i < 2 * STORE_GC_THRESHOLD; i++) {
+	TRANSACTION *tp = trans_create();
+	store_put(tp, make_key(content, 26), blob_create(content, i + 1));
+	trans_commit(tp);
+    }
+    store_gc_sweep(NUM_BUCKETS);
+    BLOB *value = store_get_snapshot(ssp, make_key(content, 26));
+    cr_assert_eq(value, bp1, "Wrong value returned, was %p, expected %p", value, bp1);
+    blob_unref(value, "");
+    cr_assert_null(store_get_snapshot(ssp, make_key("absent", 6)),
+		   "Value returned for absent key");
+    // Nothing can be discarded while the old transaction is pending.
+    KEY *kp = make_key(content, 26);
+    assert_number_of_versions(kp, 2 * STORE_GC_THRESHOLD + 1);
+    trans_abort(pending);
+    store_gc_sweep(NUM_BUCKETS);
+    // Versions after the one the snapshot reads are kept for later snapshots.
+    assert_number_of_versions(kp, 2 * STORE_GC_THRESHOLD + 1);
+    trans_snapshot_release(ssp);
+    store_gc_sweep(NUM_BUCKETS);
+    assert_number_of_versions(kp, 1);
+}
+
+/*
+ * A scan as of a snapshot sees neither keys created nor values changed
+ * after the snapshot was taken.
+ */
+Test(store_suite, snapshot_scan, .init = init, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    struct scan_result res = { 0 };
+    scan_setup();
+    TRANS_SNAPSHOT *ssp = trans_snapshot_create();
+    TRANSACTION *tp = trans_create();
+    store_put(tp, make_key("k00a", 4), blob_create("X", 1));
+    store_put(tp, make_key("k01", 3), NULL);
+    trans_commit(tp);
+    store_scan_snapshot(ssp, make_key("k00", 3), make_key("k03", 3), 0, scan_collect, &res);
+    cr_assert_eq(res.n, 3, "Wrong number of keys scanned, was %d, expected 3", res.n);
+    cr_assert(!strcmp(res.keys[1], "k01"), "Wrong key at position 1");
+    res.n = 0;
+    store_scan_snapshot(ssp, NULL, NULL, 2, scan_collect, &res);
+    cr_assert_eq(res.n, 2, "Wrong number of keys scanned, was %d, expected 2", res.n);
+    trans_snapshot_release(ssp);
+}
+
+/*
+ * Put and get a batch of keys, including a repeated key, and check that
+ * the values are the ones that separate calls would have produced.
+ */
+Test(store_suite, batch_put_get, .init = init, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    char content[10];
+    KEY *keys[NKEYS + 1];
+    BLOB *values[NKEYS + 1];
+    TRANS_STATUS statuses[NKEYS + 1];
+    for(int i = 0; i < NKEYS; i++) {
+	snprintf(content, sizeof(content), "k%03d", i);
+	keys[i] = make_key(content, 4);
+	values[i] = blob_create(content, 4);
+    }
+    keys[NKEYS] = make_key("k000", 4);
+    values[NKEYS] = blob_create("last", 4);
+    TRANSACTION *tp = trans_create();
+    TRANS_STATUS st = store_put_many(tp, NKEYS + 1, keys, values, statuses);
+    cr_assert_eq(st, TRANS_PENDING, "Batch put did not succeed");
+    for(int i = 0; i <= NKEYS; i++)
+	cr_assert_eq(statuses[i], TRANS_PENDING, "Wrong status for key %d", i);
+    assert_number_of_keys(NKEYS);
+    for(int i = 0; i < NKEYS; i++) {
+	snprintf(content, sizeof(content), "k%03d", NKEYS - 1 - i);
+	keys[i] = make_key(content, 4);
+    }
+    st = store_get_many(tp, NKEYS, keys, values, statuses);
+    cr_assert_eq(st, TRANS_PENDING, "Batch get did not succeed");
+    for(int i = 0; i < NKEYS; i++) {
+	snprintf(content, sizeof(content), "k%03d", NKEYS - 1 - i);
+	char *exp = i == NKEYS - 1 ? "last" : content;
+	cr_assert(values[i] != NULL && !memcmp(values[i]->content, exp, 4),
+		  "Wrong value for key %s", content);
+	blob_unref(values[i], "");
+    }
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "Transaction did not commit");
+}
+
+/*
+ * A conflict part way through a batch aborts the transaction, and the
+ * keys after it are not read.
+ */
+Test(store_suite, batch_abort, .init = init, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    TRANSACTION *old = trans_create();
+    TRANSACTION *tp = trans_create();
+    store_put(tp, make_key("B", 1), blob_create("X", 1));
+    KEY *keys[3] = { make_key("A", 1), make_key("B", 1), make_key("C", 1) };
+    BLOB *values[3];
+    TRANS_STATUS statuses[3];
+    TRANS_STATUS st = store_get_many(old, 3, keys, values, statuses);
+    cr_assert_eq(st, TRANS_ABORTED, "Batch with conflict did not abort");
+    cr_assert_eq(statuses[1], TRANS_ABORTED, "Conflicting key did not abort");
+    cr_assert_null(values[1], "Value returned for conflicting key");
+    trans_abort(old);
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "Transaction did not commit");
+}
+
+static void assert_blob_equals(BLOB *bp, char *exp, size_t size) {
+    cr_assert_not_null(bp, "Expected a value");
+    cr_assert(bp->size == size && !memcmp(bp->content, exp, size), "Wrong value");
+}
+
+/*
+ * Small values are held inline and large ones by reference, and both read
+ * back the same, in a transaction or committed, including values with
+ * embedded zero bytes and a read that copies an inline version.
+ */
+Test(store_suite, inline_values, .init = init, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    char small[] = "sm\0all", large[STORE_INLINE_MAX + 10];
+    memset(large, 'L', sizeof(large));
+    store_set_inline_max(STORE_INLINE_MAX);
+    TRANSACTION *tp = trans_create();
+    store_put(tp, make_key("s", 1), blob_create(small, sizeof(small)));
+    store_put(tp, make_key("l", 1), blob_create(large, sizeof(large)));
+    store_put(tp, make_key("n", 1), NULL);
+    BLOB *bp = NULL;
+    store_get(tp, make_key("s", 1), &bp);
+    assert_blob_equals(bp, small, sizeof(small));
+    blob_unref(bp, "");
+    trans_commit(tp);
+    tp = trans_create();
+    bp = NULL;
+    store_get(tp, make_key("s", 1), &bp);
+    assert_blob_equals(bp, small, sizeof(small));
+    blob_unref(bp, "");
+    bp = NULL;
+    store_get(tp, make_key("l", 1), &bp);
+    assert_blob_equals(bp, large, sizeof(large));
+    blob_unref(bp, "");
+    bp = (BLOB *)1;
+    store_get(tp, make_key("n", 1), &bp);
+    cr_assert_null(bp, "Expected NULL value");
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "Transaction did not commit");
+    assert_number_of_versions(make_key("s", 1), 2);
+    bp = store_get_committed(make_key("s", 1));
+    assert_blob_equals(bp, small, sizeof(small));
+    blob_unref(bp, "");
+    bp = store_get_committed(make_key("l", 1));
+    assert_blob_equals(bp, large, sizeof(large));
+    blob_unref(bp, "");
+    cr_assert_null(store_get_committed(make_key("n", 1)), "Expected NULL value");
+    store_set_inline_max(0);
+}
+
+/*
+ * ADD treats a missing value as 0, leaves a non-numeric value alone, and
+ * takes part in conflicts like a GET followed by a PUT.
+ */
+Test(store_suite, add_counter, .init = init, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    TRANSACTION *tp = trans_create();
+    BLOB *bp;
+    store_add(tp, make_key("c", 1), 5, &bp);
+    assert_blob_equals(bp, "5", 1);
+    blob_unref(bp, "");
+    store_add(tp, make_key("c", 1), -7, &bp);
+    assert_blob_equals(bp, "-2", 2);
+    blob_unref(bp, "");
+    store_put(tp, make_key("s", 1), blob_create("abc", 3));
+    cr_assert_eq(store_add(tp, make_key("s", 1), 1, &bp), TRANS_PENDING, "Transaction aborted");
+    cr_assert_null(bp, "Non-numeric value was added to");
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "Transaction did not commit");
+    bp = store_get_committed(make_key("c", 1));
+    assert_blob_equals(bp, "-2", 2);
+    blob_unref(bp, "");
+    bp = store_get_committed(make_key("s", 1));
+    assert_blob_equals(bp, "abc", 3);
+    blob_unref(bp, "");
+
+    // An older transaction adding after a younger one has read aborts.
+    TRANSACTION *tp1 = trans_create();
+    TRANSACTION *tp2 = trans_create();
+    store_add(tp2, make_key("c", 1), 10, &bp);
+    assert_blob_equals(bp, "8", 1);
+    blob_unref(bp, "");
+    cr_assert_eq(store_add(tp1, make_key("c", 1), 1, &bp), TRANS_ABORTED,
+		 "Older transaction did not abort");
+    cr_assert_null(bp, "Value returned to aborted transaction");
+    trans_commit(tp2);
+    bp = store_get_committed(make_key("c", 1));
+    assert_blob_equals(bp, "8", 1);
+    blob_unref(bp, "");
+}
+
+/*
+ * CAS puts the new value only if the current value is the expected one,
+ * and otherwise returns the current value; either way it takes part in
+ * conflicts like a PUT or a GET.
+ */
+Test(store_suite, compare_and_swap, .init = init, .timeout = 5) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    TRANSACTION *tp = trans_create();
+    int swapped;
+    BLOB *bp;
+    store_cas(tp, make_key("k", 1), NULL, blob_create("1", 1), &swapped, &bp);
+    cr_assert(swapped && bp == NULL, "Swap on absent key failed");
+    store_cas(tp, make_key("k", 1), NULL, blob_create("2", 1), &swapped, &bp);
+    cr_assert(!swapped, "Swap with wrong expected value succeeded");
+    assert_blob_equals(bp, "1", 1);
+    blob_unref(bp, "");
+    store_cas(tp, make_key("k", 1), blob_create("1", 1), blob_create("3", 1), &swapped, &bp);
+    cr_assert(swapped && bp == NULL, "Swap with right expected value failed");
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "Transaction did not commit");
+    bp = store_get_committed(make_key("k", 1));
+    assert_blob_equals(bp, "3", 1);
+    blob_unref(bp, "");
+
+    // A failed swap reads the key, so an older transaction may not write it.
+    TRANSACTION *tp1 = trans_create();
+    TRANSACTION *tp2 = trans_create();
+    store_cas(tp2, make_key("k", 1), blob_create("9", 1), blob_create("4", 1), &swapped, &bp);
+    cr_assert(!swapped, "Swap with wrong expected value succeeded");
+    blob_unref(bp, "");
+    cr_assert_eq(store_put(tp1, make_key("k", 1), blob_create("5", 1)), TRANS_ABORTED,
+		 "Older transaction did not abort");
+    trans_commit(tp2);
+}
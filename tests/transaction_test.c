@@ -7,6 +7,7 @@
 #include "debug.h"
 #include "data.h"
 #include "transaction.h"
+#include "transaction_funcs.h"
 #include "excludes.h"
 
 /* Number of threads we create in multithreaded tests. */
@@ -306,3 +307,122 @@ Test(transaction_suite, many_threads_ref_unref_trans, .init = init, .timeout = 1
     // Check final reference count.
     cr_assert_eq(tp->refcnt, 1, "Final transaction refcount is %d, not 1", tp->refcnt);
 }
+
+Test(transaction_suite, transaction_oldest_pending_test, .init = init, .timeout = 5) {
+#ifdef NO_TRANSACTION
+    cr_assert_fail("Transaction module was not implemented");
+#endif
+    TRANSACTION *tp1 = trans_create();
+    TRANSACTION *tp2 = trans_create();
+    TRANSACTION *tp3 = trans_create();
+    unsigned int id = trans_oldest_pending();
+    cr_assert_eq(id, tp1->id, "Expected oldest pending %d, was %d", tp1->id, id);
+    trans_ref(tp2, "");
+    trans_commit(tp2);
+    id = trans_oldest_pending();
+    cr_assert_eq(id, tp1->id, "Expected oldest pending %d, was %d", tp1->id, id);
+    trans_ref(tp1, "");
+    trans_abort(tp1);
+    id = trans_oldest_pending();
+    cr_assert_eq(id, tp3->id, "Expected oldest pending %d, was %d", tp3->id, id);
+    trans_ref(tp3, "");
+    trans_commit(tp3);
+    id = trans_oldest_pending();
+    cr_assert_eq(id, tp3->id + 1, "Expected oldest pending %d, was %d", tp3->id + 1, id);
+    trans_unref(tp1, "");
+    trans_unref(tp2, "");
+    trans_unref(tp3, "");
+}
+
+Test(transaction_suite, transaction_snapshot_horizon_test, .init = init, .timeout = 5) {
+#ifdef NO_TRANSACTION
+    cr_assert_fail("Transaction module was not implemented");
+#endif
+    TRANSACTION *tp1 = trans_create();
+    unsigned int id1 = tp1->id;
+    TRANS_SNAPSHOT *ssp1 = trans_snapshot_create();
+    cr_assert_eq(ssp1->id, id1, "Expected snapshot %d, was %d", id1, ssp1->id);
+    trans_commit(tp1);
+    TRANS_SNAPSHOT *ssp2 = trans_snapshot_create();
+    cr_assert_eq(ssp2->id, id1 + 1, "Expected snapshot %d, was %d", id1 + 1, ssp2->id);
+    unsigned int id = trans_horizon();
+    cr_assert_eq(id, ssp1->id, "Expected horizon %d, was %d", ssp1->id, id);
+    trans_snapshot_release(ssp1);
+    id = trans_horizon();
+    cr_assert_eq(id, ssp2->id, "Expected horizon %d, was %d", ssp2->id, id);
+    trans_snapshot_release(ssp2);
+    TRANSACTION *tp2 = trans_create();
+    unsigned int id2 = tp2->id;
+    trans_commit(tp2);
+    id = trans_horizon();
+    cr_assert_eq(id, id2 + 1, "Expected horizon %d, was %d", id2 + 1, id);
+}
+
+/* Records the calls made to commit_callback(). */
+struct commit_result {
+    int calls;
+    TRANS_STATUS status;
+};
+
+static void commit_callback(TRANS_STATUS status, void *arg) {
+    struct commit_result *rp = arg;
+    rp->calls++;
+    rp->status = status;
+}
+
+Test(transaction_suite, transaction_async_commit_test, .init = init, .timeout = 5) {
+#ifdef NO_TRANSACTION
+    cr_assert_fail("Transaction module was not implemented");
+#endif
+    struct commit_result res = { 0 };
+    TRANSACTION *tp = trans_create();
+    trans_ref(tp, "");
+    TRANS_STATUS st = trans_commit_async(tp, commit_callback, &res);
+    cr_assert_eq(st, TRANS_COMMITTED, "Expected status %d, was %d", TRANS_COMMITTED, st);
+    cr_assert_eq(res.calls, 0, "Expected no callback, got %d", res.calls);
+    trans_unref(tp, "");
+}
+
+Test(transaction_suite, transaction_async_dependent_commit_test, .init = init, .timeout = 5) {
+#ifdef NO_TRANSACTION
+    cr_assert_fail("Transaction module was not implemented");
+#endif
+    struct commit_result res = { 0 };
+    TRANSACTION *tp1 = trans_create();
+    TRANSACTION *tp2 = trans_create();
+    trans_add_dependency(tp2, tp1);
+    trans_ref(tp2, "");
+    TRANS_STATUS st = trans_commit_async(tp2, commit_callback, &res);
+    cr_assert_eq(st, TRANS_PENDING, "Expected status %d, was %d", TRANS_PENDING, st);
+    cr_assert_eq(res.calls, 0, "Expected no callback, got %d", res.calls);
+    cr_assert_eq(tp2->status, TRANS_PENDING, "Expected status %d, was %d", TRANS_PENDING, tp2->status);
+    trans_commit(tp1);
+    cr_assert_eq(res.calls, 1, "Expected one callback, got %d", res.calls);
+    cr_assert_eq(res.status, TRANS_COMMITTED, "Expected status %d, was %d", TRANS_COMMITTED, res.status);
+    cr_assert_eq(tp2->status, TRANS_COMMITTED, "Expected status %d, was %d", TRANS_COMMITTED, tp2->status);
+    trans_unref(tp2, "");
+}
+
+Test(transaction_suite, transaction_async_chain_abort_test, .init = init, .timeout = 5) {
+#ifdef NO_TRANSACTION
+    cr_assert_fail("Transaction module was not implemented");
+#endif
+    struct commit_result res2 = { 0 }, res3 = { 0 };
+    TRANSACTION *tp1 = trans_create();
+    TRANSACTION *tp2 = trans_create();
+    TRANSACTION *tp3 = trans_create();
+    trans_add_dependency(tp2, tp1);
+    trans_add_dependency(tp3, tp2);
+    trans_ref(tp3, "");
+    TRANS_STATUS st = trans_commit_async(tp3, commit_callback, &res3);
+    cr_assert_eq(st, TRANS_PENDING, "Expected status %d, was %d", TRANS_PENDING, st);
+    st = trans_commit_async(tp2, commit_callback, &res2);
+    cr_assert_eq(st, TRANS_PENDING, "Expected status %d, was %d", TRANS_PENDING, st);
+    // Aborting tp1 aborts tp2, whose abort in turn aborts tp3.
+    trans_abort(tp1);
+    cr_assert_eq(res2.calls, 1, "Expected one callback, got %d", res2.calls);
+    cr_assert_eq(res2.status, TRANS_ABORTED, "Expected status %d, was %d", TRANS_ABORTED, res2.status);
+    cr_assert_eq(res3.calls, 1, "Expected one callback, got %d", res3.calls);
+    cr_assert_eq(res3.status, TRANS_ABORTED, "Expected status %d, was %d", TRANS_ABORTED, res3.status);
+    trans_unref(tp3, "");
+}
@@ -0,0 +1,466 @@
+#include <criterion/criterion.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "debug.h"
+#include "store.h"
+#include "store_funcs.h"
+#include "transaction_funcs.h"
+#include "wal.h"
+#include "excludes.h"
+
+/* Number of keys we use in some tests. */
+#define NKEYS (100)
+
+/* Number of threads, and commits per thread, in concurrent tests. */
+#define NWRITERS (4)
+#define NCOMMITS (200)
+
+/* Number of keys in a checkpoint loaded by several threads. */
+#define NLOADKEYS (3 * CKPT_STRIDE + 10)
+
+/*
+ * Logs go in /var/tmp rather than /tmp, which is often a memory file
+ * system on which syncing costs nothing.
+ */
+static char log_name[64];
+static char ckpt_name[80];
+static char prev_name[80];
+
+static void remove_files() {
+    unlink(log_name);
+    unlink(ckpt_name);
+    unlink(prev_name);
+}
+
+static void init() {
+    snprintf(log_name, sizeof(log_name), "/var/tmp/xacto_wal_test.%d", getpid());
+    snprintf(ckpt_name, sizeof(ckpt_name), "%s.ckpt", log_name);
+    snprintf(prev_name, sizeof(prev_name), "%s.prev", log_name);
+    remove_files();
+    trans_init();
+    store_init();
+}
+
+static void fini() {
+    remove_files();
+}
+
+/*
+ * Simulate a restart: throw away the store and transaction manager
+ * and bring them back up from the log.
+ */
+static void restart(WAL_SYNC policy) {
+    wal_close();
+    store_fini();
+    trans_fini();
+    trans_init();
+    store_init();
+    cr_assert_eq(wal_open(log_name, policy, 10), 0, "Could not open log");
+}
+
+static KEY *make_key(char *content) {
+    return key_create(blob_create(content, strlen(content)));
+}
+
+static void assert_value(char *key, char *exp) {
+    BLOB *bp = store_get_committed(make_key(key));
+    if(exp == NULL) {
+	cr_assert_null(bp, "Value found for key %s", key);
+	return;
+    }
+    cr_assert_not_null(bp, "No value for key %s", key);
+    cr_assert(bp->size == strlen(exp) && !memcmp(bp->content, exp, bp->size),
+	      "Wrong value for key %s", key);
+    blob_unref(bp, "");
+}
+
+/*
+ * Committed values survive a restart, and those of aborted or unfinished
+ * transactions do not.
+ */
+Test(wal_suite, recover, .init = init, .fini = fini, .timeout = 10) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    cr_assert_eq(wal_open(log_name, WAL_SYNC_COMMIT, 0), 0, "Could not open log");
+    char key[16], value[16];
+    TRANSACTION *tp = trans_create();
+    for(int i = 0; i < NKEYS; i++) {
+	snprintf(key, sizeof(key), "key%d", i);
+	snprintf(value, sizeof(value), "value%d", i);
+	store_put(tp, make_key(key), blob_create(value, strlen(value)));
+    }
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "Transaction did not commit");
+    tp = trans_create();
+    store_put(tp, make_key("key0"), blob_create("new", 3));
+    store_put(tp, make_key("key1"), NULL);
+    store_put(tp, make_key("key0"), blob_create("newer", 5));
+    trans_commit(tp);
+    tp = trans_create();
+    store_put(tp, make_key("key2"), blob_create("aborted", 7));
+    trans_abort(tp);
+    tp = trans_create();
+    store_put(tp, make_key("key3"), blob_create("unfinished", 10));
+    restart(WAL_SYNC_COMMIT);
+    assert_value("key0", "newer");
+    assert_value("key1", NULL);
+    assert_value("key2", "value2");
+    assert_value("key3", "value3");
+    assert_value("key99", "value99");
+    WAL_STATS stats;
+    wal_get_stats(&stats);
+    cr_assert_eq(stats.recovered, 2, "Wrong number of records recovered, was %lu, expected 2",
+		 stats.recovered);
+    wal_close();
+}
+
+/*
+ * A record cut short by a crash is discarded, along with anything after it,
+ * and the log can be appended to afterwards.
+ */
+Test(wal_suite, torn_record, .init = init, .fini = fini, .timeout = 10) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    cr_assert_eq(wal_open(log_name, WAL_SYNC_NONE, 0), 0, "Could not open log");
+    TRANSACTION *tp = trans_create();
+    store_put(tp, make_key("A"), blob_create("1", 1));
+    trans_commit(tp);
+    tp = trans_create();
+    store_put(tp, make_key("B"), blob_create("2", 1));
+    trans_commit(tp);
+    wal_close();
+    int fd = open(log_name, O_WRONLY);
+    off_t size = lseek(fd, 0, SEEK_END);
+    cr_assert_eq(ftruncate(fd, size - 1), 0, "Could not truncate log");
+    close(fd);
+    restart(WAL_SYNC_NONE);
+    assert_value("A", "1");
+    assert_value("B", NULL);
+    WAL_STATS stats;
+    wal_get_stats(&stats);
+    cr_assert_eq(stats.recovered, 1, "Wrong number of records recovered, was %lu, expected 1",
+		 stats.recovered);
+    cr_assert(stats.discarded > 0, "Torn record was not discarded");
+    tp = trans_create();
+    store_put(tp, make_key("C"), blob_create("3", 1));
+    trans_commit(tp);
+    restart(WAL_SYNC_NONE);
+    assert_value("A", "1");
+    assert_value("C", "3");
+    wal_close();
+}
+
+static void *commit_thread(void *arg) {
+    int n = (int)(long)arg;
+    char key[32];
+    for(int i = 0; i < NCOMMITS; i++) {
+	snprintf(key, sizeof(key), "t%d:%d", n, i);
+	TRANSACTION *tp = trans_create();
+	store_put(tp, make_key(key), blob_create(key, strlen(key)));
+	trans_commit(tp);
+    }
+    return NULL;
+}
+
+/*
+ * Under each durability policy, every commit made by concurrent threads is
+ * logged once and survives a restart.
+ */
+Test(wal_suite, concurrent_commits, .init = init, .fini = fini, .timeout = 30) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    WAL_SYNC policies[] = { WAL_SYNC_COMMIT, WAL_SYNC_INTERVAL, WAL_SYNC_NONE };
+    for(int p = 0; p < 3; p++) {
+	unlink(log_name);
+	cr_assert_eq(wal_open(log_name, policies[p], 10), 0, "Could not open log");
+	pthread_t tids[NWRITERS];
+	for(int i = 0; i < NWRITERS; i++)
+	    pthread_create(&tids[i], NULL, commit_thread, (void *)(long)i);
+	for(int i = 0; i < NWRITERS; i++)
+	    pthread_join(tids[i], NULL);
+	WAL_STATS stats;
+	wal_get_stats(&stats);
+	cr_assert_eq(stats.commits, NWRITERS * NCOMMITS, "Wrong number of commits logged");
+	restart(policies[p]);
+	wal_get_stats(&stats);
+	cr_assert_eq(stats.recovered, NWRITERS * NCOMMITS,
+		     "Wrong number of records recovered, was %lu, expected %d",
+		     stats.recovered, NWRITERS * NCOMMITS);
+	char key[32];
+	snprintf(key, sizeof(key), "t%d:%d", NWRITERS - 1, NCOMMITS - 1);
+	assert_value("t0:0", "t0:0");
+	assert_value(key, key);
+	wal_close();
+	store_fini();
+	trans_fini();
+	trans_init();
+	store_init();
+    }
+}
+
+static volatile int durable_ret = 1;
+
+static void durable_done(int ret, void *arg) {
+    durable_ret = ret;
+}
+
+/*
+ * Under WAL_SYNC_COMMIT, committing only appends the record, and waiting
+ * for it to be durable without blocking leaves the sync to the log
+ * thread, which ends the wait once it is done.
+ */
+Test(wal_suite, durable_wait, .init = init, .fini = fini, .timeout = 10) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    cr_assert_eq(wal_open(log_name, WAL_SYNC_COMMIT, 0), 0, "Could not open log");
+    TRANSACTION *tp = trans_create();
+    store_put(tp, make_key("A"), blob_create("1", 1));
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "Transaction did not commit");
+    WAL_STATS stats;
+    wal_get_stats(&stats);
+    cr_assert_eq(stats.syncs, 0, "Log was synced by the commit");
+    cr_assert_eq(wal_wait_durable(durable_done, NULL), 1, "Wait did not go to the log thread");
+    while(durable_ret == 1)
+	usleep(1000);
+    cr_assert_eq(durable_ret, 0, "Wait ended with %d", durable_ret);
+    wal_get_stats(&stats);
+    cr_assert_eq(stats.syncs, 1, "Log was synced %lu times, expected 1", stats.syncs);
+    cr_assert_eq(wal_wait_durable(durable_done, NULL), 0, "Durable log was waited for");
+    cr_assert_eq(wal_wait_durable(NULL, NULL), 0, "Durable log was waited for");
+    tp = trans_create();
+    store_put(tp, make_key("B"), blob_create("2", 1));
+    trans_commit(tp);
+    cr_assert_eq(wal_wait_durable(NULL, NULL), 0, "Blocking wait failed");
+    wal_get_stats(&stats);
+    cr_assert_eq(stats.syncs, 2, "Log was synced %lu times, expected 2", stats.syncs);
+    wal_close();
+}
+
+/*
+ * Under WAL_SYNC_NONE, committing does not write either: the wait before
+ * the commit is acknowledged goes to the log thread, which writes the
+ * record without syncing it.
+ */
+Test(wal_suite, written_wait, .init = init, .fini = fini, .timeout = 10) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    cr_assert_eq(wal_open(log_name, WAL_SYNC_NONE, 0), 0, "Could not open log");
+    TRANSACTION *tp = trans_create();
+    store_put(tp, make_key("A"), blob_create("1", 1));
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "Transaction did not commit");
+    durable_ret = 1;
+    int ret = wal_wait_durable(durable_done, NULL);
+    cr_assert(ret == 0 || ret == 1, "Wait failed");
+    while(ret == 1 && durable_ret == 1)
+	usleep(1000);
+    cr_assert(ret == 0 || durable_ret == 0, "Wait ended with %d", durable_ret);
+    WAL_STATS stats;
+    wal_get_stats(&stats);
+    cr_assert_eq(stats.writes, 1, "Log was written %lu times, expected 1", stats.writes);
+    cr_assert_eq(stats.syncs, 0, "Log was synced");
+    cr_assert_eq(wal_wait_durable(NULL, NULL), 0, "Written log was waited for");
+    wal_close();
+}
+
+/*
+ * After a checkpoint, a restart loads the checkpoint and replays only what
+ * was committed since.  This also holds if a crash leaves the old log behind.
+ */
+Test(wal_suite, checkpoint_recover, .init = init, .fini = fini, .timeout = 10) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    cr_assert_eq(wal_open(log_name, WAL_SYNC_COMMIT, 0), 0, "Could not open log");
+    char key[16], value[16];
+    TRANSACTION *tp = trans_create();
+    for(int i = 0; i < NKEYS; i++) {
+	snprintf(key, sizeof(key), "key%d", i);
+	snprintf(value, sizeof(value), "value%d", i);
+	store_put(tp, make_key(key), blob_create(value, strlen(value)));
+    }
+    trans_commit(tp);
+    tp = trans_create();
+    store_put(tp, make_key("key1"), NULL);
+    trans_commit(tp);
+    cr_assert_eq(wal_checkpoint(), 0, "Checkpoint failed");
+    cr_assert_eq(access(prev_name, F_OK), -1, "Old log was not removed");
+    tp = trans_create();
+    store_put(tp, make_key("key0"), blob_create("after", 5));
+    store_put(tp, make_key("key2"), NULL);
+    trans_commit(tp);
+    restart(WAL_SYNC_COMMIT);
+    WAL_STATS stats;
+    wal_get_stats(&stats);
+    cr_assert_eq(stats.load.entries, NKEYS - 1, "Wrong number of keys loaded, was %lu, expected %d",
+		 stats.load.entries, NKEYS - 1);
+    cr_assert_eq(stats.recovered, 1, "Wrong number of records recovered, was %lu, expected 1",
+		 stats.recovered);
+    assert_value("key0", "after");
+    assert_value("key1", NULL);
+    assert_value("key2", NULL);
+    assert_value("key99", "value99");
+
+    // Simulate a crash after the log was moved aside, but before the old
+    // log was dropped: the old log is replayed as well.
+    wal_close();
+    cr_assert_eq(rename(log_name, prev_name), 0, "Could not rename log");
+    restart(WAL_SYNC_COMMIT);
+    wal_get_stats(&stats);
+    cr_assert_eq(stats.recovered, 1, "Wrong number of records recovered, was %lu, expected 1",
+		 stats.recovered);
+    assert_value("key0", "after");
+    assert_value("key2", NULL);
+    tp = trans_create();
+    store_put(tp, make_key("key3"), blob_create("later", 5));
+    trans_commit(tp);
+    cr_assert_eq(wal_checkpoint(), 0, "Checkpoint failed");
+    cr_assert_eq(access(prev_name, F_OK), -1, "Old log was not removed");
+    // That checkpoint found the old log still there, so it kept the current one.
+    restart(WAL_SYNC_COMMIT);
+    wal_get_stats(&stats);
+    cr_assert_eq(stats.recovered, 1, "Wrong number of records recovered, was %lu, expected 1",
+		 stats.recovered);
+    assert_value("key0", "after");
+    assert_value("key3", "later");
+    assert_value("key4", "value4");
+    wal_close();
+}
+
+/* Number of keys in the store while a checkpoint is taken under load. */
+#define NCKPTKEYS (20000)
+
+/* Most pairs each writer commits while the checkpoint is taken. */
+#define NPAIRS (4000)
+
+static volatile int stop_writers;
+
+/*
+ * Commit pairs of keys at the two ends of the key space, so that a
+ * checkpoint reading keys in order is likely to see one of a pair but not
+ * the other.  Returns the number of pairs committed.
+ */
+static void *pair_thread(void *arg) {
+    int n = (int)(long)arg;
+    char key[32];
+    long i;
+    for(i = 0; i < NPAIRS && !stop_writers; i++) {
+	TRANSACTION *tp = trans_create();
+	snprintf(key, sizeof(key), "a%d:%ld", n, i);
+	store_put(tp, make_key(key), blob_create("1", 1));
+	snprintf(key, sizeof(key), "z%d:%ld", n, i);
+	store_put(tp, make_key(key), blob_create("1", 1));
+	trans_commit(tp);
+    }
+    return (void *)i;
+}
+
+static void copy_file(char *from, char *to) {
+    int in = open(from, O_RDONLY);
+    cr_assert_neq(in, -1, "Could not open %s", from);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    cr_assert_neq(out, -1, "Could not create %s", to);
+    char buf[65536];
+    ssize_t n;
+    while((n = read(in, buf, sizeof(buf))) > 0)
+	cr_assert_eq(write(out, buf, n), n, "Could not copy %s", from);
+    close(in);
+    close(out);
+}
+
+/*
+ * A checkpoint taken under WAL_SYNC_INTERVAL while transactions commit is
+ * not put in place before the log records of the transactions it has seen
+ * are on disk.  A crash right after the checkpoint, which loses whatever
+ * the log had not written yet, must not leave part of a transaction.
+ */
+Test(wal_suite, checkpoint_interval, .init = init, .fini = fini, .timeout = 30) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    // An interval long enough that the log is only written by the checkpoint.
+    cr_assert_eq(wal_open(log_name, WAL_SYNC_INTERVAL, 60000), 0, "Could not open log");
+    char key[32];
+    TRANSACTION *tp = trans_create();
+    for(int i = 0; i < NCKPTKEYS; i++) {
+	snprintf(key, sizeof(key), "m%d", i);
+	store_put(tp, make_key(key), blob_create(key, strlen(key)));
+    }
+    trans_commit(tp);
+    pthread_t tids[2];
+    long npairs[2];
+    stop_writers = 0;
+    for(int i = 0; i < 2; i++)
+	pthread_create(&tids[i], NULL, pair_thread, (void *)(long)i);
+    cr_assert_eq(wal_checkpoint(), 0, "Checkpoint failed");
+    stop_writers = 1;
+    for(int i = 0; i < 2; i++)
+	pthread_join(tids[i], (void **)&npairs[i]);
+
+    // Keep what a crash at this point would leave, then put it back.
+    char saved[96];
+    snprintf(saved, sizeof(saved), "%s.saved", log_name);
+    copy_file(log_name, saved);
+    wal_close();
+    cr_assert_eq(rename(saved, log_name), 0, "Could not restore log");
+    restart(WAL_SYNC_INTERVAL);
+    for(int n = 0; n < 2; n++) {
+	for(long i = 0; i < npairs[n]; i++) {
+	    snprintf(key, sizeof(key), "a%d:%ld", n, i);
+	    BLOB *a = store_get_committed(make_key(key));
+	    snprintf(key, sizeof(key), "z%d:%ld", n, i);
+	    BLOB *z = store_get_committed(make_key(key));
+	    cr_assert((a == NULL) == (z == NULL), "Only part of transaction %d:%ld recovered", n, i);
+	    if(a != NULL)
+		blob_unref(a, "");
+	    if(z != NULL)
+		blob_unref(z, "");
+	}
+    }
+    assert_value("m0", "m0");
+    wal_close();
+}
+
+/*
+ * A checkpoint of more than one chunk of entries loads the same whether
+ * one thread or several split the chunks between them.
+ */
+Test(wal_suite, checkpoint_load_threads, .init = init, .fini = fini, .timeout = 10) {
+#ifdef NO_STORE
+    cr_assert_fail("Store was not implemented");
+#endif
+    cr_assert_eq(wal_open(log_name, WAL_SYNC_NONE, 0), 0, "Could not open log");
+    char key[32];
+    TRANSACTION *tp = trans_create();
+    for(int i = 0; i < NLOADKEYS; i++) {
+	snprintf(key, sizeof(key), "load%d", i);
+	store_put(tp, make_key(key), blob_create(key, strlen(key)));
+    }
+    trans_commit(tp);
+    cr_assert_eq(wal_checkpoint(), 0, "Checkpoint failed");
+    wal_close();
+    int nthreads[] = { 1, 4 };
+    for(int t = 0; t < 2; t++) {
+	store_fini();
+	trans_fini();
+	trans_init();
+	store_init();
+	CKPT_STATS cs;
+	cr_assert_eq(ckpt_load(ckpt_name, nthreads[t], &cs), 0, "Could not load checkpoint");
+	cr_assert_eq(cs.threads, nthreads[t], "Wrong number of threads, was %d, expected %d",
+		     cs.threads, nthreads[t]);
+	cr_assert_eq(cs.entries, NLOADKEYS, "Wrong number of keys loaded, was %lu, expected %d",
+		     cs.entries, NLOADKEYS);
+	assert_value("load0", "load0");
+	snprintf(key, sizeof(key), "load%d", NLOADKEYS - 1);
+	assert_value(key, key);
+    }
+}